@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+/* Every allocation is aligned for pointers and doubles */
+#define ARENA_ALIGN 8
+
+typedef struct arena_block_t {
+	struct arena_block_t *next;
+	size_t used;
+	size_t size;
+	char data[];
+} arena_block_t;
+
+/*
+ * Bump allocator over a list of blocks. Nothing is freed on its own, the
+ * whole arena goes at once with arena_free().
+ */
+typedef struct {
+	arena_block_t *blocks;
+	size_t total;
+} arena_t;
+
+arena_t *arena_create(void);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t size);
+void arena_free(arena_t *arena);
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stdint.h>
+
 #include "lexer.h"
+#include "value.h"
 
-#define DEFAULT_STMTS_SIZE 512
 #define DEFAULT_ARGS_SIZE 255
+/* Starting capacity of the arrays in the AST, they grow in the arena */
+#define DEFAULT_NODES_SIZE 4
 
 /*
 expression → equality ;
@@ -14,7 +18,10 @@ term       → factor ( ( "-" | "+" ) factor )* ;
 factor     → unary ( ( "/" | "*" ) unary )* ;
 unary      → ( "!" | "-" ) unary | primary ;
 primary    → NUMBER | STRING | "true" | "false" | "nil" | "(" expression ")" ;
-statement      → exprStmt | ifStmt | printStmt | block ;
+statement      → exprStmt | forStmt | ifStmt | printStmt | block ;
+forStmt        → "for" "(" ( varDecl | exprStmt | ";" ) expression? ";" expression? ")"
+                 statement
+               | "for" IDENTIFIER "in" expression ( ".." | "..=" ) expression statement ;
 ifStmt         → "if" "(" expression ")" statement ( "else" statement )? ;
 block          → "{" declaration* "}" ;
 */
@@ -34,14 +41,6 @@ typedef enum {
 	EXPR_VARIABLE,
 } expr_type_t;
 
-typedef enum {
-	VAL_BOOL,
-	VAL_NIL,
-	VAL_NUMBER,
-	VAL_STRING,
-	VAL_FN,
-} value_type_t;
-
 typedef enum {
 	STMT_BLOCK,
 	STMT_CLASS,
@@ -52,6 +51,8 @@ typedef enum {
 	STMT_VAR,
 	STMT_WHILE,
 	STMT_RETURN,
+	STMT_FOR,
+	STMT_RANGE,
 } stmt_type_t;
 
 typedef enum {
@@ -60,9 +61,7 @@ typedef enum {
 } fn_type_t;
 
 typedef struct expr_t expr_t;
-typedef struct value_t value_t;
 typedef struct stmt_t stmt_t;
-typedef struct fn_t fn_t;
 
 typedef struct {
 	expr_t **arguments;
@@ -70,36 +69,30 @@ typedef struct {
 	int capacity;
 } arg_array_t;
 
-typedef struct {
-	value_t **arguments;
-	int length;
-	int capacity;
-} val_array_t;
-
 typedef struct {
 	stmt_t **statements;
 	int length;
 	int capacity;
 } stmt_array_t;
 
-struct value_t {
-	value_type_t type;
-	union {
-		int boolean;
-		double number;
-		char *string;
-		fn_t *function;
-	} as;
-};
-
 typedef struct ht_t ht_t;
+typedef struct scope_t scope_t;
+typedef struct interpreter_t interpreter_t;
+typedef struct flat_t flat_t;
+/* Index of a node in a flat_t */
+typedef uint32_t node_t;
 
 struct fn_t {
 	fn_type_t type;
 	int arity;
-	ht_t *env;
-	stmt_t *stmt;
-	value_t *(*call)(struct fn_t *stmt, val_array_t *arguments, ht_t *env);
+	scope_t *env;
+	/* Declaration of a custom function */
+	flat_t *flat;
+	node_t decl;
+	/* Last collection that reached it */
+	int marked;
+	/* Takes over the arguments, arity of them */
+	value_t (*call)(interpreter_t *interp, struct fn_t *fn, value_t *arguments, scope_t *env);
 };
 
 struct expr_t {
@@ -175,6 +168,11 @@ struct stmt_t {
 			token_t name;
 			array_t *params;
 			struct stmt_t *body;
+			/* NULL body is parsed from [start, end) of source on first call */
+			source_t *source;
+			size_t start;
+			size_t end;
+			int line;
 		} function;
 		struct {
 			expr_t *condition;
@@ -196,17 +194,32 @@ struct stmt_t {
 			expr_t *condition;
 			struct stmt_t *body;
 		} _while;
+		struct {
+			/* Any of the three can be NULL */
+			struct stmt_t *initializer;
+			expr_t *condition;
+			expr_t *increment;
+			struct stmt_t *body;
+		} _for;
+		/* for name in start..end or start..=end */
+		struct {
+			token_t name;
+			expr_t *start;
+			expr_t *end;
+			token_type_t operator;
+			struct stmt_t *body;
+		} range;
 	} as;
 };
 
-expr_t *create_binary_expr(token_t *operator, expr_t *left, expr_t *right);
-expr_t *create_unary_expr(token_t *operator, expr_t *right);
-expr_t *create_literal_expr(token_t *token);
-expr_t *create_grouping_expr(expr_t *expression);
-expr_t *create_variable_expr(token_t *name);
-expr_t *create_assign_expr(expr_t *name, expr_t *value);
-expr_t *create_logical_expr(token_t *operator, expr_t *left, expr_t *right);
-expr_t *create_call_expr(expr_t *callee, token_t *paren, arg_array_t *args);
+expr_t *create_binary_expr(arena_t *arena, token_t *operator, expr_t *left, expr_t *right);
+expr_t *create_unary_expr(arena_t *arena, token_t *operator, expr_t *right);
+expr_t *create_literal_expr(arena_t *arena, token_t *token);
+expr_t *create_grouping_expr(arena_t *arena, expr_t *expression);
+expr_t *create_variable_expr(arena_t *arena, token_t *name);
+expr_t *create_assign_expr(arena_t *arena, expr_t *name, expr_t *value);
+expr_t *create_logical_expr(arena_t *arena, token_t *operator, expr_t *left, expr_t *right);
+expr_t *create_call_expr(arena_t *arena, expr_t *callee, token_t *paren, arg_array_t *args);
 void print_ast(expr_t *expr);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int bench_lex(int argc, char **argv);
+int bench_lex_parallel(int argc, char **argv);
+int bench_frontend(int argc, char **argv);
+int bench_cache(int argc, char **argv);
+int bench_lsp(int argc, char **argv);
+int bench_eval(int argc, char **argv);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "flat.h"
+#include "lexer.h"
+
+#ifndef VERSION
+#define VERSION "dev"
+#endif
+
+#define CACHE_MAGIC "RDC"
+/* Bumped whenever what is written changes */
+#define CACHE_FORMAT 6
+
+/*
+ * Start of a cached program, followed by its pools in the order of the
+ * counts here, each starting on 8 bytes. Pointers in the pools are written
+ * as offsets: constant strings into the strings section, names and
+ * functions into the symbols section, a list of offsets of the names as
+ * string_t in strings.
+ */
+typedef struct {
+	char magic[4];
+	uint32_t format;
+	/* cache_key() of the source it was parsed from */
+	uint64_t key;
+	/* Hash of everything after the header, as written */
+	uint64_t checksum;
+	uint64_t length;
+	uint32_t root;
+	uint32_t exprs;
+	uint32_t stmts;
+	uint32_t lists;
+	uint32_t constants;
+	uint32_t names;
+	uint32_t functions;
+	uint32_t scopes;
+	uint32_t symbols;
+	uint64_t strings;
+} cache_header_t;
+
+/* A scope around the node cache_load() is checking, innermost first */
+typedef struct cache_scope_t {
+	struct cache_scope_t *enclosing;
+	int slots;
+} cache_scope_t;
+
+/* Nodes of a loaded program met so far by cache_nodes_valid() */
+typedef struct {
+	flat_t *flat;
+	char *exprs;
+	char *stmts;
+	char *functions;
+} cache_walk_t;
+
+/* Set by --no-cache */
+extern int cache_disabled;
+
+uint64_t cache_key(source_t *source);
+int cache_path(source_t *source, char *path, int create);
+flat_t *cache_load(source_t *source, node_t *root);
+int cache_store(source_t *source, flat_t *flat, node_t root);
+int cache_clear(void);
+int cache_command(int argc, char **argv);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef DIAGNOSTIC_H
+#define DIAGNOSTIC_H
+
+#include <stddef.h>
+
+#define DEFAULT_DIAGNOSTICS_SIZE 8
+
+/*
+ * An error found before running, kept instead of printed for rd lsp.
+ * start and length are the bytes of the source it is about, length is 0
+ * when only the line is known.
+ */
+typedef struct {
+	int line;
+	size_t start;
+	int length;
+	char *message;
+} diagnostic_t;
+
+typedef struct {
+	diagnostic_t *items;
+	int length;
+	int capacity;
+} diagnostics_t;
+
+void diagnostic_add(diagnostics_t *diagnostics, int line, size_t start, int length,
+		const char *message);
+void diagnostics_clear(diagnostics_t *diagnostics);
+void diagnostics_free(diagnostics_t *diagnostics);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include "diagnostic.h"
+#include "lexer.h"
+
+#define DEFAULT_CHUNKS_SIZE 64
+
+/*
+ * A top level declaration of a document, from its first token up to the
+ * first token of the next, the first one also holds what comes before.
+ * Its diagnostics are kept with it so an edit elsewhere leaves them be.
+ */
+typedef struct {
+	size_t start;
+	size_t end;
+	/* Line at start */
+	int line;
+	diagnostics_t diagnostics;
+} chunk_t;
+
+/*
+ * A file open in rd lsp. Each edit parses again the chunks it touches and
+ * only those, from the one before it up to where the chunks parsed line up
+ * with the old ones again, which are then kept as they were.
+ */
+typedef struct {
+	char *text;
+	size_t length;
+	size_t capacity;
+	/* Over text, for the lexer */
+	source_t source;
+	chunk_t *chunks;
+	int chunks_length;
+	int chunks_capacity;
+	/* Chunks the last edit parsed, the rest were kept */
+	int reparsed;
+} document_t;
+
+document_t *document_open(const char *text, size_t length);
+void document_edit(document_t *document, size_t start, size_t end, const char *text,
+		size_t length);
+size_t document_line(document_t *document, int line);
+int document_line_of(document_t *document, size_t offset);
+void document_free(document_t *document);
+
+#endif
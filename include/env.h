@@ -4,19 +4,43 @@
 #include "ast.h"
 #include "lexer.h"
 
+/*
+ * Names are interned symbols, a NULL name marks a free slot. Values put
+ * in are taken over, ht_get() lends out the one held.
+ */
 struct ht_t {
-	char *name;
+	symbol_t *name;
 	value_t value;
 	struct ht_t *enclosing;
 };
 
 #define DEFAULT_HT_SIZE 500
 
+/*
+ * Locals of one block or call, in the slots resolve() gave them. Freed
+ * when the block is left unless a function declared in it, or in a scope
+ * inside it, may still refer to it. scope_set() takes over the value,
+ * scope_get() gives back a copy.
+ */
+struct scope_t {
+	struct scope_t *enclosing;
+	int length;
+	int captured;
+	/* Last collection that reached it */
+	int marked;
+	value_t slots[];
+};
+
 ht_t *ht_init(ht_t *env);
-void ht_add(ht_t *ht, char *name, value_t *value);
-value_t *ht_get(ht_t *ht, token_t *name, int check_enclosing);
-void ht_replace(ht_t *ht, char *name, value_t *value);
-void ht_assign(ht_t *ht, token_t *name, value_t *value);
+void ht_add(ht_t *ht, symbol_t *name, value_t value);
+value_t *ht_get(ht_t *ht, symbol_t *name, int check_enclosing);
+void ht_replace(ht_t *ht, symbol_t *name, value_t value);
+int ht_assign(ht_t *ht, symbol_t *name, value_t value);
 void ht_free(ht_t *ht);
+scope_t *scope_new(scope_t *enclosing, int length);
+value_t scope_get(scope_t *scope, int slot);
+void scope_set(scope_t *scope, int slot, value_t value);
+void scope_clear(scope_t *scope);
+void scope_free(scope_t *scope);
 
 #endif
@@ -0,0 +1,132 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include <stdint.h>
+
+#include "ast.h"
+
+#define DEFAULT_FLAT_SIZE 256
+
+/*
+ * An expression in 12 bytes, what a and b hold depends on type:
+ *   EXPR_LITERAL   a constant
+ *   EXPR_VARIABLE  a name
+ *   EXPR_ASSIGN    a name, b value
+ *   EXPR_BINARY    a left, b right, op
+ *   EXPR_LOGICAL   a left, b right, op
+ *   EXPR_UNARY     a right, op
+ *   EXPR_CALL      a callee, count arguments from lists[b]
+ * Groupings only matter when printing and are not kept. A variable or
+ * assignment resolve() bound to a local has count set to how many scopes
+ * up it is plus one, and a its slot there instead of a name.
+ */
+typedef struct {
+	uint8_t type;
+	uint8_t op;
+	uint16_t count;
+	node_t a;
+	node_t b;
+} flat_expr_t;
+
+/*
+ *   STMT_BLOCK   b statements from lists[a], c slots of its scope
+ *   STMT_EXPR    a expression
+ *   STMT_PRINT   a expression
+ *   STMT_VAR     a name, b initializer, c set when a is a local slot instead
+ *   STMT_IF      a condition, b then, c else
+ *   STMT_WHILE   a condition, b body
+ *   STMT_FUN     a function, b its slot plus one when it is a local
+ *   STMT_RETURN  a value
+ *   STMT_FOR     a initializer, b condition, lists[c] increment and
+ *                lists[c + 1] body
+ *   STMT_RANGE   a start, b end, lists[c] name and lists[c + 1] body, op
+ *                is .. or ..=
+ * A block without declarations of its own has no scope, c is 0. A for
+ * loop has a scope of one slot when its initializer declares a variable,
+ * a range loop always does, for its variable.
+ */
+typedef struct {
+	uint8_t type;
+	uint8_t op;
+	node_t a;
+	node_t b;
+	node_t c;
+} flat_stmt_t;
+
+/*
+ * A function declaration, arity names from lists[params]. body is 0 until
+ * a lazy one is parsed from [start, end) of source by flat_body(), scope
+ * is then what resolve() saw where it was declared.
+ */
+typedef struct {
+	symbol_t *name;
+	node_t params;
+	int arity;
+	node_t body;
+	/* Of the scope of a call, 0 when calls need none */
+	int slots;
+	source_t *source;
+	size_t start;
+	size_t end;
+	int line;
+	node_t scope;
+} flat_fn_t;
+
+/*
+ * Locals declared so far in a scope around a lazy function, length names
+ * from lists[names] in slot order
+ */
+typedef struct {
+	node_t enclosing;
+	node_t names;
+	int length;
+} flat_scope_t;
+
+/*
+ * A program as contiguous pools of nodes that refer to each other by
+ * index, 0 is no node in every pool. Lines and names are side arrays so
+ * the nodes the interpreter walks stay small. Nothing points into the
+ * arena the program was parsed in, strings are copied into strings.
+ */
+struct flat_t {
+	flat_expr_t *exprs;
+	/* Line of each expression, for runtime errors */
+	int *lines;
+	int exprs_length;
+	int exprs_capacity;
+	flat_stmt_t *stmts;
+	int stmts_length;
+	int stmts_capacity;
+	/* Runs of children of blocks, calls and parameter lists */
+	node_t *lists;
+	int lists_length;
+	int lists_capacity;
+	value_t *constants;
+	int constants_length;
+	int constants_capacity;
+	symbol_t **names;
+	int names_length;
+	int names_capacity;
+	flat_fn_t *functions;
+	int functions_length;
+	int functions_capacity;
+	flat_scope_t *scopes;
+	int scopes_length;
+	int scopes_capacity;
+	arena_t *strings;
+	/* The cache file the pools are in when cache_load() made it, or NULL */
+	char *map;
+	size_t map_size;
+};
+
+flat_t *flat_create(void);
+node_t flatten(flat_t *flat, stmt_array_t *statements);
+node_t flatten_expr(flat_t *flat, expr_t *expr);
+node_t flat_list(flat_t *flat, int length);
+node_t flat_name(flat_t *flat, symbol_t *name);
+node_t flat_scope(flat_t *flat, flat_scope_t *scope);
+int flat_body(flat_t *flat, node_t function);
+size_t flat_size(flat_t *flat);
+void flat_free(flat_t *flat);
+
+#endif
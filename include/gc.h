@@ -0,0 +1,78 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#include "ast.h"
+#include "env.h"
+
+#define DEFAULT_SCOPES_SIZE 50
+#define DEFAULT_FUNCTIONS_SIZE 16
+#define DEFAULT_STACK_SIZE 64
+/* Bytes the heap can reach before the first collection, rd run --gc-threshold */
+#define GC_THRESHOLD (1024 * 1024)
+/* The next collection is when the heap is this many times what survived */
+#define GC_GROWTH 2
+
+typedef struct {
+	scope_t **scopes;
+	int length;
+	int capacity;
+} scope_array_t;
+
+typedef struct {
+	fn_t **functions;
+	int length;
+	int capacity;
+} fn_array_t;
+
+typedef struct {
+	value_t *values;
+	int length;
+	int capacity;
+} value_stack_t;
+
+/*
+ * Heap of one program: functions and the scopes they closed over, which
+ * can refer to each other in cycles. Strings count their references
+ * instead. Whatever the globals, the stack, the scope each call was made
+ * from and the scope a collection starts in can't reach is freed.
+ */
+typedef struct {
+	fn_array_t functions;
+	scope_array_t scopes;
+	/* Values being worked on that nothing else holds, call arguments */
+	value_stack_t stack;
+	/* Scope of every call under way, where it was called from */
+	scope_array_t frames;
+	/* Scopes entered and not yet left, innermost last */
+	scope_array_t open;
+	/* Functions marked whose scopes are not yet */
+	fn_array_t gray;
+	/* Objects marked with it are reached, one more each collection */
+	int epoch;
+	/* Bytes in the heap, collected when it gets to threshold */
+	size_t live;
+	size_t threshold;
+	/* For rd run --gc-stats */
+	int collections;
+	size_t allocated;
+	size_t freed;
+	size_t peak;
+	double time;
+} gc_t;
+
+extern size_t gc_threshold;
+extern int gc_stats;
+
+void scope_array_add(scope_array_t *array, scope_t *scope);
+void gc_init(gc_t *gc);
+void gc_add_function(gc_t *gc, fn_t *fn);
+void gc_add_scope(gc_t *gc, scope_t *scope);
+void gc_push(gc_t *gc, value_t value);
+void gc_collect(gc_t *gc, ht_t *globals, scope_t *env);
+void gc_unwind(gc_t *gc);
+void gc_report(gc_t *gc);
+void gc_free(gc_t *gc);
+
+#endif
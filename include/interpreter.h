@@ -1,13 +1,33 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include <setjmp.h>
+
 #include "ast.h"
 #include "env.h"
+#include "gc.h"
+
+/*
+ * State of one running program, any number of them can run at once
+ */
+struct interpreter_t {
+	/* Program being run */
+	flat_t *flat;
+	/* Names declared at the top level */
+	ht_t *globals;
+	/* Functions and the scopes closures were declared in */
+	gc_t gc;
+	/* Runtime errors jump back here once reported */
+	jmp_buf error;
+};
 
-void free_val(value_t *value);
-void runtime_error(const char *message, int line);
-value_t *evaluate(expr_t *expr, ht_t *env);
-void print_value(value_t *value);
-void interpret(stmt_array_t *array);
+value_t value_copy(value_t value);
+void free_val(value_t value);
+int is_truthy(value_t value);
+void runtime_error(interpreter_t *interp, const char *message, int line);
+value_t evaluate(interpreter_t *interp, node_t node, scope_t *env);
+void print_value(value_t value);
+int interpret(flat_t *flat, node_t root);
+int interpret_expr(flat_t *flat, node_t node);
 
 #endif
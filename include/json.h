@@ -0,0 +1,37 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+
+#include "arena.h"
+
+typedef enum {
+	JSON_NULL,
+	JSON_BOOL,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT,
+} json_type_t;
+
+/*
+ * A parsed JSON value. The items of an array or object are a list from
+ * child, each with key set in an object. Strings are decoded to UTF-8 and
+ * can hold 0 bytes, so they come with their length.
+ */
+typedef struct json_t {
+	json_type_t type;
+	double number;
+	char *string;
+	size_t length;
+	char *key;
+	struct json_t *child;
+	struct json_t *next;
+} json_t;
+
+json_t *json_parse(arena_t *arena, const char *text, size_t length);
+json_t *json_get(json_t *object, const char *key);
+json_t *json_path(json_t *object, const char *first, const char *second);
+void json_write_string(FILE *out, const char *chars, size_t length);
+
+#endif
@@ -1,6 +1,13 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stddef.h>
+
+#include "arena.h"
+#include "diagnostic.h"
+#include "str.h"
+#include "symbol.h"
+
 #define DEFAULT_TOKENS_SIZE 512
 
 typedef enum {
@@ -11,7 +18,8 @@ typedef enum {
 
   // One or two character tokens
   TOKEN_BANG, TOKEN_BANG_EQUAL, TOKEN_EQUAL, TOKEN_EQUAL_EQUAL, TOKEN_GREATER,
-  TOKEN_GREATER_EQUAL, TOKEN_LESS, TOKEN_LESS_EQUAL,
+  TOKEN_GREATER_EQUAL, TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_DOT_DOT,
+  TOKEN_DOT_DOT_EQUAL,
 
   // Literals
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
@@ -21,28 +29,105 @@ typedef enum {
   TOKEN_IF, TOKEN_NIL, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER,
   TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
 
+  // Keywords reserved for docs/grammar.md
+  TOKEN_FN, TOKEN_LET, TOKEN_MATCH, TOKEN_MUT, TOKEN_PUB, TOKEN_STRUCT,
+  TOKEN_TYPE,
+
   TOKEN_EOF
 } token_type_t;
 
+#define LEXER_CHUNK_SIZE 65536
+
+/*
+ * Source text of a script, mmap'd when it comes from a regular file.
+ * Tokens point into it, so it has to outlive the tokens and the AST.
+ * A streamed script is not kept, its identifiers and strings point at
+ * their symbol and string, and the text of numbers is copied into arena.
+ */
 typedef struct {
-    char *keyword;
-    token_type_t token_type;
-} keyword_map;
+	char *data;
+	size_t length;
+	int mapped;
+	arena_t *arena;
+} source_t;
 
+/*
+ * A token is a span of the source, start is not 0 terminated.
+ * Identifiers are interned as they are lexed, numbers and strings are
+ * decoded into as. The string belongs to whoever holds the token and is
+ * moved out, setting it to NULL, when the token is handed on.
+ */
 typedef struct {
 	token_type_t type;
-	char *value;
+	char *start;
+	int length;
 	int line;
+	symbol_t *symbol;
+	union {
+		double number;
+		string_t *string;
+	} as;
 } token_t;
 
 typedef struct {
     token_t *tokens;
     int length;
     int capacity;
+    source_t *source;
 } array_t;
 
+/*
+ * Lexical error held back by a lexer on another thread until the chunks
+ * are put back in order
+ */
+typedef struct {
+	int line;
+	char character; /* 0 for an unterminated string */
+} lex_error_t;
+
+/*
+ * Scanning state. Walks a whole source in place, or reads fd in chunks
+ * of LEXER_CHUNK_SIZE into buf, keeping only the token being scanned
+ * across reads. With tokens set it replays an already lexed array.
+ */
+typedef struct {
+	source_t *source;
+	int fd;
+	char *buf;
+	size_t pos;
+	size_t len;
+	size_t size;
+	int line;
+	/* Strings are allocated from it when set, by a parser that owns them */
+	arena_t *arena;
+	token_t *tokens;
+	int index;
+	/* Chunk of a parallel run, keeps errors back for the caller */
+	int deferred;
+	lex_error_t *errors;
+	int errors_length;
+	int errors_capacity;
+	/* Errors go here instead of stderr when set, for rd lsp */
+	diagnostics_t *diagnostics;
+} lexer_t;
+
+#define PARALLEL_MIN_CHUNK (1024 * 1024)
+
+source_t *source_open(const char *filename);
+void source_close(source_t *source);
+lexer_t *lexer_open(const char *filename);
+lexer_t *lexer_range(source_t *source, size_t start, size_t end, int line);
+lexer_t *lexer_tokens(array_t *array);
+token_t lexer_next(lexer_t *lexer);
+void lexer_close(lexer_t *lexer);
+int token_equal(token_t *a, token_t *b);
+int same_tokens(array_t *a, array_t *b);
+double number_decode(const char *start, int length);
+token_type_t keyword_type(const char *start, int length);
 void token_add(array_t *array, token_t token);
 array_t *tokenize(char *filename);
+int split_source(source_t *source, size_t *starts, int chunks);
+array_t *tokenize_parallel(char *filename, int threads);
 void print_tokens(token_t *tokens);
 void free_array(array_t *array);
 
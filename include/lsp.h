@@ -0,0 +1,40 @@
+#ifndef LSP_H
+#define LSP_H
+
+#include <stdio.h>
+
+#include "document.h"
+
+#define DEFAULT_DOCUMENTS_SIZE 8
+
+typedef struct {
+	char *uri;
+	int version;
+	document_t *document;
+} lsp_document_t;
+
+/*
+ * A language server talking JSON-RPC over in and out, with the headers of
+ * the base protocol. Only reports diagnostics for now.
+ */
+typedef struct {
+	FILE *in;
+	FILE *out;
+	/* Every message read is copied here when set, rd lsp --record */
+	FILE *record;
+	lsp_document_t *documents;
+	int documents_length;
+	int documents_capacity;
+	/* Positions count bytes of UTF-8 when the client takes that, else UTF-16 */
+	int utf8;
+	int shutdown;
+	int exited;
+} lsp_t;
+
+void lsp_init(lsp_t *lsp, FILE *in, FILE *out);
+char *lsp_read(FILE *in, size_t *length);
+void lsp_message(lsp_t *lsp, const char *message, size_t length);
+void lsp_free(lsp_t *lsp);
+int lsp_main(int argc, char **argv);
+
+#endif
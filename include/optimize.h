@@ -0,0 +1,88 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "ast.h"
+
+/* Most nodes the body of a function can have to be inlined */
+#define INLINE_NODES 16
+
+/* What a program does with a name, by symbol id */
+typedef struct {
+	int declared;
+	int used;
+	int assigned;
+	/* Assigned in a function body, where a call could do it from anywhere */
+	int assigned_in_function;
+} name_use_t;
+
+/* State of optimize_program() */
+typedef struct {
+	arena_t *arena;
+	const char *filename;
+	name_use_t *names;
+	int names_length;
+	/* A body that has not been parsed, what it uses is not known */
+	int unknown;
+	/* Function bodies the count is in */
+	int functions;
+	/* Functions that can be inlined where the walk has got to */
+	stmt_t **inlinable;
+	int inlinable_length;
+	int inlinable_capacity;
+	/* Names surely declared where the walk has got to, reading them cannot fail */
+	symbol_t **defined;
+	int defined_length;
+	int defined_capacity;
+	/* Variables made up to hold values, named so no script can write them */
+	int temporaries;
+} optimizer_t;
+
+/* A loop invariant expression and the variable it is kept in */
+typedef struct {
+	expr_t *expr;
+	symbol_t *temporary;
+} hoisted_t;
+
+/* What a loop assigns or declares, and whether it calls anything */
+typedef struct {
+	symbol_t **written;
+	int written_length;
+	int written_capacity;
+	int calls;
+	hoisted_t *hoisted;
+	int hoisted_length;
+	int hoisted_capacity;
+} loop_info_t;
+
+/* A pure expression evaluated earlier in a basic block */
+typedef struct {
+	expr_t *expr;
+	/* Where it is, to make it store its value the first time it is reused */
+	expr_t **slot;
+	/* Statement it is in */
+	int index;
+	symbol_t *temporary;
+	/* Nothing it reads has been assigned since */
+	int live;
+} available_t;
+
+/* Pure expressions of the basic block a walk is in */
+typedef struct {
+	available_t *items;
+	int length;
+	int capacity;
+	/* Statement the walk is at */
+	int index;
+} block_info_t;
+
+extern int opt_report;
+
+/*
+ * Passes over the AST between parse() and flatten(), new nodes and
+ * strings come from the arena the AST was parsed into
+ */
+expr_t *fold_expr(arena_t *arena, expr_t *expr);
+void optimize(arena_t *arena, stmt_array_t *statements);
+void optimize_program(arena_t *arena, stmt_array_t *statements, const char *filename);
+
+#endif
@@ -1,12 +1,50 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <setjmp.h>
+
 #include "ast.h"
 #include "lexer.h"
 
-stmt_array_t *parse(token_t *tks);
-expr_t *parse_expr(token_t *tks);
-void free_expr(expr_t *expr);
-void free_statements(stmt_array_t *array);
+/* Lookahead window over the lexer, holds previous() and peek() */
+#define TOKEN_RING_SIZE 4
+
+/*
+ * State of one parse, any number of them can run at once
+ */
+typedef struct {
+	lexer_t *lexer;
+	token_t ring[TOKEN_RING_SIZE];
+	int current;
+	/* Every node of the program being parsed comes from here */
+	arena_t *arena;
+	/* Leave function bodies to parse_range() on their first call */
+	int lazy;
+	/* Syntax errors jump back here once reported */
+	jmp_buf error;
+} parser_t;
+
+/*
+ * A script parsed and flattened by parse_files(), root is the block of
+ * its top level statements
+ */
+typedef struct {
+	char *filename;
+	source_t *source;
+	flat_t *flat;
+	node_t root;
+	/* 65 after a lexical or syntax error, 1 when it could not be read */
+	int status;
+} program_t;
+
+extern int lazy_bodies;
+
+stmt_array_t *parse(lexer_t *lexer, arena_t *arena);
+stmt_t *parse_range(source_t *source, size_t start, size_t end, int line, arena_t *arena);
+expr_t *parse_expr(lexer_t *lexer, arena_t *arena);
+stmt_t *parse_declaration(source_t *source, size_t start, int line, arena_t *arena,
+		diagnostics_t *diagnostics, size_t *next, int *next_line);
+program_t *parse_files(char **filenames, int count, int threads);
+void free_programs(program_t *programs, int count);
 
 #endif
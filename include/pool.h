@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+#define DEFAULT_JOBS_SIZE 64
+
+typedef struct {
+	void (*fn)(void *arg);
+	void *arg;
+} job_t;
+
+/*
+ * Fixed set of worker threads taking jobs off a shared queue
+ */
+typedef struct {
+	pthread_t *threads;
+	int threads_length;
+	job_t *jobs;
+	int length;
+	int capacity;
+	int next;
+	int running;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+} pool_t;
+
+int pool_jobs(const char *arg);
+pool_t *pool_create(int threads);
+void pool_submit(pool_t *pool, void (*fn)(void *arg), void *arg);
+void pool_wait(pool_t *pool);
+void pool_destroy(pool_t *pool);
+
+#endif
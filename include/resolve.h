@@ -0,0 +1,39 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "flat.h"
+
+#define DEFAULT_LOCALS_SIZE 8
+
+typedef struct {
+	symbol_t *name;
+	/* 0 while its initializer is being resolved */
+	int defined;
+} local_t;
+
+/* Locals of a scope in slot order */
+typedef struct {
+	local_t *locals;
+	int length;
+	int capacity;
+} local_array_t;
+
+/*
+ * Scopes around the node being resolved, innermost last. Only blocks and
+ * calls that declare something get a scope, the top level is global.
+ */
+typedef struct {
+	flat_t *flat;
+	local_array_t *scopes;
+	int length;
+	int capacity;
+	int ok;
+	/* Errors go here instead of stderr when set */
+	diagnostics_t *diagnostics;
+} resolver_t;
+
+int resolve(flat_t *flat, node_t root);
+int resolve_report(flat_t *flat, node_t root, diagnostics_t *diagnostics);
+int resolve_function(flat_t *flat, node_t function);
+
+#endif
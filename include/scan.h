@@ -0,0 +1,35 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * Scanning kernels for the lexer. Each one takes the range [p, end) and
+ * returns where the run it skips over stops, end if it never does.
+ * They work on 32 (AVX2) or 16 (SSE2) bytes at a time when the compiler
+ * targets those, the _scalar versions are always built for comparison.
+ */
+
+/* Spaces, tabs and newlines, newlines are added to *lines */
+const char *scan_blank(const char *p, const char *end, int *lines);
+/* Up to the newline ending a // comment */
+const char *scan_line(const char *p, const char *end);
+/* Up to the closing quote of a string, newlines are added to *lines */
+const char *scan_string(const char *p, const char *end, int *lines);
+/* Identifier characters, [A-Za-z0-9_] */
+const char *scan_ident(const char *p, const char *end);
+const char *scan_digits(const char *p, const char *end);
+/* Up to the next quote or slash, where a string or comment could start */
+const char *scan_code(const char *p, const char *end);
+int count_newlines(const char *p, const char *end);
+
+const char *scan_blank_scalar(const char *p, const char *end, int *lines);
+const char *scan_line_scalar(const char *p, const char *end);
+const char *scan_string_scalar(const char *p, const char *end, int *lines);
+const char *scan_ident_scalar(const char *p, const char *end);
+const char *scan_digits_scalar(const char *p, const char *end);
+const char *scan_code_scalar(const char *p, const char *end);
+int count_newlines_scalar(const char *p, const char *end);
+
+/* Name of the instruction set the kernels were built for */
+const char *scan_isa(void);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef STR_H
+#define STR_H
+
+#include "arena.h"
+
+/* Where string_hash() starts from */
+#define STRING_HASH 2166136261u
+
+/*
+ * Length-prefixed string, chars is also 0 terminated so it can be printed
+ * directly. Strings are never changed once made. One on the heap is freed
+ * when the last of its refs is released, one with no refs lives as long as
+ * the arena or cache it came from and is shared without counting.
+ */
+typedef struct {
+	int length;
+	int refs;
+	unsigned int hash;
+	char chars[];
+} string_t;
+
+unsigned int string_hash(unsigned int hash, const char *chars, int length);
+string_t *string_new(const char *chars, int length);
+string_t *string_arena(arena_t *arena, const char *chars, int length);
+string_t *string_ref(string_t *string);
+void string_release(string_t *string);
+string_t *string_concat(string_t *a, string_t *b);
+string_t *string_concat_chars(const char *a, int a_length, const char *b, int b_length);
+string_t *string_concat_arena(arena_t *arena, string_t *a, string_t *b);
+int string_equal(string_t *a, string_t *b);
+
+#endif
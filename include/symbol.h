@@ -0,0 +1,22 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#define DEFAULT_SYMBOLS_SIZE 1024
+
+/*
+ * An interned identifier, there is exactly one per distinct name so
+ * symbols are compared by pointer
+ */
+typedef struct {
+	int id;
+	unsigned int hash;
+	int length;
+	char name[];
+} symbol_t;
+
+symbol_t *intern(const char *start, int length);
+symbol_t *symbol_get(int id);
+int symbol_count(void);
+void free_symbols(void);
+
+#endif
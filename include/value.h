@@ -0,0 +1,124 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "str.h"
+
+typedef enum {
+	VAL_BOOL,
+	VAL_NIL,
+	VAL_NUMBER,
+	VAL_STRING,
+	VAL_SHORT,
+	VAL_FN,
+} value_type_t;
+
+typedef struct fn_t fn_t;
+
+#ifdef NAN_BOXING
+/*
+ * A value in 8 bytes, built with -DNAN_BOXING. A number is its double.
+ * Everything else is a quiet NaN no arithmetic makes, with nil, false and
+ * true in its low bits. Objects also have the sign bit set and keep their
+ * pointer in the low 48 bits, with bit 0 set for a function. Strings are
+ * always on the heap.
+ */
+typedef uint64_t value_t;
+
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+#define OBJ_TAG ((uint64_t) 0x8000000000000000 | QNAN)
+#define NIL_TAG ((uint64_t) 1)
+#define FALSE_TAG ((uint64_t) 2)
+#define TRUE_TAG ((uint64_t) 3)
+#define FN_TAG ((uint64_t) 1)
+
+#define BOOL_VAL(value) ((value) ? QNAN | TRUE_TAG : QNAN | FALSE_TAG)
+#define NIL_VAL (QNAN | NIL_TAG)
+#define NUMBER_VAL(value) (((union { double number; uint64_t bits; }) { (value) }).bits)
+#define STRING_VAL(value) (OBJ_TAG | (uint64_t) (uintptr_t) (value))
+#define FN_VAL(value) (OBJ_TAG | FN_TAG | (uint64_t) (uintptr_t) (value))
+
+#define IS_BOOL(value) (((value) | 1) == (QNAN | TRUE_TAG))
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_STRING(value) (((value) & (OBJ_TAG | FN_TAG)) == OBJ_TAG)
+#define IS_FN(value) (((value) & (OBJ_TAG | FN_TAG)) == (OBJ_TAG | FN_TAG))
+
+#define AS_BOOL(value) ((value) == (QNAN | TRUE_TAG))
+#define AS_NUMBER(value) (((union { uint64_t bits; double number; }) { (value) }).number)
+#define AS_STRING(value) ((string_t *) (uintptr_t) ((value) & ~(OBJ_TAG | FN_TAG)))
+#define AS_FN(value) ((fn_t *) (uintptr_t) ((value) & ~(OBJ_TAG | FN_TAG)))
+
+#define VALUE_TYPE(value) (IS_NUMBER(value) ? VAL_NUMBER : IS_NIL(value) ? VAL_NIL : \
+		IS_BOOL(value) ? VAL_BOOL : IS_STRING(value) ? VAL_STRING : VAL_FN)
+
+/* There is no room to keep strings in the value */
+#define SHORT_STRING_SIZE -1
+#define IS_SHORT(value) 0
+#define SHORT_EQUAL(a, b) 0
+#define TEXT_CHARS(value) (AS_STRING(value)->chars)
+#define TEXT_LENGTH(value) (AS_STRING(value)->length)
+#else
+/* Bytes a string can have and still be kept in the value itself */
+#define SHORT_STRING_SIZE 14
+
+/*
+ * A value, 16 bytes, passed and returned by value. Only long strings and
+ * functions point at anything on the heap. A short string keeps its length
+ * and bytes in the value itself, from head on, zero padded. Read and make
+ * them with the macros below rather than the fields, they are all there is
+ * of a value built with -DNAN_BOXING.
+ */
+typedef struct value_t {
+	uint8_t type;
+	uint8_t length;
+	/* Named rather than an array so values stay in registers */
+	uint16_t head;
+	uint32_t rest;
+	union {
+		int boolean;
+		double number;
+		string_t *string;
+		fn_t *function;
+		uint64_t bits;
+	} as;
+} value_t;
+
+#define BOOL_VAL(value) ((value_t) { VAL_BOOL, 0, 0, 0, { .boolean = (value) } })
+#define NIL_VAL ((value_t) { VAL_NIL, 0, 0, 0, { .number = 0 } })
+#define NUMBER_VAL(value) ((value_t) { VAL_NUMBER, 0, 0, 0, { .number = (value) } })
+#define STRING_VAL(value) ((value_t) { VAL_STRING, 0, 0, 0, { .string = (value) } })
+#define FN_VAL(value) ((value_t) { VAL_FN, 0, 0, 0, { .function = (value) } })
+
+#define IS_BOOL(value) ((value).type == VAL_BOOL)
+#define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_STRING(value) ((value).type == VAL_STRING)
+#define IS_SHORT(value) ((value).type == VAL_SHORT)
+#define IS_FN(value) ((value).type == VAL_FN)
+
+#define AS_BOOL(value) ((value).as.boolean)
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_STRING(value) ((value).as.string)
+#define AS_FN(value) ((value).as.function)
+#define AS_SHORT(value) ((char *) &(value) + offsetof(value_t, head))
+
+#define VALUE_TYPE(value) ((value_type_t) (value).type)
+#define SHORT_EQUAL(a, b) ((a).length == (b).length && (a).head == (b).head && \
+		(a).rest == (b).rest && (a).as.bits == (b).as.bits)
+
+/* Bytes of a string of either kind and how many */
+#define TEXT_CHARS(value) (IS_SHORT(value) ? AS_SHORT(value) : AS_STRING(value)->chars)
+#define TEXT_LENGTH(value) (IS_SHORT(value) ? (value).length : AS_STRING(value)->length)
+#endif
+
+/* A string of either kind, one that fits is always short */
+#define IS_TEXT(value) (IS_STRING(value) || IS_SHORT(value))
+#define FITS_SHORT(length) ((length) <= SHORT_STRING_SIZE)
+
+value_t short_concat(const char *a, int a_length, const char *b, int b_length);
+value_t text_concat(value_t left, value_t right);
+
+#endif
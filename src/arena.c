@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+arena_t *arena_create(void)
+{
+	arena_t *arena = malloc(sizeof(arena_t));
+	arena->blocks = NULL;
+	arena->total = 0;
+	return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	arena_block_t *block = arena->blocks;
+	if (!block || block->size - block->used < size) {
+		/* Larger requests get a block of their own */
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(arena_block_t) + block_size);
+		block->used = 0;
+		block->size = block_size;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	void *ptr = block->data + block->used;
+	block->used += size;
+	arena->total += size;
+	return ptr;
+}
+
+/*
+ * Resize an array taken from the arena. The last allocation of the current
+ * block grows in place, anything else is copied and the old copy is left
+ * until the arena is freed.
+ */
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t size)
+{
+	old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	size_t extra = ((size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1)) - old_size;
+	arena_block_t *block = arena->blocks;
+	if (block && (char *) ptr + old_size == block->data + block->used &&
+			block->size - block->used >= extra) {
+		block->used += extra;
+		arena->total += extra;
+		return ptr;
+	}
+	void *copy = arena_alloc(arena, size);
+	memcpy(copy, ptr, old_size < size ? old_size : size);
+	return copy;
+}
+
+void arena_free(arena_t *arena)
+{
+	if (!arena)
+		return;
+	while (arena->blocks) {
+		arena_block_t *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+	free(arena);
+}
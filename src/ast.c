@@ -5,59 +5,51 @@
 #include "ast.h"
 #include "lexer.h"
 
-expr_t *create_binary_expr(token_t *operator, expr_t *left, expr_t *right)
+expr_t *create_binary_expr(arena_t *arena, token_t *operator, expr_t *left, expr_t *right)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_BINARY;
 	expr->line = operator->line;
 	expr->as.binary.left = left;
 	expr->as.binary.right = right;
-	expr->as.binary.operator.type = operator->type;
-	expr->as.binary.operator.value = strdup(operator->value);
-	expr->as.binary.operator.line = operator->line;
+	expr->as.binary.operator = *operator;
 	return expr;
 }
 
-expr_t *create_unary_expr(token_t *operator, expr_t *right)
+expr_t *create_unary_expr(arena_t *arena, token_t *operator, expr_t *right)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_UNARY;
 	expr->line = operator->line;
-	expr->as.unary.operator.type = operator->type;
-	expr->as.unary.operator.value = strdup(operator->value);
-	expr->as.unary.operator.line = operator->line;
+	expr->as.unary.operator = *operator;
 	expr->as.unary.right = right;
 	return expr;
 }
 
-expr_t *create_literal_expr(token_t *token)
+expr_t *create_literal_expr(arena_t *arena, token_t *token)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_LITERAL;
 	expr->line = token->line;
-	expr->as.literal.value = malloc(sizeof(value_t));
+	expr->as.literal.value = arena_alloc(arena, sizeof(value_t));
 	switch (token->type) {
 		case TOKEN_NUMBER:
-			expr->as.literal.value->type = VAL_NUMBER;
-			double num;
-			sscanf(token->value, "%lf", &num);
-			expr->as.literal.value->as.number = num;
+			*expr->as.literal.value = NUMBER_VAL(token->as.number);
 			break;
 
 		case TOKEN_NIL:
-			expr->as.literal.value->type = VAL_NIL;
-			expr->as.literal.value->as.number = 0;
+			*expr->as.literal.value = NIL_VAL;
 			break;
 
 		case TOKEN_TRUE:
 		case TOKEN_FALSE:
-			expr->as.literal.value->type = VAL_BOOL;
-			expr->as.literal.value->as.boolean = token->type == TOKEN_TRUE;
+			*expr->as.literal.value = BOOL_VAL(token->type == TOKEN_TRUE);
 			break;
 
 		case TOKEN_STRING:
-			expr->as.literal.value->type = VAL_STRING;
-			expr->as.literal.value->as.string = strdup(token->value);
+			/* Moved, the token no longer owns it */
+			*expr->as.literal.value = STRING_VAL(token->as.string);
+			token->as.string = NULL;
 			break;
 
 		default:
@@ -66,33 +58,31 @@ expr_t *create_literal_expr(token_t *token)
 	return expr;
 }
 
-expr_t *create_grouping_expr(expr_t *expression)
+expr_t *create_grouping_expr(arena_t *arena, expr_t *expression)
 {
 	if (!expression) {
 		return NULL;
 	}
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_GROUPING;
 	expr->line = expression->line;
 	expr->as.grouping.expression = expression;
 	return expr;
 }
 
-expr_t *create_variable_expr(token_t *name)
+expr_t *create_variable_expr(arena_t *arena, token_t *name)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_VARIABLE;
 	expr->line = name->line;
-	expr->as.variable.name.type = name->type;
-	expr->as.variable.name.value = strdup(name->value);
-	expr->as.variable.name.line = name->line;
+	expr->as.variable.name = *name;
 
 	return expr;
 }
 
-expr_t *create_assign_expr(expr_t *name, expr_t *value)
+expr_t *create_assign_expr(arena_t *arena, expr_t *name, expr_t *value)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_ASSIGN;
 	expr->line = name->as.variable.name.line;
 	expr->as.assign.name =  name;
@@ -101,28 +91,24 @@ expr_t *create_assign_expr(expr_t *name, expr_t *value)
 	return expr;
 }
 
-expr_t *create_logical_expr(token_t *operator, expr_t *left, expr_t *right)
+expr_t *create_logical_expr(arena_t *arena, token_t *operator, expr_t *left, expr_t *right)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_LOGICAL;
 	expr->line = operator->line;
 	expr->as.logical.left = left;
 	expr->as.logical.right = right;
-	expr->as.logical.operator.type = operator->type;
-	expr->as.logical.operator.value = strdup(operator->value);
-	expr->as.logical.operator.line = operator->line;
+	expr->as.logical.operator = *operator;
 	return expr;
 }
 
-expr_t *create_call_expr(expr_t *callee, token_t *paren, arg_array_t *args)
+expr_t *create_call_expr(arena_t *arena, expr_t *callee, token_t *paren, arg_array_t *args)
 {
-	expr_t *expr = malloc(sizeof(expr_t));
+	expr_t *expr = arena_alloc(arena, sizeof(expr_t));
 	expr->type = EXPR_CALL;
 	expr->line = paren->line;
 	expr->as.call.callee = callee;
-	expr->as.call.paren.type = paren->type;
-	expr->as.call.paren.value = strdup(paren->value);
-	expr->as.call.paren.line = paren->line;
+	expr->as.call.paren = *paren;
 	expr->as.call.args = args;
 	return expr;
 }
@@ -132,9 +118,10 @@ void print_ast(expr_t *expr)
 	if (!expr)
 		return;
 	if (expr->type == EXPR_LITERAL) {
-		switch (expr->as.literal.value->type) {
+		value_t literal = *expr->as.literal.value;
+		switch (VALUE_TYPE(literal)) {
 			case VAL_BOOL:
-				printf("%s", expr->as.literal.value->as.boolean ? "true" : "false");
+				printf("%s", AS_BOOL(literal) ? "true" : "false");
 				break;
 
 			case VAL_NIL:
@@ -142,7 +129,7 @@ void print_ast(expr_t *expr)
 				break;
 
 			case VAL_NUMBER:;
-				double value = expr->as.literal.value->as.number;
+				double value = AS_NUMBER(literal);
 				if (value == (int) value) {
 					printf("%.1f", value);
 				} else {
@@ -151,7 +138,8 @@ void print_ast(expr_t *expr)
 				break;
 
 			case VAL_STRING:
-				printf("%s", expr->as.literal.value->as.string);
+			case VAL_SHORT:
+				printf("%.*s", TEXT_LENGTH(literal), TEXT_CHARS(literal));
 				break;
 
 			case VAL_FN:
@@ -159,13 +147,13 @@ void print_ast(expr_t *expr)
 				break;
 		}
 	} else if (expr->type == EXPR_BINARY) {
-		printf("(%s ", expr->as.binary.operator.value);
+		printf("(%.*s ", expr->as.binary.operator.length, expr->as.binary.operator.start);
 		print_ast(expr->as.binary.left);
 		printf(" ");
 		print_ast(expr->as.binary.right);
 		printf(")");
 	} else if (expr->type == EXPR_UNARY) {
-		printf("(%s ", expr->as.unary.operator.value);
+		printf("(%.*s ", expr->as.unary.operator.length, expr->as.unary.operator.start);
 		print_ast(expr->as.unary.right);
 		printf(")");
 	} else if (expr->type == EXPR_GROUPING) {
@@ -0,0 +1,1023 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "ast.h"
+#include "bench.h"
+#include "cache.h"
+#include "flat.h"
+#include "interpreter.h"
+#include "json.h"
+#include "lexer.h"
+#include "lsp.h"
+#include "optimize.h"
+#include "parser.h"
+#include "resolve.h"
+#include "scan.h"
+
+#define BENCH_KERNEL_SIZE (16 * 1024 * 1024)
+#define BENCH_MIN_TIME 0.5
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Buffers made of one long run for each kernel, so the timings measure the
+ * inner loop rather than the call overhead
+ */
+char *kernel_input(char fill, char stop)
+{
+	char *buf = malloc(BENCH_KERNEL_SIZE);
+	memset(buf, fill, BENCH_KERNEL_SIZE);
+	buf[BENCH_KERNEL_SIZE - 1] = stop;
+	return buf;
+}
+
+typedef const char *(*scan_fn)(const char *p, const char *end);
+typedef const char *(*scan_lines_fn)(const char *p, const char *end, int *lines);
+
+double time_scan(scan_fn fn, const char *buf)
+{
+	int reps = 0;
+	const char *volatile sink;
+	double start = now(), elapsed;
+	do {
+		sink = fn(buf, buf + BENCH_KERNEL_SIZE);
+		reps++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+	(void) sink;
+	return (double) BENCH_KERNEL_SIZE * reps / elapsed / 1e9;
+}
+
+double time_scan_lines(scan_lines_fn fn, const char *buf)
+{
+	int reps = 0, lines = 0;
+	const char *volatile sink;
+	double start = now(), elapsed;
+	do {
+		sink = fn(buf, buf + BENCH_KERNEL_SIZE, &lines);
+		reps++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+	(void) sink;
+	return (double) BENCH_KERNEL_SIZE * reps / elapsed / 1e9;
+}
+
+double time_newlines(int (*fn)(const char *p, const char *end), const char *buf)
+{
+	int reps = 0;
+	volatile int sink;
+	double start = now(), elapsed;
+	do {
+		sink = fn(buf, buf + BENCH_KERNEL_SIZE);
+		reps++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+	(void) sink;
+	return (double) BENCH_KERNEL_SIZE * reps / elapsed / 1e9;
+}
+
+void report(const char *name, double scalar, double vector)
+{
+	printf("%-10s %10.2f %10.2f %8.1fx\n", name, scalar, vector, vector / scalar);
+}
+
+/*
+ * rd bench-lex <filename>
+ * Throughput of each scanning kernel against its scalar version and of
+ * tokenize() on the given file
+ */
+int bench_lex(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: rd bench-lex <filename>\n");
+		return 1;
+	}
+
+	printf("kernels (%s)   scalar GB/s   %s GB/s\n", scan_isa(), scan_isa());
+	char *buf = kernel_input(' ', 'x');
+	report("blank", time_scan_lines(scan_blank_scalar, buf),
+			time_scan_lines(scan_blank, buf));
+	free(buf);
+
+	buf = kernel_input('x', '\n');
+	report("line", time_scan(scan_line_scalar, buf), time_scan(scan_line, buf));
+	free(buf);
+
+	buf = kernel_input('x', '"');
+	report("string", time_scan_lines(scan_string_scalar, buf),
+			time_scan_lines(scan_string, buf));
+	report("ident", time_scan(scan_ident_scalar, buf), time_scan(scan_ident, buf));
+	report("newlines", time_newlines(count_newlines_scalar, buf),
+			time_newlines(count_newlines, buf));
+	free(buf);
+
+	buf = kernel_input('7', ';');
+	report("digits", time_scan(scan_digits_scalar, buf), time_scan(scan_digits, buf));
+	free(buf);
+
+	size_t bytes = 0, tokens = 0;
+	int reps = 0;
+	double start = now(), elapsed;
+	do {
+		array_t *array = tokenize(argv[2]);
+		if (!array) {
+			return 1;
+		}
+		bytes += array->source->length;
+		tokens += array->length;
+		free_array(array);
+		reps++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+
+	printf("\ntokenize %s: %zu bytes, %zu tokens, %d runs\n", argv[2],
+			bytes / reps, tokens / reps, reps);
+	printf("%.3f GB/s, %.2f Mtokens/s\n", bytes / elapsed / 1e9, tokens / elapsed / 1e6);
+	return 0;
+}
+
+/*
+ * rd bench-lex-parallel <filename> [threads]
+ * tokenize_parallel() with 1, 2, 4... threads up to the given count,
+ * checking each result against tokenize()
+ */
+int bench_lex_parallel(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: rd bench-lex-parallel <filename> [threads]\n");
+		return 1;
+	}
+	int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+
+	array_t *expected = tokenize(argv[2]);
+	if (!expected) {
+		return 1;
+	}
+	printf("%s: %zu bytes, %d tokens\n", argv[2], expected->source->length,
+			expected->length);
+	printf("threads   seconds    GB/s  speedup  identical\n");
+
+	double base = 0;
+	int ok = 1;
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		int reps = 0, same = 1;
+		double start = now(), elapsed;
+		do {
+			array_t *array = tokenize_parallel(argv[2], threads);
+			same = same && same_tokens(expected, array);
+			free_array(array);
+			reps++;
+		} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+		double seconds = elapsed / reps;
+		if (threads == 1)
+			base = seconds;
+		printf("%7d %9.4f %7.3f %7.2fx  %s\n", threads, seconds,
+				expected->source->length / seconds / 1e9, base / seconds,
+				same ? "yes" : "NO");
+		ok = ok && same;
+	}
+	free_array(expected);
+	return !ok;
+}
+
+/* Generated source, a deterministic function of shape and size */
+typedef struct {
+	char *data;
+	size_t length;
+	size_t capacity;
+	unsigned int seed;
+} gen_t;
+
+void gen_printf(gen_t *gen, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (gen->length + n + 1 > gen->capacity) {
+		while (gen->length + n + 1 > gen->capacity)
+			gen->capacity *= 2;
+		gen->data = realloc(gen->data, gen->capacity);
+	}
+	va_start(args, format);
+	vsnprintf(gen->data + gen->length, n + 1, format, args);
+	va_end(args);
+	gen->length += n;
+}
+
+/* Linear congruential generator, the same sequence on every platform */
+int gen_rand(gen_t *gen, int below)
+{
+	gen->seed = gen->seed * 1103515245u + 12345u;
+	return (gen->seed >> 16) % below;
+}
+
+void gen_operand(gen_t *gen)
+{
+	if (gen_rand(gen, 2)) {
+		gen_printf(gen, "v%d", gen_rand(gen, 64));
+	} else {
+		gen_printf(gen, "%d.%d", gen_rand(gen, 1000), gen_rand(gen, 100));
+	}
+}
+
+/* if statements nested 32 deep with a little work at each level */
+void gen_nested(gen_t *gen)
+{
+	int depth = 32;
+	for (int i = 0; i < depth; i++) {
+		gen_printf(gen, "%*sif (v%d < %d) {\n", i * 2, "", gen_rand(gen, 64), i);
+		gen_printf(gen, "%*sv%d = v%d + 1;\n", i * 2 + 2, "", gen_rand(gen, 64),
+				gen_rand(gen, 64));
+	}
+	for (int i = depth - 1; i >= 0; i--)
+		gen_printf(gen, "%*s}\n", i * 2, "");
+}
+
+/* Long chains of binary operators in one expression */
+void gen_chain(gen_t *gen)
+{
+	static const char *arithmetic[] = { "+", "-", "*" };
+	static const char *comparison[] = { "<", ">=", "==", "!=" };
+	static const char *logical[] = { "and", "or" };
+	if (gen_rand(gen, 2)) {
+		gen_printf(gen, "v%d = ", gen_rand(gen, 64));
+		gen_operand(gen);
+		for (int i = 0; i < 200; i++) {
+			gen_printf(gen, " %s ", arithmetic[gen_rand(gen, 3)]);
+			gen_operand(gen);
+		}
+	} else {
+		gen_printf(gen, "b%d = ", gen_rand(gen, 64));
+		for (int i = 0; i < 50; i++) {
+			if (i)
+				gen_printf(gen, " %s ", logical[gen_rand(gen, 2)]);
+			gen_operand(gen);
+			gen_printf(gen, " %s ", comparison[gen_rand(gen, 4)]);
+			gen_operand(gen);
+		}
+	}
+	gen_printf(gen, ";\n");
+}
+
+/* Many small functions, each called once after it is declared */
+void gen_functions(gen_t *gen)
+{
+	int n = gen_rand(gen, 256);
+	gen_printf(gen, "fun f%d(a, b) {\n  var x = a * %d + b;\n"
+			"  if (x > 10) return x - 1;\n  return x;\n}\n"
+			"v%d = f%d(v%d, 2);\n", n, n % 97, gen_rand(gen, 64), n, gen_rand(gen, 64));
+}
+
+/* Mostly comments and string literals */
+void gen_comments(gen_t *gen)
+{
+	gen_printf(gen, "// %d: a comment long enough to be worth skipping quickly, "
+			"with \"quotes\" and // slashes in it\n", gen_rand(gen, 100000));
+	gen_printf(gen, "s%d = \"", gen_rand(gen, 64));
+	for (int i = gen_rand(gen, 4); i >= 0; i--)
+		gen_printf(gen, "a string literal spanning\nlines of text %d ", i);
+	gen_printf(gen, "\";\n");
+}
+
+typedef struct {
+	const char *name;
+	void (*gen)(gen_t *gen);
+} shape_t;
+
+shape_t shapes[] = {
+	{ "nested", gen_nested },
+	{ "chain", gen_chain },
+	{ "functions", gen_functions },
+	{ "comments", gen_comments },
+	{ "mixed", NULL },
+};
+
+/*
+ * Source of about size bytes made of the given shape, mixed interleaves all
+ * of them. Every variable it uses is declared first.
+ */
+source_t *generate(shape_t *shape, size_t size)
+{
+	gen_t gen = { malloc(4096), 0, 4096, 1 };
+	for (int i = 0; i < 64; i++)
+		gen_printf(&gen, "var v%d = %d;\nvar b%d = false;\nvar s%d = \"\";\n", i, i, i, i);
+	int n = 0;
+	while (gen.length < size) {
+		if (shape->gen) {
+			shape->gen(&gen);
+		} else {
+			shapes[n++ % 4].gen(&gen);
+		}
+	}
+
+	source_t *source = malloc(sizeof(source_t));
+	source->data = gen.data;
+	source->length = gen.length;
+	source->mapped = 0;
+	source->arena = NULL;
+	return source;
+}
+
+int count_expr(expr_t *expr)
+{
+	if (!expr)
+		return 0;
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			return 1 + count_expr(expr->as.assign.name) + count_expr(expr->as.assign.value);
+		case EXPR_BINARY:
+			return 1 + count_expr(expr->as.binary.left) + count_expr(expr->as.binary.right);
+		case EXPR_LOGICAL:
+			return 1 + count_expr(expr->as.logical.left) + count_expr(expr->as.logical.right);
+		case EXPR_GROUPING:
+			return 1 + count_expr(expr->as.grouping.expression);
+		case EXPR_UNARY:
+			return 1 + count_expr(expr->as.unary.right);
+		case EXPR_CALL: {
+			int n = 1 + count_expr(expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++)
+				n += count_expr(expr->as.call.args->arguments[i]);
+			return n;
+		}
+		default:
+			return 1;
+	}
+}
+
+int count_stmts(stmt_array_t *array);
+
+int count_stmt(stmt_t *stmt)
+{
+	if (!stmt)
+		return 0;
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			return 1 + count_stmts(stmt->as.block.statements);
+		case STMT_EXPR:
+			return 1 + count_expr(stmt->as.expr.expression);
+		case STMT_FUN:
+			return 1 + count_stmt(stmt->as.function.body);
+		case STMT_IF:
+			return 1 + count_expr(stmt->as._if.condition) +
+				count_stmt(stmt->as._if.then_branch) + count_stmt(stmt->as._if.else_branch);
+		case STMT_PRINT:
+			return 1 + count_expr(stmt->as.print.expression);
+		case STMT_RETURN:
+			return 1 + count_expr(stmt->as._return.value);
+		case STMT_VAR:
+			return 1 + count_expr(stmt->as.variable.initializer);
+		case STMT_WHILE:
+			return 1 + count_expr(stmt->as._while.condition) + count_stmt(stmt->as._while.body);
+		case STMT_FOR:
+			return 1 + count_stmt(stmt->as._for.initializer) +
+				count_expr(stmt->as._for.condition) + count_expr(stmt->as._for.increment) +
+				count_stmt(stmt->as._for.body);
+		case STMT_RANGE:
+			return 1 + count_expr(stmt->as.range.start) + count_expr(stmt->as.range.end) +
+				count_stmt(stmt->as.range.body);
+		default:
+			return 1;
+	}
+}
+
+int count_stmts(stmt_array_t *array)
+{
+	int n = 0;
+	for (int i = 0; i < array->length; i++)
+		n += count_stmt(array->statements[i]);
+	return n;
+}
+
+/* Bytes malloc has handed out and not had back, 0 where it can't say */
+size_t heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+/* Highest resident set size of the process so far */
+double peak_rss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+array_t *lex_source(source_t *source)
+{
+	lexer_t *lexer = lexer_range(source, 0, source->length, 1);
+	array_t *array = malloc(sizeof(array_t));
+	array->tokens = malloc(DEFAULT_TOKENS_SIZE * sizeof(token_t));
+	array->length = 0;
+	array->capacity = DEFAULT_TOKENS_SIZE;
+	array->source = NULL;
+	token_t token;
+	do {
+		token = lexer_next(lexer);
+		token_add(array, token);
+	} while (token.type != TOKEN_EOF);
+	lexer_close(lexer);
+	return array;
+}
+
+stmt_array_t *parse_tokens(array_t *array, arena_t *arena)
+{
+	lexer_t *lexer = lexer_tokens(array);
+	stmt_array_t *stmts = parse(lexer, arena);
+	lexer_close(lexer);
+	return stmts;
+}
+
+void bench_shape(shape_t *shape, size_t size)
+{
+	source_t *source = generate(shape, size);
+
+	/* One run for memory, peak RSS only ever grows so it goes first */
+	size_t heap = heap_used();
+	array_t *array = lex_source(source);
+	size_t lex_heap = heap_used() - heap;
+	double lex_rss = peak_rss();
+	heap = heap_used();
+	arena_t *arena = arena_create();
+	stmt_array_t *stmts = parse_tokens(array, arena);
+	size_t parse_heap = heap_used() - heap;
+	double parse_rss = peak_rss();
+	int tokens = array->length;
+	int nodes = count_stmts(stmts);
+	size_t tree_size = arena->total;
+	flat_t *flat = flat_create();
+	flatten(flat, stmts);
+	size_t flat_bytes = flat_size(flat);
+	flat_free(flat);
+	arena_free(arena);
+	free_array(array);
+
+	double lex_time = 0, parse_time = 0, flat_time = 0, free_time = 0;
+	int reps = 0;
+	do {
+		double start = now();
+		array = lex_source(source);
+		double lexed = now();
+		arena = arena_create();
+		stmts = parse_tokens(array, arena);
+		double parsed = now();
+		flat = flat_create();
+		flatten(flat, stmts);
+		double flattened = now();
+		arena_free(arena);
+		free_time += now() - flattened;
+		flat_free(flat);
+		flat_time += flattened - parsed;
+		parse_time += parsed - lexed;
+		lex_time += lexed - start;
+		free_array(array);
+		reps++;
+	} while (lex_time + parse_time < BENCH_MIN_TIME);
+
+	printf("%s: %zu bytes, %d tokens, %d nodes, %d runs\n", shape->name,
+			source->length, tokens, nodes, reps);
+	printf("  lex   %8.2f Mtokens/s %8.1f MB/s  heap %8.1f MB  peak RSS %8.1f MB\n",
+			tokens * reps / lex_time / 1e6, source->length * reps / lex_time / 1e6,
+			lex_heap / 1e6, lex_rss);
+	printf("  parse %8.2f Mnodes/s  %8.1f MB/s  heap %8.1f MB  peak RSS %8.1f MB\n",
+			nodes * reps / parse_time / 1e6, source->length * reps / parse_time / 1e6,
+			parse_heap / 1e6, parse_rss);
+	printf("  flat  %8.2f Mnodes/s  %8.1f MB tree  %8.1f MB flat\n",
+			nodes * reps / flat_time / 1e6, tree_size / 1e6, flat_bytes / 1e6);
+	printf("  free  %8.3f ms\n", free_time / reps * 1e3);
+	source_close(source);
+}
+
+/*
+ * rd bench-frontend <shape|all> [bytes] [-o file]
+ * Lexer and parser throughput and memory on a generated source, -o writes
+ * the source out instead so it can be run or profiled on its own
+ */
+int bench_frontend(int argc, char **argv)
+{
+	int count = sizeof(shapes) / sizeof(shapes[0]);
+	if (argc < 3) {
+		fprintf(stderr, "Usage: rd bench-frontend <shape|all> [bytes] [-o file]\n");
+		fprintf(stderr, "Shapes:");
+		for (int i = 0; i < count; i++)
+			fprintf(stderr, " %s", shapes[i].name);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+	size_t size = 4 * 1024 * 1024;
+	const char *output = NULL;
+	for (int i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			size = strtoull(argv[i], NULL, 10);
+		}
+	}
+
+	int found = 0;
+	for (int i = 0; i < count; i++) {
+		if (strcmp(argv[2], "all") && strcmp(argv[2], shapes[i].name))
+			continue;
+		found = 1;
+		if (output) {
+			source_t *source = generate(&shapes[i], size);
+			FILE *f = fopen(output, "w");
+			if (!f) {
+				fprintf(stderr, "Error writing file: %s\n", output);
+				source_close(source);
+				return 1;
+			}
+			fwrite(source->data, 1, source->length, f);
+			fclose(f);
+			source_close(source);
+			return 0;
+		}
+		/* A process per shape so each starts from a fresh peak RSS */
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			bench_shape(&shapes[i], size);
+			fflush(stdout);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown shape: %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
+
+/* Everything a run does before interpreting when nothing is cached */
+flat_t *compile_source(source_t *source, node_t *root)
+{
+	array_t *array = lex_source(source);
+	arena_t *arena = arena_create();
+	stmt_array_t *stmts = parse_tokens(array, arena);
+	optimize_program(arena, stmts, NULL);
+	flat_t *flat = flat_create();
+	*root = flatten(flat, stmts);
+	resolve(flat, *root);
+	arena_free(arena);
+	free_array(array);
+	return flat;
+}
+
+/*
+ * rd bench-cache <shape|all> [bytes]
+ * Start up from source against loading the program from the cache, in a
+ * cache directory of its own that is removed after
+ */
+int bench_cache(int argc, char **argv)
+{
+	int count = sizeof(shapes) / sizeof(shapes[0]);
+	if (argc < 3) {
+		fprintf(stderr, "Usage: rd bench-cache <shape|all> [bytes]\n");
+		return 1;
+	}
+	size_t size = argc > 3 ? strtoull(argv[3], NULL, 10) : 4 * 1024 * 1024;
+	char dir[] = "/tmp/rd-cache-XXXXXX";
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Error creating cache directory\n");
+		return 1;
+	}
+	setenv("RD_CACHE_DIR", dir, 1);
+	cache_disabled = 0;
+
+	int found = 0;
+	for (int i = 0; i < count; i++) {
+		if (strcmp(argv[2], "all") && strcmp(argv[2], shapes[i].name))
+			continue;
+		found = 1;
+		source_t *source = generate(&shapes[i], size);
+		node_t root;
+		flat_t *flat = compile_source(source, &root);
+		if (!cache_store(source, flat, root)) {
+			fprintf(stderr, "%s: could not be cached\n", shapes[i].name);
+			flat_free(flat);
+			source_close(source);
+			continue;
+		}
+		flat_free(flat);
+
+		double cold = 0, warm = 0, hash = 0;
+		int reps = 0;
+		do {
+			double start = now();
+			flat = compile_source(source, &root);
+			double compiled = now();
+			flat_free(flat);
+			double loading = now();
+			flat = cache_load(source, &root);
+			double loaded = now();
+			flat_free(flat);
+			volatile uint64_t key = cache_key(source);
+			(void) key;
+			hash += now() - loaded;
+			warm += loaded - loading;
+			cold += compiled - start;
+			reps++;
+		} while (cold + warm < BENCH_MIN_TIME);
+
+		flat = cache_load(source, &root);
+		printf("%s: %zu bytes, %d runs\n", shapes[i].name, source->length, reps);
+		printf("  cold  %8.3f ms  lex, parse, optimize, flatten, resolve\n",
+				cold / reps * 1e3);
+		printf("  warm  %8.3f ms  %6.1fx  %8.3f ms of it hashing the source\n",
+				warm / reps * 1e3, cold / warm, hash / reps * 1e3);
+		printf("  cache %8.1f MB\n", flat_size(flat) / 1e6);
+		flat_free(flat);
+		source_close(source);
+	}
+	cache_clear();
+	rmdir(dir);
+	if (!found) {
+		fprintf(stderr, "Unknown shape: %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
+
+void session_send(FILE *out, const char *format, ...)
+{
+	char *message;
+	size_t length;
+	FILE *m = open_memstream(&message, &length);
+	va_list args;
+	va_start(args, format);
+	vfprintf(m, format, args);
+	va_end(args);
+	fclose(m);
+	fprintf(out, "Content-Length: %zu\r\n\r\n", length);
+	fwrite(message, 1, length, out);
+	free(message);
+}
+
+/* text as it goes in a JSON string, only what session_type() types */
+void session_escape(char *out, const char *text)
+{
+	for (; *text; text++) {
+		if (*text == '\n') {
+			*out++ = '\\';
+			*out++ = 'n';
+		} else if (*text == '\t') {
+			*out++ = '\\';
+			*out++ = 't';
+		} else {
+			if (*text == '"') {
+				*out++ = '\\';
+			}
+			*out++ = *text;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Type text from line, column 0, a character a message the way an editor
+ * does it: brackets and quotes go in with the closing one, which is then
+ * typed over. The lines are then deleted one by one from the top.
+ */
+void session_type(FILE *out, int *version, int line, const char *text)
+{
+	int first = line, column = 0, pending = 0;
+	char closers[16];
+	for (const char *p = text; *p; p++) {
+		if (pending && *p == closers[pending - 1]) {
+			pending--;
+			column++;
+			continue;
+		}
+		char typed[3] = { *p, 0, 0 }, escaped[8];
+		const char *pair = strchr("{(\"", *p);
+		if (pair && pending < (int) sizeof(closers)) {
+			typed[1] = "})\""[pair - "{(\""];
+			closers[pending++] = typed[1];
+		}
+		session_escape(escaped, typed);
+		session_send(out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+				"\"params\":{\"textDocument\":{\"uri\":\"file:///bench.lox\",\"version\":%d},"
+				"\"contentChanges\":[{\"range\":{\"start\":{\"line\":%d,\"character\":%d},"
+				"\"end\":{\"line\":%d,\"character\":%d}},\"text\":\"%s\"}]}}",
+				++*version, line, column, line, column, escaped);
+		if (*p == '\n') {
+			line++;
+			column = 0;
+		} else {
+			column++;
+		}
+	}
+	for (int i = first; i < line; i++) {
+		session_send(out, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+				"\"params\":{\"textDocument\":{\"uri\":\"file:///bench.lox\",\"version\":%d},"
+				"\"contentChanges\":[{\"range\":{\"start\":{\"line\":%d,\"character\":0},"
+				"\"end\":{\"line\":%d,\"character\":0}},\"text\":\"\"}]}}",
+				++*version, first, first + 1);
+	}
+}
+
+/*
+ * An editor opening a generated script of about lines lines, typing a
+ * function into the middle of it and a variable at the top, each followed
+ * by taking it out again
+ */
+void session_generate(FILE *out, int lines)
+{
+	shape_t *mixed = &shapes[sizeof(shapes) / sizeof(shapes[0]) - 1];
+	source_t *source = generate(mixed, (size_t) lines * 50);
+	session_send(out, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\","
+			"\"params\":{\"processId\":null,\"rootUri\":null,\"capabilities\":{}}}");
+	session_send(out, "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}");
+	char *open;
+	size_t length;
+	FILE *m = open_memstream(&open, &length);
+	fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":"
+			"{\"textDocument\":{\"uri\":\"file:///bench.lox\",\"languageId\":\"radish\","
+			"\"version\":0,\"text\":", m);
+	json_write_string(m, source->data, source->length);
+	fputs("}}}", m);
+	fclose(m);
+	fprintf(out, "Content-Length: %zu\r\n\r\n", length);
+	fwrite(open, 1, length, out);
+	free(open);
+	int version = 0;
+	int middle = count_newlines(source->data, source->data + source->length) / 2;
+	session_type(out, &version, middle, "fun typed(a, b) {\n\tvar c = a + b;\n"
+			"\tif (c > 10) print \"big\";\n\treturn c;\n}\n");
+	session_type(out, &version, 0, "var typed = 1;\n");
+	session_send(out, "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"shutdown\"}");
+	session_send(out, "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+	source_close(source);
+}
+
+int compare_times(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * rd bench-lsp <lines|session> [-o session]
+ * Time rd lsp handling each message of a session recorded with rd lsp
+ * --record, or of one made up around a script of about lines lines. -o
+ * writes the made up session out instead.
+ */
+int bench_lsp(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: rd bench-lsp <lines|session> [-o session]\n");
+		return 1;
+	}
+	char *session;
+	size_t size;
+	char *end;
+	long lines = strtol(argv[2], &end, 10);
+	if (*end) {
+		FILE *in = fopen(argv[2], "r");
+		if (!in) {
+			fprintf(stderr, "Error reading file: %s\n", argv[2]);
+			return 1;
+		}
+		FILE *m = open_memstream(&session, &size);
+		char buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), in))) {
+			fwrite(buf, 1, n, m);
+		}
+		fclose(m);
+		fclose(in);
+	} else {
+		FILE *m = open_memstream(&session, &size);
+		session_generate(m, lines);
+		fclose(m);
+		if (argc == 5 && !strcmp(argv[3], "-o")) {
+			FILE *out = fopen(argv[4], "w");
+			if (!out) {
+				fprintf(stderr, "Error writing file: %s\n", argv[4]);
+				free(session);
+				return 1;
+			}
+			fwrite(session, 1, size, out);
+			fclose(out);
+			free(session);
+			return 0;
+		}
+	}
+
+	/* Replayed until there is enough to go on, into /dev/null */
+	FILE *null = fopen("/dev/null", "w");
+	double *changes = NULL;
+	int changes_length = 0, changes_capacity = 0, messages = 0, reps = 0;
+	double open = 0, total = 0;
+	long reparsed = 0;
+	size_t bytes = 0;
+	do {
+		FILE *in = fmemopen(session, size, "r");
+		lsp_t lsp;
+		lsp_init(&lsp, in, null);
+		char *message;
+		size_t length;
+		while ((message = lsp_read(in, &length))) {
+			int change = strstr(message, "\"textDocument/didChange\"") != NULL;
+			int opening = strstr(message, "\"textDocument/didOpen\"") != NULL;
+			double start = now();
+			lsp_message(&lsp, message, length);
+			double elapsed = now() - start;
+			total += elapsed;
+			if (opening) {
+				open += elapsed;
+				bytes = lsp.documents[lsp.documents_length - 1].document->length;
+			}
+			if (change) {
+				if (changes_length == changes_capacity) {
+					changes_capacity = changes_capacity ? changes_capacity * 2 : 256;
+					changes = realloc(changes, changes_capacity * sizeof(double));
+				}
+				changes[changes_length++] = elapsed;
+				reparsed += lsp.documents[0].document->reparsed;
+			}
+			messages += !reps;
+			free(message);
+		}
+		lsp_free(&lsp);
+		fclose(in);
+		reps++;
+	} while (total < BENCH_MIN_TIME);
+	fclose(null);
+	free(session);
+
+	printf("session: %d messages, %d runs\n", messages, reps);
+	printf("  open    %8.3f ms  %zu bytes parsed whole\n", open / reps * 1e3, bytes);
+	if (changes_length) {
+		qsort(changes, changes_length, sizeof(double), compare_times);
+		printf("  change  %8.3f ms median  %8.3f ms p99  %8.3f ms max  "
+				"%.1f chunks parsed each\n", changes[changes_length / 2] * 1e3,
+				changes[changes_length * 99 / 100] * 1e3,
+				changes[changes_length - 1] * 1e3, (double) reparsed / changes_length);
+	}
+	free(changes);
+	return 0;
+}
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+ * Calls to malloc and friends while counting is set, glibc lets these stand
+ * in for its own. Sanitizers bring their own and are left alone.
+ */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+int counting;
+long allocations;
+
+void *malloc(size_t size)
+{
+	if (counting) {
+		allocations++;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	if (counting) {
+		allocations++;
+	}
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting) {
+		allocations++;
+	}
+	return __libc_realloc(ptr, size);
+}
+#define ALLOCATIONS_COUNTED 1
+#else
+int counting;
+long allocations;
+#define ALLOCATIONS_COUNTED 0
+#endif
+
+/* Arithmetic nodes evaluated by one iteration of the first loop below */
+#define BENCH_EVAL_NODES 6
+/* Size of scope the env size is given for */
+#define BENCH_EVAL_LOCALS 8
+
+/* Arithmetic, then short strings put together and compared to a key */
+const char *bench_eval_loops[] = {
+	"{ var i = 0; var s = 0; while (i < %ld) { s = i * i + i - i / 2; i = i + 1; } }",
+	"{ var i = 0; var n = 0; var a = \"na\"; var b = \"me\"; var key = \"name\"; "
+		"while (i < %ld) { var k = a + b; if (k == key) n = n + 1; i = i + 1; } }",
+};
+
+/*
+ * Allocations and time running a loop iterations times, only folded so
+ * every node of it is evaluated
+ */
+void bench_eval_run(const char *loop, long iterations, long *counted, double *elapsed)
+{
+	char text[256];
+	int length = snprintf(text, sizeof(text), loop, iterations);
+	source_t source = { text, length, 0, NULL };
+	array_t *array = lex_source(&source);
+	arena_t *arena = arena_create();
+	stmt_array_t *stmts = parse_tokens(array, arena);
+	optimize(arena, stmts);
+	flat_t *flat = flat_create();
+	node_t root = flatten(flat, stmts);
+	resolve(flat, root);
+
+	allocations = 0;
+	counting = 1;
+	double start = now();
+	interpret(flat, root);
+	*elapsed = now() - start;
+	counting = 0;
+	*counted = allocations;
+
+	flat_free(flat);
+	arena_free(arena);
+	free_array(array);
+}
+
+/* Allocations and time per iteration of a loop, less starting the program */
+void bench_eval_loop(const char *loop, long iterations, double *each, double *elapsed)
+{
+	long base, counted;
+	/* The first run also interns the names */
+	bench_eval_run(loop, 1, &base, elapsed);
+	bench_eval_run(loop, 1, &base, elapsed);
+	bench_eval_run(loop, iterations + 1, &counted, elapsed);
+	*each = (double) (counted - base) / iterations;
+}
+
+/*
+ * rd bench-eval <iterations>
+ * What evaluating arithmetic and short strings costs, allocations are told
+ * apart from the fixed ones of starting a program by running two lengths
+ * of each loop. Also how big values and envs are in this build.
+ */
+int bench_eval(int argc, char **argv)
+{
+	long iterations = argc > 2 ? strtol(argv[2], NULL, 10) : 0;
+	if (iterations < 1) {
+		fprintf(stderr, "Usage: rd bench-eval <iterations>\n");
+		return 1;
+	}
+	double each, elapsed;
+	bench_eval_loop(bench_eval_loops[0], iterations, &each, &elapsed);
+	printf("eval: %ld iterations, %d arithmetic nodes each\n", iterations, BENCH_EVAL_NODES);
+	printf("  time   %8.1f ns  per iteration\n", elapsed / iterations * 1e9);
+	if (ALLOCATIONS_COUNTED) {
+		printf("  allocs %8.2f     per iteration  %.2f per arithmetic node\n", each,
+				each / BENCH_EVAL_NODES);
+	} else {
+		printf("  allocs      n/a  not counted in this build\n");
+	}
+
+	bench_eval_loop(bench_eval_loops[1], iterations, &each, &elapsed);
+	printf("strings: %ld iterations, a 4 byte concatenation and key comparison each\n",
+			iterations);
+	printf("  time   %8.1f ns  per iteration\n", elapsed / iterations * 1e9);
+	if (ALLOCATIONS_COUNTED) {
+		printf("  allocs %8.2f     per iteration\n", each);
+	} else {
+		printf("  allocs      n/a  not counted in this build\n");
+	}
+	/* Build with and without -DNAN_BOXING to compare */
+#ifdef NAN_BOXING
+	const char *representation = "NaN boxed";
+#else
+	const char *representation = "tagged union";
+#endif
+	if (SHORT_STRING_SIZE > 0) {
+		printf("  value  %8zu B   %s, strings of up to %d B kept in it\n", sizeof(value_t),
+				representation, SHORT_STRING_SIZE);
+	} else {
+		printf("  value  %8zu B   %s\n", sizeof(value_t), representation);
+	}
+	printf("  env    %8zu B   scope of %d locals, %zu B of globals table\n",
+			sizeof(scope_t) + BENCH_EVAL_LOCALS * sizeof(value_t), BENCH_EVAL_LOCALS,
+			DEFAULT_HT_SIZE * sizeof(ht_t));
+	free_symbols();
+	return 0;
+}
@@ -0,0 +1,717 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "parser.h"
+#include "pool.h"
+#include "symbol.h"
+
+enum {
+	SECTION_EXPRS,
+	SECTION_LINES,
+	SECTION_STMTS,
+	SECTION_LISTS,
+	SECTION_CONSTANTS,
+	SECTION_NAMES,
+	SECTION_FUNCTIONS,
+	SECTION_SCOPES,
+	SECTION_SYMBOLS,
+	SECTION_STRINGS,
+	SECTION_END,
+};
+
+int cache_disabled;
+
+/* Where fnv() starts from */
+#define FNV_BASIS 14695981039346656037ull
+
+/* FNV-1a taking 8 bytes at a step, the source is hashed on every run */
+uint64_t fnv(uint64_t h, const void *data, size_t length)
+{
+	const unsigned char *p = data;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, 8);
+		h ^= word;
+		h *= 1099511628211ull;
+	}
+	for (; i < length; i++) {
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/*
+ * Hash of a cache file after its header, read on every load. Four words
+ * are taken at a step into lanes of their own so the multiplies overlap.
+ */
+uint64_t cache_checksum(const char *data, size_t length)
+{
+	uint64_t lanes[4] = { FNV_BASIS, FNV_BASIS + 1, FNV_BASIS + 2, FNV_BASIS + 3 };
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		for (int j = 0; j < 4; j++) {
+			uint64_t word;
+			memcpy(&word, data + i + j * 8, 8);
+			lanes[j] = (lanes[j] ^ word) * 1099511628211ull;
+		}
+	}
+	return fnv(fnv(FNV_BASIS, lanes, sizeof(lanes)), data + i, length - i);
+}
+
+/*
+ * Hash of the source, seeded with the version and the layout of the
+ * pools so a different build never loads what another one wrote
+ */
+uint64_t cache_key(source_t *source)
+{
+	size_t layout[] = { CACHE_FORMAT, sizeof(flat_expr_t), sizeof(flat_stmt_t),
+		sizeof(value_t), sizeof(flat_fn_t), sizeof(flat_scope_t) };
+	uint64_t h = FNV_BASIS;
+	h = fnv(h, VERSION, strlen(VERSION));
+	h = fnv(h, layout, sizeof(layout));
+	return fnv(h, source->data, source->length);
+}
+
+size_t cache_align(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+/*
+ * Where each section of a cached program starts, returns the size of the
+ * whole file
+ */
+size_t cache_layout(cache_header_t *header, size_t *offsets)
+{
+	size_t sizes[SECTION_END] = {
+		header->exprs * sizeof(flat_expr_t),
+		header->exprs * sizeof(int),
+		header->stmts * sizeof(flat_stmt_t),
+		header->lists * sizeof(node_t),
+		header->constants * sizeof(value_t),
+		header->names * sizeof(symbol_t *),
+		header->functions * sizeof(flat_fn_t),
+		header->scopes * sizeof(flat_scope_t),
+		header->symbols * sizeof(uint64_t),
+		header->strings,
+	};
+	size_t offset = cache_align(sizeof(cache_header_t));
+	for (int i = 0; i < SECTION_END; i++) {
+		offsets[i] = offset;
+		offset += cache_align(sizes[i]);
+	}
+	return offset;
+}
+
+/*
+ * $RD_CACHE_DIR, else radish under $XDG_CACHE_HOME or ~/.cache, made when
+ * create is set. 0 when there is nowhere to put it.
+ */
+int cache_dir(char *dir, int create)
+{
+	const char *env = getenv("RD_CACHE_DIR");
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (env && *env) {
+		snprintf(dir, PATH_MAX, "%s", env);
+	} else if (base && *base) {
+		snprintf(dir, PATH_MAX, "%s/radish", base);
+	} else if (home && *home) {
+		snprintf(dir, PATH_MAX, "%s/.cache", home);
+		if (create) {
+			mkdir(dir, 0755);
+		}
+		snprintf(dir, PATH_MAX, "%s/.cache/radish", home);
+	} else {
+		return 0;
+	}
+	if (create && mkdir(dir, 0755) == -1) {
+		struct stat st;
+		return stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+	}
+	return 1;
+}
+
+/* Cache file of a source, named by its key so copies of a script share it */
+int cache_path(source_t *source, char *path, int create)
+{
+	char dir[PATH_MAX];
+	if (!cache_dir(dir, create)) {
+		return 0;
+	}
+	return snprintf(path, PATH_MAX, "%s/%016llx.rdc", dir,
+			(unsigned long long) cache_key(source)) < PATH_MAX;
+}
+
+/* Whether a whole string_t is at offset in a strings section of size bytes */
+int cache_string_valid(char *strings, uint64_t size, uint64_t offset)
+{
+	if (offset % 8 || offset > size || size - offset < sizeof(string_t)) {
+		return 0;
+	}
+	string_t *string = (string_t *) (strings + offset);
+	return string->length >= 0 && (uint64_t) string->length < size - offset - sizeof(string_t);
+}
+
+/*
+ * Whether a cache file whose header matches can be trusted: its payload
+ * hashes to the checksum, and every offset cache_load() follows or fixes
+ * up stays in its section
+ */
+int cache_valid(char *map, size_t size, size_t *offsets)
+{
+	cache_header_t *header = (cache_header_t *) map;
+	char *payload = map + offsets[0];
+	if (header->checksum != cache_checksum(payload, size - offsets[0]) ||
+			header->root >= header->stmts) {
+		return 0;
+	}
+	char *strings = map + offsets[SECTION_STRINGS];
+	uint64_t *offset = (uint64_t *) (map + offsets[SECTION_SYMBOLS]);
+	for (uint32_t i = 0; i < header->symbols; i++) {
+		if (!cache_string_valid(strings, header->strings, offset[i])) {
+			return 0;
+		}
+	}
+	symbol_t **names = (symbol_t **) (map + offsets[SECTION_NAMES]);
+	for (uint32_t i = 1; i < header->names; i++) {
+		if ((uintptr_t) names[i] >= header->symbols) {
+			return 0;
+		}
+	}
+	flat_fn_t *functions = (flat_fn_t *) (map + offsets[SECTION_FUNCTIONS]);
+	for (uint32_t i = 1; i < header->functions; i++) {
+		if ((uintptr_t) functions[i].name >= header->symbols) {
+			return 0;
+		}
+	}
+	value_t *constants = (value_t *) (map + offsets[SECTION_CONSTANTS]);
+	for (uint32_t i = 1; i < header->constants; i++) {
+		if (IS_STRING(constants[i]) && !cache_string_valid(strings, header->strings,
+					(uintptr_t) AS_STRING(constants[i]))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether [start, start + length) is all in lists */
+int cache_list(flat_t *flat, node_t start, int length)
+{
+	return length >= 0 && (uint64_t) start + length <= (uint64_t) flat->lists_length;
+}
+
+/* Whether index is a name, 0 is none */
+int cache_name(flat_t *flat, node_t index)
+{
+	return index && index < (node_t) flat->names_length;
+}
+
+/* Whether a local count - 1 scopes up from scope has slot */
+int cache_local(cache_scope_t *scope, int count, node_t slot)
+{
+	while (scope && --count) {
+		scope = scope->enclosing;
+	}
+	return scope && slot < (node_t) scope->slots;
+}
+
+/* Whether slots is as many as locals can be declared, each under a name */
+int cache_slots(flat_t *flat, int slots)
+{
+	return slots >= 0 && slots < flat->names_length + flat->functions_length;
+}
+
+int cache_expr(cache_walk_t *walk, cache_scope_t *scope, node_t node)
+{
+	flat_t *flat = walk->flat;
+	if (!node) {
+		return 1;
+	}
+	if (node >= (node_t) flat->exprs_length || walk->exprs[node]) {
+		return 0;
+	}
+	walk->exprs[node] = 1;
+	flat_expr_t *expr = &flat->exprs[node];
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			return expr->a && expr->a < (node_t) flat->constants_length;
+
+		case EXPR_VARIABLE:
+			return expr->count ? cache_local(scope, expr->count, expr->a) :
+				cache_name(flat, expr->a);
+
+		case EXPR_ASSIGN:
+			return (expr->count ? cache_local(scope, expr->count, expr->a) :
+					cache_name(flat, expr->a)) && cache_expr(walk, scope, expr->b);
+
+		case EXPR_BINARY:
+		case EXPR_LOGICAL:
+			return cache_expr(walk, scope, expr->a) && cache_expr(walk, scope, expr->b);
+
+		case EXPR_UNARY:
+			return cache_expr(walk, scope, expr->a);
+
+		case EXPR_CALL:
+			if (!cache_expr(walk, scope, expr->a) || !cache_list(flat, expr->b, expr->count)) {
+				return 0;
+			}
+			for (int i = 0; i < expr->count; i++) {
+				if (!cache_expr(walk, scope, flat->lists[expr->b + i])) {
+					return 0;
+				}
+			}
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+int cache_stmt(cache_walk_t *walk, cache_scope_t *scope, node_t node);
+
+/* Statements of the block node, which has not been met yet, in scope */
+int cache_block(cache_walk_t *walk, cache_scope_t *scope, node_t node)
+{
+	flat_t *flat = walk->flat;
+	if (!node || node >= (node_t) flat->stmts_length || walk->stmts[node]) {
+		return 0;
+	}
+	flat_stmt_t *block = &flat->stmts[node];
+	if (block->type != STMT_BLOCK || block->b > INT_MAX ||
+			!cache_list(flat, block->a, block->b)) {
+		return 0;
+	}
+	walk->stmts[node] = 1;
+	for (node_t i = 0; i < block->b; i++) {
+		if (!cache_stmt(walk, scope, flat->lists[block->a + i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* A function declared in scope, its body runs in the scope of a call */
+int cache_fn(cache_walk_t *walk, cache_scope_t *scope, node_t function)
+{
+	flat_t *flat = walk->flat;
+	if (!function || function >= (node_t) flat->functions_length ||
+			walk->functions[function]) {
+		return 0;
+	}
+	walk->functions[function] = 1;
+	flat_fn_t *fn = &flat->functions[function];
+	if (!cache_list(flat, fn->params, fn->arity) || !cache_slots(flat, fn->slots) ||
+			(fn->slots && fn->slots < fn->arity) || fn->scope >= (node_t) flat->scopes_length) {
+		return 0;
+	}
+	for (int i = 0; i < fn->arity; i++) {
+		if (!cache_name(flat, flat->lists[fn->params + i])) {
+			return 0;
+		}
+	}
+	cache_scope_t call = { scope, fn->slots };
+	return cache_block(walk, fn->slots ? &call : scope, fn->body);
+}
+
+int cache_stmt(cache_walk_t *walk, cache_scope_t *scope, node_t node)
+{
+	flat_t *flat = walk->flat;
+	if (!node) {
+		return 1;
+	}
+	if (node >= (node_t) flat->stmts_length || walk->stmts[node]) {
+		return 0;
+	}
+	flat_stmt_t *stmt = &flat->stmts[node];
+	/* Made when a loop or block body has one, as the interpreter does */
+	cache_scope_t inner = { scope, 1 };
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			inner.slots = stmt->c;
+			return cache_slots(flat, stmt->c) &&
+				cache_block(walk, stmt->c ? &inner : scope, node);
+
+		case STMT_EXPR:
+		case STMT_PRINT:
+		case STMT_RETURN:
+			walk->stmts[node] = 1;
+			return cache_expr(walk, scope, stmt->a);
+
+		case STMT_VAR:
+			walk->stmts[node] = 1;
+			return (stmt->c ? cache_local(scope, 1, stmt->a) : cache_name(flat, stmt->a)) &&
+				cache_expr(walk, scope, stmt->b);
+
+		case STMT_IF:
+			walk->stmts[node] = 1;
+			return cache_expr(walk, scope, stmt->a) && cache_stmt(walk, scope, stmt->b) &&
+				cache_stmt(walk, scope, stmt->c);
+
+		case STMT_WHILE:
+			walk->stmts[node] = 1;
+			return cache_expr(walk, scope, stmt->a) && cache_stmt(walk, scope, stmt->b);
+
+		case STMT_FOR: {
+			walk->stmts[node] = 1;
+			if (!cache_list(flat, stmt->c, 2) || stmt->a >= (node_t) flat->stmts_length) {
+				return 0;
+			}
+			cache_scope_t *loop = stmt->a && flat->stmts[stmt->a].type == STMT_VAR ?
+				&inner : scope;
+			return cache_stmt(walk, loop, stmt->a) && cache_expr(walk, loop, stmt->b) &&
+				cache_expr(walk, loop, flat->lists[stmt->c]) &&
+				cache_stmt(walk, loop, flat->lists[stmt->c + 1]);
+		}
+
+		case STMT_RANGE:
+			walk->stmts[node] = 1;
+			return cache_list(flat, stmt->c, 2) && cache_name(flat, flat->lists[stmt->c]) &&
+				cache_expr(walk, scope, stmt->a) && cache_expr(walk, scope, stmt->b) &&
+				cache_stmt(walk, &inner, flat->lists[stmt->c + 1]);
+
+		case STMT_FUN:
+			walk->stmts[node] = 1;
+			return (!stmt->b || cache_local(scope, 1, stmt->b - 1)) &&
+				cache_fn(walk, scope, stmt->a);
+
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Whether every index in the pools of a loaded program stays in its pool,
+ * walking from the block root as the interpreter would. Locals must be in
+ * a scope around them, and each node be met once so the walk ends.
+ */
+int cache_nodes_valid(flat_t *flat, node_t root)
+{
+	for (int i = 1; i < flat->scopes_length; i++) {
+		flat_scope_t *scope = &flat->scopes[i];
+		if (scope->enclosing >= (node_t) i || !cache_list(flat, scope->names, scope->length)) {
+			return 0;
+		}
+		for (int j = 0; j < scope->length; j++) {
+			if (!cache_name(flat, flat->lists[scope->names + j])) {
+				return 0;
+			}
+		}
+	}
+	cache_walk_t walk = { flat, NULL, NULL, NULL };
+	walk.exprs = calloc(flat->exprs_length + flat->stmts_length + flat->functions_length, 1);
+	walk.stmts = walk.exprs + flat->exprs_length;
+	walk.functions = walk.stmts + flat->stmts_length;
+	int ok = cache_block(&walk, NULL, root);
+	free(walk.exprs);
+	return ok;
+}
+
+/*
+ * The program parsed from source last time it was stored, with its pools
+ * mapped from the cache file, NULL when there is none for it or it can't
+ * be trusted. Only symbols and string constants need fixing up.
+ */
+flat_t *cache_load(source_t *source, node_t *root)
+{
+	if (cache_disabled || !source->data) {
+		return NULL;
+	}
+	char path[PATH_MAX];
+	if (!cache_path(source, path, 0)) {
+		return NULL;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(cache_header_t)) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = st.st_size;
+	/* Private so the fixups stay in this process */
+	char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	cache_header_t *header = (cache_header_t *) map;
+	size_t offsets[SECTION_END];
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+			header->format != CACHE_FORMAT || header->key != cache_key(source) ||
+			header->length != source->length || header->strings > size ||
+			cache_layout(header, offsets) != size || !cache_valid(map, size, offsets)) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	flat_t *flat = malloc(sizeof(flat_t));
+	flat->exprs = (flat_expr_t *) (map + offsets[SECTION_EXPRS]);
+	flat->lines = (int *) (map + offsets[SECTION_LINES]);
+	flat->exprs_length = flat->exprs_capacity = header->exprs;
+	flat->stmts = (flat_stmt_t *) (map + offsets[SECTION_STMTS]);
+	flat->stmts_length = flat->stmts_capacity = header->stmts;
+	flat->lists = (node_t *) (map + offsets[SECTION_LISTS]);
+	flat->lists_length = flat->lists_capacity = header->lists;
+	flat->constants = (value_t *) (map + offsets[SECTION_CONSTANTS]);
+	flat->constants_length = flat->constants_capacity = header->constants;
+	flat->names = (symbol_t **) (map + offsets[SECTION_NAMES]);
+	flat->names_length = flat->names_capacity = header->names;
+	flat->functions = (flat_fn_t *) (map + offsets[SECTION_FUNCTIONS]);
+	flat->functions_length = flat->functions_capacity = header->functions;
+	flat->scopes = (flat_scope_t *) (map + offsets[SECTION_SCOPES]);
+	flat->scopes_length = flat->scopes_capacity = header->scopes;
+	flat->strings = NULL;
+	flat->map = map;
+	flat->map_size = size;
+	if (!cache_nodes_valid(flat, header->root)) {
+		free(flat);
+		munmap(map, size);
+		return NULL;
+	}
+
+	char *strings = map + offsets[SECTION_STRINGS];
+	uint64_t *offset = (uint64_t *) (map + offsets[SECTION_SYMBOLS]);
+	symbol_t **symbols = malloc((header->symbols + 1) * sizeof(symbol_t *));
+	for (uint32_t i = 0; i < header->symbols; i++) {
+		string_t *name = (string_t *) (strings + offset[i]);
+		symbols[i] = intern(name->chars, name->length);
+	}
+	for (int i = 1; i < flat->names_length; i++) {
+		flat->names[i] = symbols[(uintptr_t) flat->names[i]];
+	}
+	for (int i = 1; i < flat->functions_length; i++) {
+		flat->functions[i].name = symbols[(uintptr_t) flat->functions[i].name];
+	}
+	for (int i = 1; i < flat->constants_length; i++) {
+		value_t *constant = &flat->constants[i];
+		if (IS_STRING(*constant)) {
+			*constant = STRING_VAL((string_t *) (strings + (uintptr_t) AS_STRING(*constant)));
+		}
+	}
+	free(symbols);
+	*root = header->root;
+	return flat;
+}
+
+/* Copy a string_t into the strings section, returns its offset there */
+uint64_t cache_string(char *strings, uint64_t *used, const char *chars, int length)
+{
+	uint64_t offset = *used;
+	string_t *string = (string_t *) (strings + offset);
+	string->length = length;
+	/* Never freed, it goes when the cache is unmapped */
+	string->refs = 0;
+	string->hash = string_hash(STRING_HASH, chars, length);
+	memcpy(string->chars, chars, length);
+	string->chars[length] = '\0';
+	*used += cache_align(sizeof(string_t) + length + 1);
+	return offset;
+}
+
+void cache_symbol(cache_header_t *header, symbol_t **symbols, uint32_t *index,
+		symbol_t *name)
+{
+	if (!index[name->id]) {
+		symbols[header->symbols] = name;
+		index[name->id] = ++header->symbols;
+		header->strings += cache_align(sizeof(string_t) + name->length + 1);
+	}
+}
+
+/*
+ * Write a resolved program for cache_load() to find next time source is
+ * run. Programs with lazy bodies left are not stored, they would have to
+ * grow pools that are mapped. 0 when nothing was written.
+ */
+int cache_store(source_t *source, flat_t *flat, node_t root)
+{
+	if (cache_disabled || !source->data) {
+		return 0;
+	}
+	for (int i = 1; i < flat->functions_length; i++) {
+		if (!flat->functions[i].body) {
+			return 0;
+		}
+	}
+
+	/* Each distinct symbol is written once, by the order it is first seen */
+	int ids = 0;
+	for (int i = 1; i < flat->names_length; i++) {
+		ids = flat->names[i]->id >= ids ? flat->names[i]->id + 1 : ids;
+	}
+	for (int i = 1; i < flat->functions_length; i++) {
+		symbol_t *name = flat->functions[i].name;
+		ids = name->id >= ids ? name->id + 1 : ids;
+	}
+	/* Index of each symbol plus one, 0 when it has none yet */
+	uint32_t *index = calloc(ids + 1, sizeof(uint32_t));
+	symbol_t **symbols = malloc((flat->names_length + flat->functions_length) *
+			sizeof(symbol_t *));
+	cache_header_t header = { CACHE_MAGIC, CACHE_FORMAT, cache_key(source), 0,
+		source->length, root, flat->exprs_length, flat->stmts_length,
+		flat->lists_length, flat->constants_length, flat->names_length,
+		flat->functions_length, flat->scopes_length, 0, 0 };
+	for (int i = 1; i < flat->names_length; i++) {
+		cache_symbol(&header, symbols, index, flat->names[i]);
+	}
+	for (int i = 1; i < flat->functions_length; i++) {
+		cache_symbol(&header, symbols, index, flat->functions[i].name);
+	}
+	for (int i = 1; i < flat->constants_length; i++) {
+		if (IS_STRING(flat->constants[i])) {
+			string_t *string = AS_STRING(flat->constants[i]);
+			header.strings += cache_align(sizeof(string_t) + string->length + 1);
+		}
+	}
+
+	size_t offsets[SECTION_END];
+	size_t size = cache_layout(&header, offsets);
+	/* Zeroed so padding and the unused entry 0 of each pool are written as 0 */
+	char *buf = calloc(1, size);
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + offsets[SECTION_EXPRS] + sizeof(flat_expr_t), flat->exprs + 1,
+			(flat->exprs_length - 1) * sizeof(flat_expr_t));
+	memcpy(buf + offsets[SECTION_LINES] + sizeof(int), flat->lines + 1,
+			(flat->exprs_length - 1) * sizeof(int));
+	memcpy(buf + offsets[SECTION_STMTS] + sizeof(flat_stmt_t), flat->stmts + 1,
+			(flat->stmts_length - 1) * sizeof(flat_stmt_t));
+	memcpy(buf + offsets[SECTION_LISTS] + sizeof(node_t), flat->lists + 1,
+			(flat->lists_length - 1) * sizeof(node_t));
+	memcpy(buf + offsets[SECTION_SCOPES] + sizeof(flat_scope_t), flat->scopes + 1,
+			(flat->scopes_length - 1) * sizeof(flat_scope_t));
+
+	char *strings = buf + offsets[SECTION_STRINGS];
+	uint64_t used = 0;
+	uint64_t *offset = (uint64_t *) (buf + offsets[SECTION_SYMBOLS]);
+	for (uint32_t i = 0; i < header.symbols; i++) {
+		offset[i] = cache_string(strings, &used, symbols[i]->name, symbols[i]->length);
+	}
+	symbol_t **names = (symbol_t **) (buf + offsets[SECTION_NAMES]);
+	for (int i = 1; i < flat->names_length; i++) {
+		names[i] = (symbol_t *) (uintptr_t) (index[flat->names[i]->id] - 1);
+	}
+	flat_fn_t *functions = (flat_fn_t *) (buf + offsets[SECTION_FUNCTIONS]);
+	for (int i = 1; i < flat->functions_length; i++) {
+		functions[i] = flat->functions[i];
+		functions[i].name = (symbol_t *) (uintptr_t) (index[functions[i].name->id] - 1);
+		/* Every body is parsed, the source is not needed again */
+		functions[i].source = NULL;
+	}
+	value_t *constants = (value_t *) (buf + offsets[SECTION_CONSTANTS]);
+	for (int i = 1; i < flat->constants_length; i++) {
+		value_t *constant = &flat->constants[i];
+		if (IS_STRING(*constant)) {
+			uint64_t at = cache_string(strings, &used, AS_STRING(*constant)->chars,
+					AS_STRING(*constant)->length);
+			constants[i] = STRING_VAL((string_t *) (uintptr_t) at);
+		} else {
+			constants[i] = *constant;
+		}
+	}
+	free(symbols);
+	free(index);
+	((cache_header_t *) buf)->checksum = cache_checksum(buf + offsets[0], size - offsets[0]);
+
+	/* Written aside and renamed into place, so a reader never sees half */
+	int ok = 0;
+	char path[PATH_MAX], tmp[PATH_MAX + sizeof(".XXXXXX")];
+	if (cache_path(source, path, 1)) {
+		sprintf(tmp, "%s.XXXXXX", path);
+		int fd = mkstemp(tmp);
+		if (fd != -1) {
+			ok = write(fd, buf, size) == (ssize_t) size;
+			close(fd);
+			if (ok && rename(tmp, path) == -1) {
+				ok = 0;
+			}
+			if (!ok) {
+				unlink(tmp);
+			}
+		}
+	}
+	free(buf);
+	return ok;
+}
+
+/* Remove every cached program, returns how many or -1 */
+int cache_clear(void)
+{
+	char dir[PATH_MAX], path[PATH_MAX + NAME_MAX + 2];
+	DIR *d;
+	if (!cache_dir(dir, 0) || !(d = opendir(dir))) {
+		return -1;
+	}
+	int removed = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		/* Left over temporary files too */
+		if (!strstr(entry->d_name, ".rdc")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		removed += unlink(path) == 0;
+	}
+	closedir(d);
+	return removed;
+}
+
+/*
+ * rd cache warm [-j jobs] <filename>...
+ * rd cache clear
+ */
+int cache_command(int argc, char **argv)
+{
+	if (argc == 3 && !strcmp(argv[2], "clear")) {
+		int removed = cache_clear();
+		if (removed < 0) {
+			fprintf(stderr, "No cache directory\n");
+			return 1;
+		}
+		printf("%d cached programs removed\n", removed);
+		return 0;
+	}
+	if (argc < 4 || strcmp(argv[2], "warm")) {
+		fprintf(stderr, "Usage: rd cache warm [-j jobs] <filename>...\n"
+				"       rd cache clear\n");
+		return 1;
+	}
+	char **filenames = malloc(argc * sizeof(char *));
+	int count = 0, jobs = 1;
+	for (int i = 3; i < argc; i++) {
+		if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) && i + 1 < argc) {
+			if (!(jobs = pool_jobs(argv[++i]))) {
+				fprintf(stderr, "rd: -j takes a positive number of jobs, not '%s'\n", argv[i]);
+				free(filenames);
+				return 1;
+			}
+		} else {
+			filenames[count++] = argv[i];
+		}
+	}
+	/* Parsing a script stores it, one that is cached already is just loaded */
+	program_t *programs = parse_files(filenames, count, jobs);
+	int status = 0;
+	for (int i = 0; i < count; i++) {
+		if (programs[i].status) {
+			fprintf(stderr, "%s: could not be parsed\n", programs[i].filename);
+			status = status ? status : programs[i].status;
+		}
+	}
+	free_programs(programs, count);
+	free(filenames);
+	free_symbols();
+	return status;
+}
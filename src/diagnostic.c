@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostic.h"
+
+void diagnostic_add(diagnostics_t *diagnostics, int line, size_t start, int length,
+		const char *message)
+{
+	if (diagnostics->length == diagnostics->capacity) {
+		diagnostics->capacity = diagnostics->capacity ? diagnostics->capacity * 2 :
+			DEFAULT_DIAGNOSTICS_SIZE;
+		diagnostics->items = realloc(diagnostics->items,
+				diagnostics->capacity * sizeof(diagnostic_t));
+	}
+	diagnostic_t *diagnostic = &diagnostics->items[diagnostics->length++];
+	diagnostic->line = line;
+	diagnostic->start = start;
+	diagnostic->length = length;
+	diagnostic->message = strdup(message);
+}
+
+void diagnostics_clear(diagnostics_t *diagnostics)
+{
+	for (int i = 0; i < diagnostics->length; i++) {
+		free(diagnostics->items[i].message);
+	}
+	diagnostics->length = 0;
+}
+
+void diagnostics_free(diagnostics_t *diagnostics)
+{
+	diagnostics_clear(diagnostics);
+	free(diagnostics->items);
+	diagnostics->items = NULL;
+	diagnostics->capacity = 0;
+}
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "document.h"
+#include "flat.h"
+#include "optimize.h"
+#include "parser.h"
+#include "resolve.h"
+#include "scan.h"
+
+/* Index of the last chunk starting at or before offset */
+int chunk_at(document_t *document, size_t offset)
+{
+	int low = 0, high = document->chunks_length - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (document->chunks[mid].start <= offset) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+/*
+ * Parse a chunk from its start and line, then resolve it on its own. That
+ * finds what resolving the whole file would as top level names are global.
+ */
+void chunk_parse(document_t *document, chunk_t *chunk, arena_t *arena, flat_t *flat,
+		int *next_line)
+{
+	memset(&chunk->diagnostics, 0, sizeof(diagnostics_t));
+	stmt_t *stmt = parse_declaration(&document->source, chunk->start, chunk->line, arena,
+			&chunk->diagnostics, &chunk->end, next_line);
+	if (stmt) {
+		stmt_array_t statements = { &stmt, 1, 1 };
+		optimize(arena, &statements);
+		resolve_report(flat, flatten(flat, &statements), &chunk->diagnostics);
+	}
+}
+
+/* The text it ends up with is parsed by the edit of all of it */
+document_t *document_open(const char *text, size_t length)
+{
+	document_t *document = calloc(1, sizeof(document_t));
+	document->capacity = length ? length : 1;
+	document->text = malloc(document->capacity);
+	document->chunks_capacity = DEFAULT_CHUNKS_SIZE;
+	document->chunks = malloc(DEFAULT_CHUNKS_SIZE * sizeof(chunk_t));
+	document_edit(document, 0, 0, text, length);
+	return document;
+}
+
+/*
+ * Replace [start, end) of the text, bytes it had before the edit, with
+ * length bytes of text
+ */
+void document_edit(document_t *document, size_t start, size_t end, const char *text,
+		size_t length)
+{
+	/* How far what follows the edit moves */
+	long delta = (long) length - (long) (end - start);
+	int lines = count_newlines(text, text + length) -
+		count_newlines(document->text + start, document->text + end);
+	if (document->length + delta > document->capacity) {
+		while (document->length + delta > document->capacity) {
+			document->capacity *= 2;
+		}
+		document->text = realloc(document->text, document->capacity);
+	}
+	memmove(document->text + start + length, document->text + end, document->length - end);
+	memcpy(document->text + start, text, length);
+	document->length += delta;
+	document->source.data = document->text;
+	document->source.length = document->length;
+
+	chunk_t *chunks = document->chunks;
+	int length_before = document->chunks_length;
+	/* The one before the chunk edited may end on its first token */
+	int first = length_before ? chunk_at(document, start) : 0;
+	first = first ? first - 1 : 0;
+	chunk_t chunk = { 0, 0, 1, { NULL, 0, 0 } };
+	if (first < length_before) {
+		chunk.start = chunks[first].start;
+		chunk.line = chunks[first].line;
+	}
+
+	/* Chunks parsed again, spliced in over the ones they replace after */
+	chunk_t *fresh = NULL;
+	int fresh_length = 0, fresh_capacity = 0;
+	arena_t *arena = arena_create();
+	flat_t *flat = flat_create();
+	int keep = first;
+	for (;;) {
+		/*
+		 * An old chunk wholly after the edit parses the same when a chunk
+		 * ends where it now starts, the rest is kept from there
+		 */
+		while (keep < length_before && (chunks[keep].start < end ||
+					(long) chunks[keep].start + delta < (long) chunk.start)) {
+			keep++;
+		}
+		if (keep < length_before && (long) chunks[keep].start + delta == (long) chunk.start) {
+			break;
+		}
+		if (chunk.start >= document->length) {
+			break;
+		}
+		int next_line;
+		chunk_parse(document, &chunk, arena, flat, &next_line);
+		if (fresh_length == fresh_capacity) {
+			fresh_capacity = fresh_capacity ? fresh_capacity * 2 : DEFAULT_CHUNKS_SIZE;
+			fresh = realloc(fresh, fresh_capacity * sizeof(chunk_t));
+		}
+		fresh[fresh_length++] = chunk;
+		chunk.start = chunk.end;
+		chunk.line = next_line;
+	}
+	flat_free(flat);
+	arena_free(arena);
+
+	for (int i = first; i < keep; i++) {
+		diagnostics_free(&chunks[i].diagnostics);
+	}
+	int kept = length_before - keep;
+	int chunks_length = first + fresh_length + kept;
+	if (chunks_length > document->chunks_capacity) {
+		while (chunks_length > document->chunks_capacity) {
+			document->chunks_capacity *= 2;
+		}
+		chunks = realloc(chunks, document->chunks_capacity * sizeof(chunk_t));
+	}
+	memmove(chunks + first + fresh_length, chunks + keep, kept * sizeof(chunk_t));
+	if (fresh) {
+		memcpy(chunks + first, fresh, fresh_length * sizeof(chunk_t));
+	}
+	for (int i = first + fresh_length; i < chunks_length; i++) {
+		chunks[i].start += delta;
+		chunks[i].end += delta;
+		chunks[i].line += lines;
+		for (int j = 0; j < chunks[i].diagnostics.length; j++) {
+			chunks[i].diagnostics.items[j].start += delta;
+			chunks[i].diagnostics.items[j].line += lines;
+		}
+	}
+	free(fresh);
+	document->chunks = chunks;
+	document->chunks_length = chunks_length;
+	document->reparsed = fresh_length;
+}
+
+/* Offset line starts at, counting from 1, the length past the last line */
+size_t document_line(document_t *document, int line)
+{
+	size_t offset = 0;
+	int at = 1;
+	/* From the chunk before, chunks start on their first token */
+	if (document->chunks_length) {
+		int low = 0, high = document->chunks_length - 1;
+		while (low < high) {
+			int mid = (low + high + 1) / 2;
+			if (document->chunks[mid].line < line) {
+				low = mid;
+			} else {
+				high = mid - 1;
+			}
+		}
+		if (document->chunks[low].line < line) {
+			offset = document->chunks[low].start;
+			at = document->chunks[low].line;
+		}
+	}
+	while (at < line) {
+		char *newline = memchr(document->text + offset, '\n', document->length - offset);
+		if (!newline) {
+			return document->length;
+		}
+		offset = newline - document->text + 1;
+		at++;
+	}
+	return offset;
+}
+
+/* Line of the text offset is on, counting from 1 */
+int document_line_of(document_t *document, size_t offset)
+{
+	if (!document->chunks_length) {
+		return 1 + count_newlines(document->text, document->text + offset);
+	}
+	chunk_t *chunk = &document->chunks[chunk_at(document, offset)];
+	return chunk->line + count_newlines(document->text + chunk->start,
+			document->text + offset);
+}
+
+void document_free(document_t *document)
+{
+	for (int i = 0; i < document->chunks_length; i++) {
+		diagnostics_free(&document->chunks[i].diagnostics);
+	}
+	free(document->chunks);
+	free(document->text);
+	free(document);
+}
@@ -5,13 +5,11 @@
 #include "env.h"
 #include "interpreter.h"
 
-void free_statement(stmt_t *stmt);
-
 ht_t *ht_init(ht_t *env)
 {	
 	ht_t *ht = malloc(sizeof(ht_t) * DEFAULT_HT_SIZE);
 	for (int i = 0; i < DEFAULT_HT_SIZE; i++) {
-		ht[i].value.type = VAL_NIL;
+		ht[i].value = NIL_VAL;
 		ht[i].name = NULL;
 	}
 	if (env) {
@@ -22,78 +20,49 @@ ht_t *ht_init(ht_t *env)
 	return ht;
 }
 
-unsigned int hash(char *key)
-{
-	unsigned int h = 0;
-	for (; *key; key++)
-		h = 31 * h + *key;
-	return h;
-}
-
-void ht_add(ht_t *ht, char *name, value_t *value)
+void ht_add(ht_t *ht, symbol_t *name, value_t value)
 {
-	unsigned int idx = hash(name) % DEFAULT_HT_SIZE;
+	unsigned int idx = name->hash % DEFAULT_HT_SIZE;
 	/* Linear probing for collision resolution */
 	for (int i = 0; i < DEFAULT_HT_SIZE; i++) {
 		int probe_idx = (idx + i) % DEFAULT_HT_SIZE;
 		if (!ht[probe_idx].name) {
-			ht[probe_idx].name = strdup(name);
-			ht[probe_idx].value.type = value->type;
-			if (value->type == VAL_STRING) {
-				ht[probe_idx].value.as.string = strdup(value->as.string);
-			} else if (value->type == VAL_FN) {
-				ht[probe_idx].value.as.function = malloc(sizeof(fn_t));
-				memcpy(ht[probe_idx].value.as.function, value->as.function, sizeof(fn_t));
-			} else {
-				ht[probe_idx].value.as = value->as;
-			}
+			ht[probe_idx].name = name;
+			ht[probe_idx].value = value;
 			return;
-		} else {
+		} else if (ht[probe_idx].name == name) {
 			ht_replace(ht, name, value);
 			return;
 		}
 	}
 }
 
-value_t *ht_get(ht_t *ht, token_t *name, int check_enclosing)
+value_t *ht_get(ht_t *ht, symbol_t *name, int check_enclosing)
 {
 	if (!ht) {
 		return NULL;
 	}
-	unsigned int idx = hash(name->value) % DEFAULT_HT_SIZE;
-	/* Linear probing to search for the key */
+	unsigned int idx = name->hash % DEFAULT_HT_SIZE;
+	/* Linear probing to search for the key, names are never removed so
+	 * a free slot ends the search */
 	for (int i = 0; i < DEFAULT_HT_SIZE; i++) {
 		int probe_idx = (idx + i) % DEFAULT_HT_SIZE;
-		if (ht[probe_idx].name && !strcmp(ht[probe_idx].name, name->value)) {
-			value_t *val = malloc(sizeof(value_t));
-			memcpy(val, &ht[probe_idx].value, sizeof(value_t));
-			if (val->type == VAL_STRING) {
-				val->as.string = strdup(ht[probe_idx].value.as.string);
-			} else if (val->type == VAL_FN) {
-				val->as.function = malloc(sizeof(fn_t));
-				memcpy(val->as.function, ht[probe_idx].value.as.function, sizeof(fn_t));
-			}
-
-			return val;
+		if (!ht[probe_idx].name) {
+			break;
 		}
-	}
-	if (check_enclosing) {
-		if (ht->enclosing) {
-			return ht_get(ht->enclosing, name, 1);
+		if (ht[probe_idx].name == name) {
+			return &ht[probe_idx].value;
 		}
-	} else {
-		return NULL;
 	}
-
-	char err[512];
-	snprintf(err, 512, "Undefined variable '%s'.", name->value);
-	runtime_error(err, name->line);
+	if (check_enclosing && ht->enclosing) {
+		return ht_get(ht->enclosing, name, 1);
+	}
 	return NULL;
 }
 
-void ht_replace(ht_t *ht, char *name, value_t *value)
+void ht_replace(ht_t *ht, symbol_t *name, value_t value)
 {
-	unsigned int idx = hash(name) % DEFAULT_HT_SIZE;
+	unsigned int idx = name->hash % DEFAULT_HT_SIZE;
 
 	for (int i = 0; i < DEFAULT_HT_SIZE; i++) {
 		int probe_idx = (idx + i) % DEFAULT_HT_SIZE;
@@ -101,54 +70,74 @@ void ht_replace(ht_t *ht, char *name, value_t *value)
 			ht_replace(ht->enclosing, name, value);
 			break;
 		}
-		if (!strcmp(ht[probe_idx].name, name)) {
-			if (ht[probe_idx].value.type == VAL_STRING) {
-				free(ht[probe_idx].value.as.string);
-			} else if (ht[probe_idx].value.type == VAL_FN) {
-				free(ht[probe_idx].value.as.function);
-			}
-			ht[probe_idx].value.type = value->type;
-			ht[probe_idx].value.as = value->as;
-			if (value->type == VAL_STRING) {
-				ht[probe_idx].value.as.string = strdup(value->as.string);
-			} else if (value->type == VAL_FN) {
-				ht[probe_idx].value.as.function = malloc(sizeof(fn_t));
-				memcpy(ht[probe_idx].value.as.function, value->as.function, sizeof(fn_t));
-			}
+		if (ht[probe_idx].name == name) {
+			free_val(ht[probe_idx].value);
+			ht[probe_idx].value = value;
 			return;
 		}
 	}
 }
 
-void ht_assign(ht_t *ht, token_t *name, value_t *value)
+/*
+ * 0 when the name is not defined anywhere, value is still the caller's
+ */
+int ht_assign(ht_t *ht, symbol_t *name, value_t value)
 {
-	value_t *val = ht_get(ht, name, 0);
-	if (val) {
-		ht_replace(ht, name->value, value);
-		free_val(val);
-		return;
+	if (ht_get(ht, name, 0)) {
+		ht_replace(ht, name, value);
+		return 1;
 	}
 	if (ht->enclosing) {
-		ht_assign(ht->enclosing, name, value);
-		return;
+		return ht_assign(ht->enclosing, name, value);
 	}
-	char err[512];
-	snprintf(err, 512, "Undefined variable '%s'.", name->value);
-	runtime_error(err, name->line);
+	return 0;
 }
 
 void ht_free(ht_t *ht)
 {
 	for (int i = 0; i < DEFAULT_HT_SIZE; i++) {
-		if (ht[i].value.type != VAL_NIL) {
-			free(ht[i].name);
-			if (ht[i].value.type == VAL_STRING) {
-				free(ht[i].value.as.string);
-			} else if (ht[i].value.type == VAL_FN) {
-				free(ht[i].value.as.function);
-			}
-		}
+		free_val(ht[i].value);
 	}
 	free(ht);
 }
 
+scope_t *scope_new(scope_t *enclosing, int length)
+{
+	scope_t *scope = malloc(sizeof(scope_t) + length * sizeof(value_t));
+	scope->enclosing = enclosing;
+	scope->length = length;
+	scope->captured = 0;
+	scope->marked = 0;
+	for (int i = 0; i < length; i++) {
+		scope->slots[i] = NIL_VAL;
+	}
+	return scope;
+}
+
+value_t scope_get(scope_t *scope, int slot)
+{
+	return value_copy(scope->slots[slot]);
+}
+
+void scope_set(scope_t *scope, int slot, value_t value)
+{
+	free_val(scope->slots[slot]);
+	scope->slots[slot] = value;
+}
+
+/* Back to how scope_new() left it */
+void scope_clear(scope_t *scope)
+{
+	for (int i = 0; i < scope->length; i++) {
+		free_val(scope->slots[i]);
+		scope->slots[i] = NIL_VAL;
+	}
+}
+
+void scope_free(scope_t *scope)
+{
+	for (int i = 0; i < scope->length; i++) {
+		free_val(scope->slots[i]);
+	}
+	free(scope);
+}
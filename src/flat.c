@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "optimize.h"
+#include "parser.h"
+#include "resolve.h"
+
+node_t flatten_stmt(flat_t *flat, stmt_t *stmt);
+
+/* Make room for one more in a pool */
+void *flat_grow(void *pool, int length, int *capacity, size_t size)
+{
+	if (length == *capacity) {
+		*capacity *= 2;
+		pool = realloc(pool, *capacity * size);
+	}
+	return pool;
+}
+
+/*
+ * Entry 0 of every pool is left unused so 0 can mean no node
+ */
+flat_t *flat_create(void)
+{
+	flat_t *flat = malloc(sizeof(flat_t));
+	flat->exprs = malloc(DEFAULT_FLAT_SIZE * sizeof(flat_expr_t));
+	flat->lines = malloc(DEFAULT_FLAT_SIZE * sizeof(int));
+	flat->exprs_capacity = DEFAULT_FLAT_SIZE;
+	flat->stmts = malloc(DEFAULT_FLAT_SIZE * sizeof(flat_stmt_t));
+	flat->stmts_capacity = DEFAULT_FLAT_SIZE;
+	flat->lists = malloc(DEFAULT_FLAT_SIZE * sizeof(node_t));
+	flat->lists_capacity = DEFAULT_FLAT_SIZE;
+	flat->constants = malloc(DEFAULT_FLAT_SIZE * sizeof(value_t));
+	flat->constants_capacity = DEFAULT_FLAT_SIZE;
+	flat->names = malloc(DEFAULT_FLAT_SIZE * sizeof(symbol_t *));
+	flat->names_capacity = DEFAULT_FLAT_SIZE;
+	flat->functions = malloc(DEFAULT_FLAT_SIZE * sizeof(flat_fn_t));
+	flat->functions_capacity = DEFAULT_FLAT_SIZE;
+	flat->scopes = malloc(DEFAULT_FLAT_SIZE * sizeof(flat_scope_t));
+	flat->scopes_capacity = DEFAULT_FLAT_SIZE;
+	flat->exprs_length = flat->stmts_length = flat->lists_length = 1;
+	flat->constants_length = flat->names_length = flat->functions_length = 1;
+	flat->scopes_length = 1;
+	flat->strings = arena_create();
+	flat->map = NULL;
+	flat->map_size = 0;
+	return flat;
+}
+
+node_t flat_expr(flat_t *flat, flat_expr_t *expr, int line)
+{
+	int capacity = flat->exprs_capacity;
+	flat->exprs = flat_grow(flat->exprs, flat->exprs_length, &flat->exprs_capacity,
+			sizeof(flat_expr_t));
+	flat->lines = flat_grow(flat->lines, flat->exprs_length, &capacity, sizeof(int));
+	flat->exprs[flat->exprs_length] = *expr;
+	flat->lines[flat->exprs_length] = line;
+	return flat->exprs_length++;
+}
+
+node_t flat_stmt(flat_t *flat, flat_stmt_t *stmt)
+{
+	flat->stmts = flat_grow(flat->stmts, flat->stmts_length, &flat->stmts_capacity,
+			sizeof(flat_stmt_t));
+	flat->stmts[flat->stmts_length] = *stmt;
+	return flat->stmts_length++;
+}
+
+/*
+ * Reserve a run of length in lists, filled in by the caller as the
+ * children are flattened
+ */
+node_t flat_list(flat_t *flat, int length)
+{
+	node_t start = flat->lists_length;
+	if (flat->lists_length + length > flat->lists_capacity) {
+		while (flat->lists_length + length > flat->lists_capacity) {
+			flat->lists_capacity *= 2;
+		}
+		flat->lists = realloc(flat->lists, flat->lists_capacity * sizeof(node_t));
+	}
+	flat->lists_length += length;
+	return start;
+}
+
+node_t flat_constant(flat_t *flat, value_t *value)
+{
+	flat->constants = flat_grow(flat->constants, flat->constants_length,
+			&flat->constants_capacity, sizeof(value_t));
+	value_t *constant = &flat->constants[flat->constants_length];
+	*constant = *value;
+	if (IS_STRING(*value) && FITS_SHORT(AS_STRING(*value)->length)) {
+		*constant = short_concat(AS_STRING(*value)->chars, AS_STRING(*value)->length, "", 0);
+	} else if (IS_STRING(*value)) {
+		*constant = STRING_VAL(string_arena(flat->strings, AS_STRING(*value)->chars,
+					AS_STRING(*value)->length));
+	}
+	return flat->constants_length++;
+}
+
+node_t flat_name(flat_t *flat, symbol_t *name)
+{
+	flat->names = flat_grow(flat->names, flat->names_length, &flat->names_capacity,
+			sizeof(symbol_t *));
+	flat->names[flat->names_length] = name;
+	return flat->names_length++;
+}
+
+node_t flat_scope(flat_t *flat, flat_scope_t *scope)
+{
+	flat->scopes = flat_grow(flat->scopes, flat->scopes_length, &flat->scopes_capacity,
+			sizeof(flat_scope_t));
+	flat->scopes[flat->scopes_length] = *scope;
+	return flat->scopes_length++;
+}
+
+node_t flatten_expr(flat_t *flat, expr_t *expr)
+{
+	if (!expr) {
+		return 0;
+	}
+	flat_expr_t node = { expr->type, 0, 0, 0, 0 };
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			node.a = flat_constant(flat, expr->as.literal.value);
+			break;
+
+		case EXPR_VARIABLE:
+			node.a = flat_name(flat, expr->as.variable.name.symbol);
+			break;
+
+		case EXPR_ASSIGN:
+			node.a = flat_name(flat, expr->as.assign.name->as.variable.name.symbol);
+			node.b = flatten_expr(flat, expr->as.assign.value);
+			break;
+
+		case EXPR_BINARY:
+			node.op = expr->as.binary.operator.type;
+			node.a = flatten_expr(flat, expr->as.binary.left);
+			node.b = flatten_expr(flat, expr->as.binary.right);
+			break;
+
+		case EXPR_LOGICAL:
+			node.op = expr->as.logical.operator.type;
+			node.a = flatten_expr(flat, expr->as.logical.left);
+			node.b = flatten_expr(flat, expr->as.logical.right);
+			break;
+
+		case EXPR_UNARY:
+			node.op = expr->as.unary.operator.type;
+			node.a = flatten_expr(flat, expr->as.unary.right);
+			break;
+
+		case EXPR_GROUPING:
+			return flatten_expr(flat, expr->as.grouping.expression);
+
+		case EXPR_CALL:
+			node.a = flatten_expr(flat, expr->as.call.callee);
+			node.count = expr->as.call.args->length;
+			node.b = flat_list(flat, node.count);
+			for (int i = 0; i < node.count; i++) {
+				node_t arg = flatten_expr(flat, expr->as.call.args->arguments[i]);
+				flat->lists[node.b + i] = arg;
+			}
+			break;
+
+		default:
+			break;
+	}
+	return flat_expr(flat, &node, expr->line);
+}
+
+node_t flatten_block(flat_t *flat, stmt_array_t *statements)
+{
+	flat_stmt_t node = { STMT_BLOCK, 0, 0, statements->length, 0 };
+	node.a = flat_list(flat, statements->length);
+	for (int i = 0; i < statements->length; i++) {
+		node_t stmt = flatten_stmt(flat, statements->statements[i]);
+		flat->lists[node.a + i] = stmt;
+	}
+	return flat_stmt(flat, &node);
+}
+
+node_t flatten_function(flat_t *flat, stmt_t *stmt)
+{
+	flat->functions = flat_grow(flat->functions, flat->functions_length,
+			&flat->functions_capacity, sizeof(flat_fn_t));
+	node_t index = flat->functions_length++;
+	array_t *params = stmt->as.function.params;
+	node_t start = flat_list(flat, params->length);
+	for (int i = 0; i < params->length; i++) {
+		node_t name = flat_name(flat, params->tokens[i].symbol);
+		flat->lists[start + i] = name;
+	}
+	node_t body = 0;
+	if (stmt->as.function.body) {
+		body = flatten_stmt(flat, stmt->as.function.body);
+	}
+	flat_fn_t *function = &flat->functions[index];
+	function->name = stmt->as.function.name.symbol;
+	function->params = start;
+	function->arity = params->length;
+	function->body = body;
+	function->source = stmt->as.function.source;
+	function->start = stmt->as.function.start;
+	function->end = stmt->as.function.end;
+	function->line = stmt->as.function.line;
+	function->slots = 0;
+	function->scope = 0;
+	return index;
+}
+
+node_t flatten_stmt(flat_t *flat, stmt_t *stmt)
+{
+	if (!stmt) {
+		return 0;
+	}
+	flat_stmt_t node = { stmt->type, 0, 0, 0, 0 };
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			return flatten_block(flat, stmt->as.block.statements);
+
+		case STMT_EXPR:
+			node.a = flatten_expr(flat, stmt->as.expr.expression);
+			break;
+
+		case STMT_PRINT:
+			node.a = flatten_expr(flat, stmt->as.print.expression);
+			break;
+
+		case STMT_VAR:
+			node.a = flat_name(flat, stmt->as.variable.name.symbol);
+			node.b = flatten_expr(flat, stmt->as.variable.initializer);
+			break;
+
+		case STMT_IF:
+			node.a = flatten_expr(flat, stmt->as._if.condition);
+			node.b = flatten_stmt(flat, stmt->as._if.then_branch);
+			node.c = flatten_stmt(flat, stmt->as._if.else_branch);
+			break;
+
+		case STMT_WHILE:
+			node.a = flatten_expr(flat, stmt->as._while.condition);
+			node.b = flatten_stmt(flat, stmt->as._while.body);
+			break;
+
+		case STMT_FUN:
+			node.a = flatten_function(flat, stmt);
+			break;
+
+		case STMT_RETURN:
+			node.a = flatten_expr(flat, stmt->as._return.value);
+			break;
+
+		case STMT_FOR: {
+			node.a = flatten_stmt(flat, stmt->as._for.initializer);
+			node.b = flatten_expr(flat, stmt->as._for.condition);
+			node.c = flat_list(flat, 2);
+			node_t increment = flatten_expr(flat, stmt->as._for.increment);
+			node_t body = flatten_stmt(flat, stmt->as._for.body);
+			flat->lists[node.c] = increment;
+			flat->lists[node.c + 1] = body;
+			break;
+		}
+
+		case STMT_RANGE: {
+			node.op = stmt->as.range.operator;
+			node.a = flatten_expr(flat, stmt->as.range.start);
+			node.b = flatten_expr(flat, stmt->as.range.end);
+			node.c = flat_list(flat, 2);
+			node_t name = flat_name(flat, stmt->as.range.name.symbol);
+			node_t body = flatten_stmt(flat, stmt->as.range.body);
+			flat->lists[node.c] = name;
+			flat->lists[node.c + 1] = body;
+			break;
+		}
+
+		default:
+			break;
+	}
+	return flat_stmt(flat, &node);
+}
+
+/*
+ * Append a parsed program, the block returned holds its top level
+ * statements. The AST can be freed once it is flattened.
+ */
+node_t flatten(flat_t *flat, stmt_array_t *statements)
+{
+	return flatten_block(flat, statements);
+}
+
+/*
+ * Parse, flatten and resolve the body of a lazy function, 0 after an error
+ * resolving it. Its syntax was checked when the program was parsed.
+ */
+int flat_body(flat_t *flat, node_t function)
+{
+	flat_fn_t fn = flat->functions[function];
+	arena_t *arena = arena_create();
+	stmt_t *body = parse_range(fn.source, fn.start, fn.end, fn.line, arena);
+	int ok = body != NULL;
+	if (body) {
+		optimize(arena, body->as.block.statements);
+		node_t node = flatten_stmt(flat, body);
+		flat->functions[function].body = node;
+		ok = resolve_function(flat, function);
+	}
+	arena_free(arena);
+	return ok;
+}
+
+/* Bytes held by the pools and strings */
+size_t flat_size(flat_t *flat)
+{
+	if (flat->map) {
+		return flat->map_size;
+	}
+	return flat->exprs_capacity * (sizeof(flat_expr_t) + sizeof(int)) +
+		flat->stmts_capacity * sizeof(flat_stmt_t) +
+		flat->lists_capacity * sizeof(node_t) +
+		flat->constants_capacity * sizeof(value_t) +
+		flat->names_capacity * sizeof(symbol_t *) +
+		flat->functions_capacity * sizeof(flat_fn_t) +
+		flat->scopes_capacity * sizeof(flat_scope_t) +
+		flat->strings->total;
+}
+
+void flat_free(flat_t *flat)
+{
+	if (!flat) {
+		return;
+	}
+	if (flat->map) {
+		munmap(flat->map, flat->map_size);
+		free(flat);
+		return;
+	}
+	free(flat->exprs);
+	free(flat->lines);
+	free(flat->stmts);
+	free(flat->lists);
+	free(flat->constants);
+	free(flat->names);
+	free(flat->functions);
+	free(flat->scopes);
+	arena_free(flat->strings);
+	free(flat);
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "gc.h"
+#include "interpreter.h"
+
+size_t gc_threshold = GC_THRESHOLD;
+int gc_stats = 0;
+
+void scope_array_add(scope_array_t *array, scope_t *scope)
+{
+	if (array->length == array->capacity) {
+		array->capacity *= 2;
+		array->scopes = realloc(array->scopes, array->capacity * sizeof(scope_t *));
+	}
+	array->scopes[array->length++] = scope;
+}
+
+void fn_array_add(fn_array_t *array, fn_t *fn)
+{
+	if (array->length == array->capacity) {
+		array->capacity *= 2;
+		array->functions = realloc(array->functions, array->capacity * sizeof(fn_t *));
+	}
+	array->functions[array->length++] = fn;
+}
+
+void gc_init(gc_t *gc)
+{
+	gc->functions.functions = malloc(DEFAULT_FUNCTIONS_SIZE * sizeof(fn_t *));
+	gc->functions.length = 0;
+	gc->functions.capacity = DEFAULT_FUNCTIONS_SIZE;
+	gc->scopes.scopes = malloc(DEFAULT_SCOPES_SIZE * sizeof(scope_t *));
+	gc->scopes.length = 0;
+	gc->scopes.capacity = DEFAULT_SCOPES_SIZE;
+	gc->stack.values = malloc(DEFAULT_STACK_SIZE * sizeof(value_t));
+	gc->stack.length = 0;
+	gc->stack.capacity = DEFAULT_STACK_SIZE;
+	gc->frames.scopes = malloc(DEFAULT_SCOPES_SIZE * sizeof(scope_t *));
+	gc->frames.length = 0;
+	gc->frames.capacity = DEFAULT_SCOPES_SIZE;
+	gc->open.scopes = malloc(DEFAULT_SCOPES_SIZE * sizeof(scope_t *));
+	gc->open.length = 0;
+	gc->open.capacity = DEFAULT_SCOPES_SIZE;
+	gc->gray.functions = malloc(DEFAULT_FUNCTIONS_SIZE * sizeof(fn_t *));
+	gc->gray.length = 0;
+	gc->gray.capacity = DEFAULT_FUNCTIONS_SIZE;
+	gc->epoch = 0;
+	gc->live = 0;
+	gc->threshold = gc_threshold;
+	gc->collections = 0;
+	gc->allocated = 0;
+	gc->freed = 0;
+	gc->peak = 0;
+	gc->time = 0;
+}
+
+size_t scope_size(scope_t *scope)
+{
+	return sizeof(scope_t) + scope->length * sizeof(value_t);
+}
+
+void gc_grow(gc_t *gc, size_t size)
+{
+	gc->live += size;
+	gc->allocated += size;
+	if (gc->live > gc->peak) {
+		gc->peak = gc->live;
+	}
+}
+
+void gc_add_function(gc_t *gc, fn_t *fn)
+{
+	fn->marked = 0;
+	fn_array_add(&gc->functions, fn);
+	gc_grow(gc, sizeof(fn_t));
+}
+
+/* A scope left while a function may still use it */
+void gc_add_scope(gc_t *gc, scope_t *scope)
+{
+	scope_array_add(&gc->scopes, scope);
+	gc_grow(gc, scope_size(scope));
+}
+
+void gc_push(gc_t *gc, value_t value)
+{
+	if (gc->stack.length == gc->stack.capacity) {
+		gc->stack.capacity *= 2;
+		gc->stack.values = realloc(gc->stack.values, gc->stack.capacity * sizeof(value_t));
+	}
+	gc->stack.values[gc->stack.length++] = value;
+}
+
+void gc_mark_value(gc_t *gc, value_t value)
+{
+	if (IS_FN(value) && AS_FN(value)->marked != gc->epoch) {
+		AS_FN(value)->marked = gc->epoch;
+		fn_array_add(&gc->gray, AS_FN(value));
+	}
+}
+
+/* Scope and those around it, up to one already marked */
+void gc_mark_scope(gc_t *gc, scope_t *scope)
+{
+	for (; scope && scope->marked != gc->epoch; scope = scope->enclosing) {
+		scope->marked = gc->epoch;
+		for (int i = 0; i < scope->length; i++) {
+			gc_mark_value(gc, scope->slots[i]);
+		}
+	}
+}
+
+/*
+ * Mark everything reachable from the roots, then free the rest. env is
+ * the scope of whatever is running now.
+ */
+void gc_collect(gc_t *gc, ht_t *globals, scope_t *env)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	gc->epoch++;
+	for (int i = 0; globals && i < DEFAULT_HT_SIZE; i++) {
+		gc_mark_value(gc, globals[i].value);
+	}
+	for (int i = 0; i < gc->stack.length; i++) {
+		gc_mark_value(gc, gc->stack.values[i]);
+	}
+	for (int i = 0; i < gc->frames.length; i++) {
+		gc_mark_scope(gc, gc->frames.scopes[i]);
+	}
+	gc_mark_scope(gc, env);
+	/* Marking a scope can find more functions, so until there are none */
+	while (gc->gray.length) {
+		gc_mark_scope(gc, gc->gray.functions[--gc->gray.length]->env);
+	}
+
+	int kept = 0;
+	for (int i = 0; i < gc->functions.length; i++) {
+		fn_t *fn = gc->functions.functions[i];
+		if (fn->marked == gc->epoch) {
+			gc->functions.functions[kept++] = fn;
+		} else {
+			gc->live -= sizeof(fn_t);
+			gc->freed += sizeof(fn_t);
+			free(fn);
+		}
+	}
+	gc->functions.length = kept;
+	kept = 0;
+	for (int i = 0; i < gc->scopes.length; i++) {
+		scope_t *scope = gc->scopes.scopes[i];
+		if (scope->marked == gc->epoch) {
+			gc->scopes.scopes[kept++] = scope;
+		} else {
+			gc->live -= scope_size(scope);
+			gc->freed += scope_size(scope);
+			scope_free(scope);
+		}
+	}
+	gc->scopes.length = kept;
+
+	gc->threshold = gc->live * GC_GROWTH > gc_threshold ? gc->live * GC_GROWTH : gc_threshold;
+	gc->collections++;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	gc->time += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * After an error jumped out of what was running: the scopes it had not
+ * left are freed with the rest of the heap, and the values on the stack
+ * are let go
+ */
+void gc_unwind(gc_t *gc)
+{
+	for (int i = 0; i < gc->open.length; i++) {
+		gc_add_scope(gc, gc->open.scopes[i]);
+	}
+	for (int i = 0; i < gc->stack.length; i++) {
+		free_val(gc->stack.values[i]);
+	}
+	gc->open.length = 0;
+	gc->stack.length = 0;
+	gc->frames.length = 0;
+}
+
+void gc_report(gc_t *gc)
+{
+	fprintf(stderr, "gc: %d collections in %.3f ms, %zu bytes allocated, %zu freed, "
+			"%zu live at most, %zu at the end\n", gc->collections, gc->time * 1e3,
+			gc->allocated, gc->freed, gc->peak, gc->live);
+}
+
+/* Everything left, at the end of the program */
+void gc_free(gc_t *gc)
+{
+	for (int i = 0; i < gc->functions.length; i++) {
+		free(gc->functions.functions[i]);
+	}
+	for (int i = 0; i < gc->scopes.length; i++) {
+		scope_free(gc->scopes.scopes[i]);
+	}
+	free(gc->functions.functions);
+	free(gc->scopes.scopes);
+	free(gc->stack.values);
+	free(gc->frames.scopes);
+	free(gc->open.scopes);
+	free(gc->gray.functions);
+}
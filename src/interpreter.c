@@ -6,221 +6,157 @@
 
 #include "ast.h"
 #include "env.h"
+#include "flat.h"
 #include "interpreter.h"
 #include "lexer.h"
 #include "parser.h"
 
 typedef struct {
     int has_returned;
-    value_t *value;
+    value_t value;
 } return_state_t;
 
-typedef struct {
-	ht_t **envs;
-	int length;
-	int capacity;
-} ht_array_t;
-
-ht_array_t *hts;
-#define DEFAULT_ENVS_SIZE 50
-
-void evaluate_statement(stmt_t *stmt, ht_t *env, return_state_t *state);
+void evaluate_statement(interpreter_t *interp, node_t node, scope_t *env, return_state_t *state);
 
-void free_val(value_t *value)
+/*
+ * Copy of value for someone else to own. Strings are shared, functions
+ * belong to the interpreter that declared them.
+ */
+value_t value_copy(value_t value)
 {
-	if (!value)
-		return;
-	if (value->type == VAL_STRING) {
-		if (value->as.string) {
-			free(value->as.string);
-		}
-	} else if (value->type == VAL_FN) {
-		if (value->as.function) {
-			free(value->as.function);
-		}
+	if (IS_STRING(value)) {
+		string_ref(AS_STRING(value));
 	}
-	free(value);
+	return value;
 }
 
-value_t *visit_literal(expr_t *expr)
+/* Let go of what value refers to, values themselves are never on the heap */
+void free_val(value_t value)
 {
-	value_t *val = malloc(sizeof(value_t));
-	memcpy(val, expr->as.literal.value, sizeof(value_t));
-	if (val->type == VAL_STRING) {
-		val->as.string = strdup(expr->as.literal.value->as.string);
+	if (IS_STRING(value)) {
+		string_release(AS_STRING(value));
 	}
-	return val;
 }
 
-value_t *visit_grouping(expr_t *expr, ht_t *env)
+value_t visit_literal(interpreter_t *interp, flat_expr_t *expr)
 {
-	return evaluate(expr->as.grouping.expression, env);
+	return value_copy(interp->flat->constants[expr->a]);
 }
 
-void runtime_error(const char *message, int line)
+void runtime_error(interpreter_t *interp, const char *message, int line)
 {
 	fprintf(stderr, "%s\n[line %d]\n", message, line);
 	errno = 70;
-	exit(70);
+	longjmp(interp->error, 1);
+}
+
+int values_equal(value_t left, value_t right)
+{
+	if (VALUE_TYPE(left) != VALUE_TYPE(right)) {
+		return 0;
+	}
+	switch (VALUE_TYPE(left)) {
+		case VAL_NUMBER:
+			return AS_NUMBER(left) == AS_NUMBER(right);
+		case VAL_BOOL:
+			return AS_BOOL(left) == AS_BOOL(right);
+		case VAL_STRING:
+			return string_equal(AS_STRING(left), AS_STRING(right));
+		case VAL_SHORT:
+			return SHORT_EQUAL(left, right);
+		case VAL_NIL:
+			return 1; // nil == nil
+		default:
+			return 0;
+	}
 }
 
-value_t *visit_binary(expr_t *expr, ht_t *env)
+value_t visit_binary(interpreter_t *interp, node_t node, flat_expr_t *expr, scope_t *env)
 {
-	token_type_t op_type = expr->as.binary.operator.type;
-	value_t *right = evaluate(expr->as.binary.right, env);
-	value_t *left = evaluate(expr->as.binary.left, env);
-
-	// Arithmetic
-	if (left->type == VAL_NUMBER && right->type == VAL_NUMBER) {
-		value_t *result = malloc(sizeof(value_t));
-		result->type = VAL_NUMBER;
+	token_type_t op_type = expr->op;
+	value_t right = evaluate(interp, expr->b, env);
+	/* Nothing else may hold a function while the left side runs */
+	if (IS_FN(right)) {
+		gc_push(&interp->gc, right);
+	}
+	value_t left = evaluate(interp, expr->a, env);
+	if (IS_FN(right)) {
+		interp->gc.stack.length--;
+	}
+
+	// Arithmetic and number comparison
+	if (IS_NUMBER(left) && IS_NUMBER(right)) {
+		double a = AS_NUMBER(left), b = AS_NUMBER(right);
 		switch (op_type) {
 			case TOKEN_PLUS:
-				result->as.number = left->as.number + right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
+				return NUMBER_VAL(a + b);
 			case TOKEN_MINUS:
-				result->as.number = left->as.number - right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
+				return NUMBER_VAL(a - b);
 			case TOKEN_STAR:
-				result->as.number = left->as.number * right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
+				return NUMBER_VAL(a * b);
 			case TOKEN_SLASH:
-				if (right->as.number == 0) {
-					runtime_error("Division by zero.", expr->line);
+				if (b == 0) {
+					runtime_error(interp, "Division by zero.", interp->flat->lines[node]);
 				}
-				result->as.number = left->as.number / right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
+				return NUMBER_VAL(a / b);
+			case TOKEN_GREATER:
+				return BOOL_VAL(a > b);
+			case TOKEN_GREATER_EQUAL:
+				return BOOL_VAL(a >= b);
+			case TOKEN_LESS:
+				return BOOL_VAL(a < b);
+			case TOKEN_LESS_EQUAL:
+				return BOOL_VAL(a <= b);
 			default:
 				break;
 		}
-		free_val(result);
 	}
 
 	// Comparison
 	if (op_type == TOKEN_EQUAL_EQUAL || op_type == TOKEN_BANG_EQUAL) {
-		int is_equal;
-		if (left->type != right->type) {
-			is_equal = 0;
-		} else {
-			switch (left->type) {
-				case VAL_NUMBER:
-					is_equal = left->as.number == right->as.number;
-					break;
-
-				case VAL_BOOL:
-					is_equal = left->as.boolean == right->as.boolean;
-					break;
-
-				case VAL_STRING:
-					is_equal = strcmp(left->as.string, right->as.string) == 0;
-					break;
-
-				case VAL_NIL:
-					is_equal = 1; // nil == nil
-					break;
-
-				default:
-					is_equal = 0;
-					break;
-			}
-		}
-		value_t *result = malloc(sizeof(value_t));
-		result->type = VAL_BOOL;
-		result->as.boolean = op_type == TOKEN_EQUAL_EQUAL ? is_equal : !is_equal;
+		int is_equal = values_equal(left, right);
 		free_val(left);
 		free_val(right);
-		return result;
+		return BOOL_VAL(op_type == TOKEN_EQUAL_EQUAL ? is_equal : !is_equal);
 	}
 
-	// Number Comparison
-	if (left->type == VAL_NUMBER && right->type == VAL_NUMBER) {
-		value_t *result = malloc(sizeof(value_t));
-		result->type = VAL_BOOL;
-		switch (op_type) {
-			case TOKEN_GREATER:
-				result->as.boolean = left->as.number > right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
-			case TOKEN_GREATER_EQUAL:
-				result->as.boolean = left->as.number >= right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
-			case TOKEN_LESS:
-				result->as.boolean = left->as.number < right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
-			case TOKEN_LESS_EQUAL:
-				result->as.boolean = left->as.number <= right->as.number;
-				free_val(left);
-				free_val(right);
-				return result;
-
-			default: break;
-		}
-	}
-
-	// String concatenation
-	if (left->type == VAL_STRING && right->type == VAL_STRING) {
+	// String concatenation, short enough to stay out of the heap
+	if (IS_TEXT(left) && IS_TEXT(right)) {
 		if (op_type == TOKEN_PLUS) {
-			value_t *result = malloc(sizeof(value_t));
-			result->type = VAL_STRING;
-			size_t left_len = strlen(left->as.string);
-			size_t right_len = strlen(right->as.string);
-			result->as.string = malloc(left_len + right_len + 1);
-			strcpy(result->as.string, left->as.string);
-			strcat(result->as.string, right->as.string);
+			value_t result = text_concat(left, right);
 			free_val(left);
 			free_val(right);
 			return result;
 		}
 	}
 
+	free_val(left);
+	free_val(right);
 	// String/number comparisons
-	if ((left->type == VAL_STRING && right->type == VAL_NUMBER) ||
-			(left->type == VAL_NUMBER && right->type == VAL_STRING)) {
-		runtime_error("Operands must be numbers.", expr->line);
+	if ((IS_TEXT(left) && IS_NUMBER(right)) || (IS_NUMBER(left) && IS_TEXT(right))) {
+		runtime_error(interp, "Operands must be numbers.", interp->flat->lines[node]);
 	}
 
-	runtime_error("Operands must be two numbers or two strings.", expr->line);
-	value_t *val = malloc(sizeof(value_t));
-	val->type = VAL_NIL;
-	free_val(left);
-	free_val(right);
-	return val;
+	runtime_error(interp, "Operands must be two numbers or two strings.", interp->flat->lines[node]);
+	return NIL_VAL;
 }
 
-int is_truthy(value_t *value)
+int is_truthy(value_t value)
 {
-	switch (value->type) {
+	switch (VALUE_TYPE(value)) {
 		case VAL_NIL:
 			return 0;
 
 		case VAL_BOOL:
-			return value->as.boolean;
+			return AS_BOOL(value);
 
 		case VAL_NUMBER:
-			if (value->as.number == 0)
+			if (AS_NUMBER(value) == 0)
 				return 0;
 			return 1;
 
 		case VAL_STRING:
+		case VAL_SHORT:
 			return 1;
 
 		default:
@@ -228,59 +164,83 @@ int is_truthy(value_t *value)
 	}
 }
 
-value_t *visit_unary(expr_t *expr, ht_t *env)
+value_t visit_unary(interpreter_t *interp, node_t node, flat_expr_t *expr, scope_t *env)
 {
-	value_t *operand = evaluate(expr->as.unary.right, env);
+	value_t operand = evaluate(interp, expr->a, env);
 
-	if (expr->as.unary.operator.type == TOKEN_MINUS) {
-		if (operand->type == VAL_NUMBER) {
-			value_t *result = malloc(sizeof(value_t));
-			result->type = VAL_NUMBER;
-			result->as.number = -operand->as.number;
-			free_val(operand);
-			return result;
+	if (expr->op == TOKEN_MINUS) {
+		if (IS_NUMBER(operand)) {
+			return NUMBER_VAL(-AS_NUMBER(operand));
 		} else {
-			runtime_error("Operand must be a number.", expr->line);
+			free_val(operand);
+			runtime_error(interp, "Operand must be a number.", interp->flat->lines[node]);
 		}
-	} else if (expr->as.unary.operator.type == TOKEN_BANG) {
-		value_t *result = malloc(sizeof(value_t));
-		result->type = VAL_BOOL;
-		result->as.boolean = !is_truthy(operand);
+	} else if (expr->op == TOKEN_BANG) {
+		int truthy = is_truthy(operand);
 		free_val(operand);
-
-		return result;
+		return BOOL_VAL(!truthy);
 	}
 
-	value_t *val = malloc(sizeof(value_t));
-	val->type = VAL_NIL;
 	free_val(operand);
-	return val;
+	return NIL_VAL;
 }
 
-value_t *visit_variable(expr_t *expr, ht_t *env)
+/*
+ * Undefined variable error
+ */
+void undefined(interpreter_t *interp, node_t node, symbol_t *name)
 {
-	value_t *val = ht_get(env, &expr->as.variable.name, 1);
+	char err[512];
+	snprintf(err, 512, "Undefined variable '%.*s'.", name->length, name->name);
+	runtime_error(interp, err, interp->flat->lines[node]);
+}
+
+/* Scope of a local count - 1 scopes up from env */
+scope_t *scope_up(scope_t *env, int count)
+{
+	while (--count) {
+		env = env->enclosing;
+	}
+	return env;
+}
+
+value_t visit_variable(interpreter_t *interp, node_t node, flat_expr_t *expr, scope_t *env)
+{
+	if (expr->count) {
+		return scope_get(scope_up(env, expr->count), expr->a);
+	}
+	symbol_t *name = interp->flat->names[expr->a];
+	value_t *val = ht_get(interp->globals, name, 0);
 	if (val) {
-		return val;
-	} else {
-		val = malloc(sizeof(value_t));
-		val->type = VAL_NIL;
-		return val;
+		return value_copy(*val);
+	} else if (interp->globals) {
+		undefined(interp, node, name);
 	}
+	/* No environment at all for rd evaluate */
+	return NIL_VAL;
 }
 
-value_t *visit_assign(expr_t *expr, ht_t *env)
+value_t visit_assign(interpreter_t *interp, node_t node, flat_expr_t *expr, scope_t *env)
 {
-	value_t *value = evaluate(expr->as.assign.value, env);
-	ht_assign(env, &expr->as.assign.name->as.variable.name, value);
+	value_t value = evaluate(interp, expr->b, env);
+	if (expr->count) {
+		scope_set(scope_up(env, expr->count), expr->a, value_copy(value));
+	} else {
+		value_t copy = value_copy(value);
+		if (!interp->globals || !ht_assign(interp->globals, interp->flat->names[expr->a], copy)) {
+			free_val(copy);
+			free_val(value);
+			undefined(interp, node, interp->flat->names[expr->a]);
+		}
+	}
     return value;
 }
 
-value_t *visit_logical(expr_t *expr, ht_t *env)
+value_t visit_logical(interpreter_t *interp, flat_expr_t *expr, scope_t *env)
 {
-	value_t *left = evaluate(expr->as.logical.left, env);
+	value_t left = evaluate(interp, expr->a, env);
 
-    if (expr->as.logical.operator.type == TOKEN_OR) {
+    if (expr->op == TOKEN_OR) {
       if (is_truthy(left))
 		  return left;
     } else {
@@ -288,95 +248,76 @@ value_t *visit_logical(expr_t *expr, ht_t *env)
 		  return left;
     }
 
-    return evaluate(expr->as.logical.right, env);
-}
-
-void val_add(val_array_t *array, value_t *expr)
-{
-	if (array->length == array->capacity) {
-		array->capacity *= 2;
-		array->arguments = realloc(array->arguments, array->capacity * sizeof(expr_t *));
-	}
-	array->arguments[array->length++] = expr;
-}
-
-void free_vals(val_array_t *array)
-{
-	for (int i = 0; i < array->length; i++) {
-		free_val(array->arguments[i]);
-	}
-	free(array->arguments);
-	free(array);
+	free_val(left);
+    return evaluate(interp, expr->b, env);
 }
 
-value_t *visit_call(expr_t *expr, ht_t *env)
+value_t visit_call(interpreter_t *interp, node_t node, flat_expr_t *expr, scope_t *env)
 {
-	value_t *callee = evaluate(expr->as.call.callee, env);
-	if (callee->type != VAL_FN) {
-		runtime_error("Can only call functions and classes.", expr->line);
+	value_t callee = evaluate(interp, expr->a, env);
+	if (!IS_FN(callee)) {
+		free_val(callee);
+		runtime_error(interp, "Can only call functions and classes.", interp->flat->lines[node]);
 	}
 
-	val_array_t *arguments = malloc(sizeof(val_array_t));
-	arguments->arguments = malloc(DEFAULT_ARGS_SIZE * sizeof(value_t *));
-	arguments->length = 0;
-	arguments->capacity = DEFAULT_ARGS_SIZE;
-	
-	for (int i = 0; i < expr->as.call.args->length; i++) {
-		value_t *val = evaluate(expr->as.call.args->arguments[i], env);
-		val_add(arguments, val);
+	/* The callee and arguments go on the stack, the callee takes the arguments over */
+	gc_t *gc = &interp->gc;
+	int base = gc->stack.length;
+	gc_push(gc, callee);
+	for (int i = 0; i < expr->count; i++) {
+		value_t argument = evaluate(interp, interp->flat->lists[expr->b + i], env);
+		gc_push(gc, argument);
 	}
 
-	if (arguments->length != callee->as.function->arity) {
+	fn_t *fn = AS_FN(callee);
+	if (expr->count != fn->arity) {
 		char err[512];
-		snprintf(err, 512, "Expected %d arguments but got %d.", callee->as.function->arity, arguments->length);
-		runtime_error(err, expr->line);
+		snprintf(err, 512, "Expected %d arguments but got %d.", fn->arity, expr->count);
+		runtime_error(interp, err, interp->flat->lines[node]);
     }
-    value_t *res = callee->as.function->call(callee->as.function, arguments, callee->as.function->env);
-	free_vals(arguments);
-	free_val(callee);
+	scope_array_add(&gc->frames, env);
+	value_t res = fn->call(interp, fn, &gc->stack.values[base + 1], fn->env);
+	gc->frames.length--;
+	gc->stack.length = base;
 	return res;
 }
 
-value_t *evaluate(expr_t *expr, ht_t *env)
+/*
+ * The node is copied out first, the pools can move when a lazy body is
+ * flattened during a call
+ */
+value_t evaluate(interpreter_t *interp, node_t node, scope_t *env)
 {
-	if (!expr) {
-		value_t *nil = malloc(sizeof(value_t));
-		nil->type = VAL_NIL;
-		return nil;
+	if (!node) {
+		return NIL_VAL;
 	}
-	switch (expr->type) {
+	flat_expr_t expr = interp->flat->exprs[node];
+	switch (expr.type) {
 		case EXPR_LITERAL:
-			return visit_literal(expr);
+			return visit_literal(interp, &expr);
 		case EXPR_BINARY:
-			return visit_binary(expr, env);
+			return visit_binary(interp, node, &expr, env);
 		case EXPR_UNARY:
-			return visit_unary(expr, env);
-		case EXPR_GROUPING:
-			return visit_grouping(expr, env);
+			return visit_unary(interp, node, &expr, env);
 		case EXPR_VARIABLE:
-			return visit_variable(expr, env);
+			return visit_variable(interp, node, &expr, env);
 		case EXPR_ASSIGN:
-			return visit_assign(expr, env);
+			return visit_assign(interp, node, &expr, env);
 		case EXPR_LOGICAL:
-			return visit_logical(expr, env);
+			return visit_logical(interp, &expr, env);
 		case EXPR_CALL:
-			return visit_call(expr, env);
+			return visit_call(interp, node, &expr, env);
 		default:
 			exit(65);
 			break;
 	}
 }
 
-void print_value(value_t *value)
+void print_value(value_t value)
 {
-	if (!value) {
-		printf("nil\n");
-		return;
-	}
-
-	switch (value->type) {
+	switch (VALUE_TYPE(value)) {
 		case VAL_BOOL:
-			printf("%s\n", value->as.boolean == 1 ? "true" : "false");
+			printf("%s\n", AS_BOOL(value) == 1 ? "true" : "false");
 			break;
 
 		case VAL_NIL:
@@ -384,22 +325,25 @@ void print_value(value_t *value)
 			break;
 
 		case VAL_STRING:
-			printf("%s\n", value->as.string);
+		case VAL_SHORT:
+			printf("%.*s\n", TEXT_LENGTH(value), TEXT_CHARS(value));
 			break;
 
 		case VAL_NUMBER:
-			if (value->as.number == (int) value->as.number) {
-				printf("%d\n", (int) value->as.number);
+			if (AS_NUMBER(value) == (int) AS_NUMBER(value)) {
+				printf("%d\n", (int) AS_NUMBER(value));
 			} else {
-				printf("%g\n", value->as.number);
+				printf("%g\n", AS_NUMBER(value));
 			}
 			break;
 
 		case VAL_FN:
-			if (value->as.function->type == FN_NATIVE) {
+			if (AS_FN(value)->type == FN_NATIVE) {
 				printf("<native fn>\n");
 			} else {
-				printf("<fn %s>\n", value->as.function->stmt->as.function.name.value);
+				fn_t *fn = AS_FN(value);
+				symbol_t *name = fn->flat->functions[fn->decl].name;
+				printf("<fn %.*s>\n", name->length, name->name);
 			}
 			break;
 
@@ -408,173 +352,341 @@ void print_value(value_t *value)
 	}
 }
 
-void evaluate_statements(stmt_array_t *array, ht_t *env, return_state_t *state)
+/*
+ * Statements of a block, in env
+ */
+void evaluate_statements(interpreter_t *interp, node_t block, scope_t *env, return_state_t *state)
 {
-	for (int i = 0; i < array->length; i++) {
-		evaluate_statement(array->statements[i], env, state);
+	flat_stmt_t stmt = interp->flat->stmts[block];
+	for (node_t i = 0; i < stmt.b; i++) {
+		evaluate_statement(interp, interp->flat->lists[stmt.a + i], env, state);
 	}
 }
 
-void ht_array_add(ht_array_t *array, ht_t *env)
+/*
+ * A scope made for what runs next, an error leaves it to gc_unwind()
+ */
+scope_t *scope_enter(interpreter_t *interp, scope_t *enclosing, int length)
 {
-	if (array->length == array->capacity) {
-		array->capacity *= 2;
-		array->envs = realloc(array->envs, array->capacity * sizeof(ht_t *));
+	scope_t *scope = scope_new(enclosing, length);
+	scope_array_add(&interp->gc.open, scope);
+	return scope;
+}
+
+/*
+ * A scope that is left goes at once, unless a function may still use it.
+ * Scopes are left the other way round from how they are entered.
+ */
+void scope_exit(interpreter_t *interp, scope_t *scope)
+{
+	interp->gc.open.length--;
+	if (scope->captured) {
+		gc_add_scope(&interp->gc, scope);
+	} else {
+		scope_free(scope);
 	}
-	array->envs[array->length++] = env;
 }
 
-void free_hts(ht_array_t *array)
+void evaluate_block(interpreter_t *interp, node_t block, scope_t *env, int slots, return_state_t *state)
 {
-	for (int i = 0; i < array->length; i++) {
-		ht_free(array->envs[i]);
+	if (!slots) {
+		evaluate_statements(interp, block, env, state);
+		return;
 	}
-	free(array->envs);
-	free(array);
+	scope_t *scope = scope_enter(interp, env, slots);
+	evaluate_statements(interp, block, scope, state);
+	scope_exit(interp, scope);
 }
 
-void evaluate_block(stmt_array_t *array, ht_t *cur_env, ht_t *scope_env, return_state_t *state)
+/*
+ * One iteration of a loop body. The scope of a block body is made on the
+ * first one and cleared for the next instead of made again, unless a
+ * function declared in it has kept it.
+ */
+void loop_body(interpreter_t *interp, node_t body, scope_t *env, scope_t **scope, return_state_t *state)
 {
-	ht_t *previous = cur_env;
-	cur_env = scope_env;
-	ht_array_add(hts, scope_env);
-	evaluate_statements(array, cur_env, state);
-	cur_env = previous;
+	flat_stmt_t stmt = interp->flat->stmts[body];
+	if (stmt.type != STMT_BLOCK || !stmt.c) {
+		evaluate_statement(interp, body, env, state);
+		return;
+	}
+	if (*scope && (*scope)->captured) {
+		scope_exit(interp, *scope);
+		*scope = NULL;
+	}
+	if (*scope) {
+		scope_clear(*scope);
+	} else {
+		*scope = scope_enter(interp, env, stmt.c);
+	}
+	evaluate_statements(interp, body, *scope, state);
 }
 
-value_t *_clock(fn_t *fn, val_array_t *arguments, ht_t *env)
+void loop_exit(interpreter_t *interp, scope_t *scope)
 {
-	value_t *val = malloc(sizeof(value_t));
-	val->type = VAL_NUMBER;
-	val->as.number = time(NULL);
-	return val;
+	if (scope) {
+		scope_exit(interp, scope);
+	}
 }
 
-value_t *_call(fn_t *fn, val_array_t *arguments, ht_t *env)
+/*
+ * for (initializer; condition; increment), a variable declared by the
+ * initializer lives in a scope of its own for the whole loop
+ */
+void evaluate_for(interpreter_t *interp, flat_stmt_t *stmt, scope_t *env, return_state_t *state)
 {
-	ht_t *fn_env = ht_init(fn->env);
-	for (int i = 0; i < fn->stmt->as.function.params->length; i++) {
-		ht_add(fn_env, fn->stmt->as.function.params->tokens[i].value, arguments->arguments[i]);
+	node_t increment = interp->flat->lists[stmt->c];
+	node_t body = interp->flat->lists[stmt->c + 1];
+	scope_t *loop = NULL;
+	if (stmt->a && interp->flat->stmts[stmt->a].type == STMT_VAR) {
+		loop = env = scope_enter(interp, env, 1);
+	}
+	if (stmt->a) {
+		evaluate_statement(interp, stmt->a, env, state);
 	}
+	scope_t *scope = NULL;
+	while (!state->has_returned) {
+		if (stmt->b) {
+			value_t cond = evaluate(interp, stmt->b, env);
+			int truthy = is_truthy(cond);
+			free_val(cond);
+			if (!truthy) {
+				break;
+			}
+		}
+		loop_body(interp, body, env, &scope, state);
+		if (state->has_returned) {
+			break;
+		}
+		if (increment) {
+			free_val(evaluate(interp, increment, env));
+		}
+	}
+	loop_exit(interp, scope);
+	loop_exit(interp, loop);
+}
 
-	return_state_t state = { 0, NULL };
+/*
+ * for name in start..end, the counter is a plain double copied into the
+ * variable each time round so the body can't change how far it goes
+ */
+void evaluate_range(interpreter_t *interp, flat_stmt_t *stmt, scope_t *env, return_state_t *state)
+{
+	value_t start = evaluate(interp, stmt->a, env);
+	value_t end = evaluate(interp, stmt->b, env);
+	if (!IS_NUMBER(start) || !IS_NUMBER(end)) {
+		free_val(start);
+		free_val(end);
+		runtime_error(interp, "Range bounds must be numbers.", interp->flat->lines[stmt->a]);
+	}
+	double last = AS_NUMBER(end);
+	int inclusive = stmt->op == TOKEN_DOT_DOT_EQUAL;
+	double counter = AS_NUMBER(start);
+
+	node_t body = interp->flat->lists[stmt->c + 1];
+	scope_t *loop = scope_enter(interp, env, 1);
+	scope_t *scope = NULL;
+	for (; inclusive ? counter <= last : counter < last; counter++) {
+		scope_set(loop, 0, NUMBER_VAL(counter));
+		loop_body(interp, body, loop, &scope, state);
+		if (state->has_returned) {
+			break;
+		}
+	}
+	loop_exit(interp, scope);
+	scope_exit(interp, loop);
+}
 
-	evaluate_block(fn->stmt->as.function.body->as.block.statements, env, fn_env, &state);
+value_t _clock(interpreter_t *interp, fn_t *fn, value_t *arguments, scope_t *env)
+{
+	return NUMBER_VAL(time(NULL));
+}
 
-	if (state.has_returned) {
-		return state.value;
+value_t _call(interpreter_t *interp, fn_t *fn, value_t *arguments, scope_t *env)
+{
+	flat_t *flat = fn->flat;
+	/* Errors resolving a lazy body end the program like runtime ones */
+	if (!flat->functions[fn->decl].body && !flat_body(flat, fn->decl)) {
+		longjmp(interp->error, 1);
 	}
-    return NULL;
+	flat_fn_t *decl = &flat->functions[fn->decl];
+	return_state_t state = { 0, NIL_VAL };
+	if (decl->slots) {
+		/* Parameters take the first slots, the stack no longer holds them */
+		scope_t *scope = scope_enter(interp, env, decl->slots);
+		for (int i = 0; i < decl->arity; i++) {
+			scope_set(scope, i, arguments[i]);
+			arguments[i] = NIL_VAL;
+		}
+		evaluate_statements(interp, decl->body, scope, &state);
+		scope_exit(interp, scope);
+	} else {
+		for (int i = 0; i < decl->arity; i++) {
+			free_val(arguments[i]);
+			arguments[i] = NIL_VAL;
+		}
+		evaluate_statements(interp, decl->body, env, &state);
+	}
+
+	return state.value;
 }
 
-void evaluate_statement(stmt_t *stmt, ht_t *env, return_state_t *state)
+void evaluate_statement(interpreter_t *interp, node_t node, scope_t *env, return_state_t *state)
 {
 	if (state && state->has_returned)
 		return;
-	switch (stmt->type) {
+	flat_stmt_t stmt = interp->flat->stmts[node];
+	switch (stmt.type) {
 		case STMT_IF:;
-			value_t *result = evaluate(stmt->as._if.condition, env);
-			if (is_truthy(result)) {
-				evaluate_statement(stmt->as._if.then_branch, env, state);
-			} else if (stmt->as._if.else_branch) {
-				evaluate_statement(stmt->as._if.else_branch, env, state);
-			}
+			value_t result = evaluate(interp, stmt.a, env);
+			int truthy = is_truthy(result);
 			free_val(result);
+			if (truthy) {
+				evaluate_statement(interp, stmt.b, env, state);
+			} else if (stmt.c) {
+				evaluate_statement(interp, stmt.c, env, state);
+			}
 			break;
 
 		case STMT_PRINT:;
-			value_t *val = evaluate(stmt->as.print.expression, env);
+			value_t val = evaluate(interp, stmt.a, env);
 			print_value(val);
 			free_val(val);
 			break;
 
-		case STMT_EXPR:;
-			value_t *res = evaluate(stmt->as.expr.expression, env);
-			free_val(res);
+		case STMT_EXPR:
+			free_val(evaluate(interp, stmt.a, env));
 			break;
 
 		case STMT_VAR: {
-			value_t *value = malloc(sizeof(value_t));
-			value->type = VAL_NIL;
-			if (stmt->as.variable.initializer) {
-				free(value);
-				value = evaluate(stmt->as.variable.initializer, env);
+			value_t value = evaluate(interp, stmt.b, env);
+			if (stmt.c) {
+				scope_set(env, stmt.a, value);
+			} else {
+				ht_add(interp->globals, interp->flat->names[stmt.a], value);
 			}
-			ht_add(env, stmt->as.variable.name.value, value);
-			free_val(value);
 			break;
 		}
 
 		case STMT_BLOCK:;
-			evaluate_block(stmt->as.block.statements, env, ht_init(env), state);
+			evaluate_block(interp, node, env, stmt.c, state);
 			break;
 
 		case STMT_WHILE:;
-			value_t *cond = evaluate(stmt->as._while.condition, env);
+			value_t cond = evaluate(interp, stmt.a, env);
+			scope_t *scope = NULL;
 			while (is_truthy(cond)) {
-				evaluate_statement(stmt->as._while.body, env, state);
+				loop_body(interp, stmt.b, env, &scope, state);
 				free_val(cond);
 				if (state->has_returned) {
+					loop_exit(interp, scope);
 					return;
 				}
-				cond = evaluate(stmt->as._while.condition, env);
+				cond = evaluate(interp, stmt.a, env);
 			}
 			free_val(cond);
+			loop_exit(interp, scope);
+			break;
+
+		case STMT_FOR:
+			evaluate_for(interp, &stmt, env, state);
+			break;
+
+		case STMT_RANGE:
+			evaluate_range(interp, &stmt, env, state);
 			break;
 
 		case STMT_FUN:;
+			/* Every value is reachable from env or the roots here */
+			if (interp->gc.live >= interp->gc.threshold) {
+				gc_collect(&interp->gc, interp->globals, env);
+			}
 			fn_t *fn = malloc(sizeof(fn_t));
 			fn->type = FN_CUSTOM;
-			fn->arity = stmt->as.function.params->length;
+			fn->arity = interp->flat->functions[stmt.a].arity;
 			fn->env = env;
-			fn->stmt = stmt;
+			fn->flat = interp->flat;
+			fn->decl = stmt.a;
 			fn->call = _call;
+			gc_add_function(&interp->gc, fn);
 
-			value_t *fn_val = malloc(sizeof(value_t));
-			fn_val->type = VAL_FN;
-			fn_val->as.function = fn;
-			ht_add(env, stmt->as.function.name.value, fn_val);
-			free_val(fn_val);
+			if (stmt.b) {
+				/* It keeps env and every scope around it alive */
+				for (scope_t *scope = env; scope && !scope->captured; scope = scope->enclosing) {
+					scope->captured = 1;
+				}
+				scope_set(env, stmt.b - 1, FN_VAL(fn));
+			} else {
+				ht_add(interp->globals, interp->flat->functions[stmt.a].name, FN_VAL(fn));
+			}
 			break;
 		
-		case STMT_RETURN:;
-			value_t *value = NULL;
-			if (stmt->as._return.value) {
-				value = evaluate(stmt->as._return.value, env);
-			}
+		case STMT_RETURN:
 			state->has_returned = 1;
-            state->value = value;
+			state->value = evaluate(interp, stmt.a, env);
 
 		default:
 			break;
 	}
 }
 
-void interpret(stmt_array_t *array)
+/*
+ * Run the block root of flat. Exit status of the program, 70 after a
+ * runtime error and 65 after a syntax error in a lazily parsed body
+ */
+int interpret(flat_t *flat, node_t root)
 {
-	ht_t *env = ht_init(NULL);
-	value_t *clock_fn = malloc(sizeof(value_t));
-	clock_fn->type = VAL_FN;
+	interpreter_t interp;
+	interp.globals = ht_init(NULL);
+	gc_init(&interp.gc);
 	fn_t *fn = malloc(sizeof(fn_t));
 	fn->type = FN_NATIVE;
 	fn->arity = 0;
 	/* Native function don't have body */
-	fn->stmt = NULL;
+	fn->env = NULL;
+	fn->flat = NULL;
+	fn->decl = 0;
 	fn->call = _clock;
-	clock_fn->as.function = fn;
-
-	ht_add(env, "clock", clock_fn);
-
-	return_state_t state = { 0, NULL };
-
-	hts = malloc(sizeof(ht_array_t));
-	hts->envs = malloc(DEFAULT_ENVS_SIZE * sizeof (ht_t *));
-	hts->length = 0;
-	hts->capacity = DEFAULT_ENVS_SIZE;
-	evaluate_statements(array, env, &state);
-	free_hts(hts);
-	ht_free(env);
-	free(clock_fn);
-	free(fn);
-	free_statements(array);
+	gc_add_function(&interp.gc, fn);
+
+	ht_add(interp.globals, intern("clock", 5), FN_VAL(fn));
+
+	return_state_t state = { 0, NIL_VAL };
+
+	interp.flat = flat;
+	errno = 0;
+	if (!setjmp(interp.error)) {
+		evaluate_statements(&interp, root, NULL, &state);
+	} else {
+		gc_unwind(&interp.gc);
+	}
+	free_val(state.value);
+	if (gc_stats) {
+		gc_report(&interp.gc);
+	}
+	ht_free(interp.globals);
+	gc_free(&interp.gc);
+	/* Errors set errno before jumping back */
+	return errno == 65 || errno == 70 ? errno : 0;
+}
+
+/*
+ * Evaluate and print the single expression node of flat, for rd evaluate
+ */
+int interpret_expr(flat_t *flat, node_t node)
+{
+	interpreter_t interp;
+	interp.flat = flat;
+	interp.globals = NULL;
+	gc_init(&interp.gc);
+	errno = 0;
+	if (!setjmp(interp.error)) {
+		value_t val = evaluate(&interp, node, NULL);
+		print_value(val);
+		free_val(val);
+	} else {
+		gc_unwind(&interp.gc);
+	}
+	gc_free(&interp.gc);
+	return errno == 70 ? 70 : 0;
 }
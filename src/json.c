@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+typedef struct {
+	arena_t *arena;
+	const char *p;
+	const char *end;
+} json_parser_t;
+
+json_t *json_value(json_parser_t *parser);
+
+void json_blank(json_parser_t *parser)
+{
+	while (parser->p < parser->end && (*parser->p == ' ' || *parser->p == '\t' ||
+				*parser->p == '\n' || *parser->p == '\r')) {
+		parser->p++;
+	}
+}
+
+int json_literal(json_parser_t *parser, const char *word)
+{
+	size_t length = strlen(word);
+	if ((size_t) (parser->end - parser->p) < length || memcmp(parser->p, word, length)) {
+		return 0;
+	}
+	parser->p += length;
+	return 1;
+}
+
+int json_hex(json_parser_t *parser, unsigned *code)
+{
+	if (parser->end - parser->p < 4) {
+		return 0;
+	}
+	*code = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = *parser->p++;
+		*code <<= 4;
+		if (c >= '0' && c <= '9') {
+			*code |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			*code |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			*code |= c - 'A' + 10;
+		} else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Append code point as UTF-8 */
+size_t json_utf8(char *out, unsigned code)
+{
+	if (code < 0x80) {
+		out[0] = code;
+		return 1;
+	} else if (code < 0x800) {
+		out[0] = 0xc0 | code >> 6;
+		out[1] = 0x80 | (code & 0x3f);
+		return 2;
+	} else if (code < 0x10000) {
+		out[0] = 0xe0 | code >> 12;
+		out[1] = 0x80 | (code >> 6 & 0x3f);
+		out[2] = 0x80 | (code & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | code >> 18;
+	out[1] = 0x80 | (code >> 12 & 0x3f);
+	out[2] = 0x80 | (code >> 6 & 0x3f);
+	out[3] = 0x80 | (code & 0x3f);
+	return 4;
+}
+
+/*
+ * Decoded string after the opening quote, NULL when it is malformed. The
+ * decoded form is never longer than the escaped one.
+ */
+char *json_string(json_parser_t *parser, size_t *length)
+{
+	const char *close = parser->p;
+	while (close < parser->end && *close != '"') {
+		close += *close == '\\' ? 2 : 1;
+	}
+	if (close >= parser->end) {
+		return NULL;
+	}
+	char *string = arena_alloc(parser->arena, close - parser->p + 1);
+	size_t n = 0;
+	while (parser->p < close) {
+		char c = *parser->p++;
+		if (c != '\\') {
+			string[n++] = c;
+			continue;
+		}
+		unsigned code;
+		switch (*parser->p++) {
+			case '"': string[n++] = '"'; break;
+			case '\\': string[n++] = '\\'; break;
+			case '/': string[n++] = '/'; break;
+			case 'b': string[n++] = '\b'; break;
+			case 'f': string[n++] = '\f'; break;
+			case 'n': string[n++] = '\n'; break;
+			case 'r': string[n++] = '\r'; break;
+			case 't': string[n++] = '\t'; break;
+			case 'u':
+				if (!json_hex(parser, &code)) {
+					return NULL;
+				}
+				/* A surrogate pair for what is past the first plane */
+				if (code >= 0xd800 && code < 0xdc00 && close - parser->p >= 6 &&
+						parser->p[0] == '\\' && parser->p[1] == 'u') {
+					unsigned low;
+					parser->p += 2;
+					if (!json_hex(parser, &low)) {
+						return NULL;
+					}
+					code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+				}
+				n += json_utf8(string + n, code);
+				break;
+			default:
+				return NULL;
+		}
+	}
+	parser->p = close + 1;
+	string[n] = '\0';
+	*length = n;
+	return string;
+}
+
+json_t *json_new(json_parser_t *parser, json_type_t type)
+{
+	json_t *json = arena_alloc(parser->arena, sizeof(json_t));
+	memset(json, 0, sizeof(json_t));
+	json->type = type;
+	return json;
+}
+
+/* Items of an array or object up to close, after the opening bracket */
+json_t *json_items(json_parser_t *parser, json_t *json, char close)
+{
+	json_t **last = &json->child;
+	json_blank(parser);
+	if (parser->p < parser->end && *parser->p == close) {
+		parser->p++;
+		return json;
+	}
+	for (;;) {
+		char *key = NULL;
+		json_blank(parser);
+		if (json->type == JSON_OBJECT) {
+			size_t length;
+			if (parser->p >= parser->end || *parser->p++ != '"' ||
+					!(key = json_string(parser, &length))) {
+				return NULL;
+			}
+			json_blank(parser);
+			if (parser->p >= parser->end || *parser->p++ != ':') {
+				return NULL;
+			}
+		}
+		json_t *item = json_value(parser);
+		if (!item) {
+			return NULL;
+		}
+		item->key = key;
+		*last = item;
+		last = &item->next;
+		json_blank(parser);
+		if (parser->p >= parser->end) {
+			return NULL;
+		}
+		char c = *parser->p++;
+		if (c == close) {
+			return json;
+		} else if (c != ',') {
+			return NULL;
+		}
+	}
+}
+
+json_t *json_value(json_parser_t *parser)
+{
+	json_blank(parser);
+	if (parser->p >= parser->end) {
+		return NULL;
+	}
+	json_t *json;
+	switch (*parser->p) {
+		case '{':
+			parser->p++;
+			return json_items(parser, json_new(parser, JSON_OBJECT), '}');
+		case '[':
+			parser->p++;
+			return json_items(parser, json_new(parser, JSON_ARRAY), ']');
+		case '"':
+			parser->p++;
+			json = json_new(parser, JSON_STRING);
+			json->string = json_string(parser, &json->length);
+			return json->string ? json : NULL;
+		case 't':
+			json = json_new(parser, JSON_BOOL);
+			json->number = 1;
+			return json_literal(parser, "true") ? json : NULL;
+		case 'f':
+			json = json_new(parser, JSON_BOOL);
+			return json_literal(parser, "false") ? json : NULL;
+		case 'n':
+			json = json_new(parser, JSON_NULL);
+			return json_literal(parser, "null") ? json : NULL;
+		default: {
+			/* The text runs on into the rest of the message, copy the number out */
+			char number[64];
+			size_t n = 0;
+			while (parser->p < parser->end && n < sizeof(number) - 1 &&
+					strchr("+-0123456789.eE", *parser->p)) {
+				number[n++] = *parser->p++;
+			}
+			number[n] = '\0';
+			char *end;
+			json = json_new(parser, JSON_NUMBER);
+			json->number = strtod(number, &end);
+			return n && end == number + n ? json : NULL;
+		}
+	}
+}
+
+/*
+ * Value of the whole of text, NULL when it is not valid JSON. Everything
+ * comes from arena.
+ */
+json_t *json_parse(arena_t *arena, const char *text, size_t length)
+{
+	json_parser_t parser = { arena, text, text + length };
+	json_t *json = json_value(&parser);
+	json_blank(&parser);
+	return parser.p == parser.end ? json : NULL;
+}
+
+/* Member of an object, NULL when it has none or is not an object */
+json_t *json_get(json_t *object, const char *key)
+{
+	if (!object || object->type != JSON_OBJECT) {
+		return NULL;
+	}
+	for (json_t *item = object->child; item; item = item->next) {
+		if (!strcmp(item->key, key)) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+/* object.first.second */
+json_t *json_path(json_t *object, const char *first, const char *second)
+{
+	return json_get(json_get(object, first), second);
+}
+
+void json_write_string(FILE *out, const char *chars, size_t length)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = chars[i];
+		if (c == '"' || c == '\\') {
+			fputc('\\', out);
+			fputc(c, out);
+		} else if (c == '\n') {
+			fputs("\\n", out);
+		} else if (c == '\t') {
+			fputs("\\t", out);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
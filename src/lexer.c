@@ -3,67 +3,117 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lexer.h"
+#include "pool.h"
+#include "scan.h"
 
-const keyword_map reserved_keywords[] = {
-	{"and", TOKEN_AND}, {"class", TOKEN_CLASS}, {"else", TOKEN_ELSE},
-	{"false", TOKEN_FALSE}, {"fun", TOKEN_FUN}, {"for", TOKEN_FOR},
-	{"if", TOKEN_IF}, {"nil", TOKEN_NIL}, {"or", TOKEN_OR},
-	{"print", TOKEN_PRINT}, {"return", TOKEN_RETURN},
-	{"super", TOKEN_SUPER}, {"this", TOKEN_THIS}, {"true", TOKEN_TRUE},
-	{"var", TOKEN_VAR}, {"while", TOKEN_WHILE}
+const char *token_names[] = {
+	[TOKEN_LEFT_PAREN] = "LEFT_PAREN", [TOKEN_RIGHT_PAREN] = "RIGHT_PAREN",
+	[TOKEN_LEFT_BRACE] = "LEFT_BRACE", [TOKEN_RIGHT_BRACE] = "RIGHT_BRACE",
+	[TOKEN_COMMA] = "COMMA", [TOKEN_DOT] = "DOT", [TOKEN_MINUS] = "MINUS",
+	[TOKEN_PLUS] = "PLUS", [TOKEN_SEMICOLON] = "SEMICOLON", [TOKEN_SLASH] = "SLASH",
+	[TOKEN_STAR] = "STAR", [TOKEN_BANG] = "BANG", [TOKEN_BANG_EQUAL] = "BANG_EQUAL",
+	[TOKEN_EQUAL] = "EQUAL", [TOKEN_EQUAL_EQUAL] = "EQUAL_EQUAL", [TOKEN_GREATER] = "GREATER",
+	[TOKEN_GREATER_EQUAL] = "GREATER_EQUAL", [TOKEN_LESS] = "LESS", [TOKEN_LESS_EQUAL] = "LESS_EQUAL",
+	[TOKEN_DOT_DOT] = "DOT_DOT", [TOKEN_DOT_DOT_EQUAL] = "DOT_DOT_EQUAL",
+	[TOKEN_IDENTIFIER] = "IDENTIFIER", [TOKEN_STRING] = "STRING", [TOKEN_NUMBER] = "NUMBER",
+	[TOKEN_AND] = "AND", [TOKEN_CLASS] = "CLASS", [TOKEN_ELSE] = "ELSE", [TOKEN_FALSE] = "FALSE",
+	[TOKEN_FUN] = "FUN", [TOKEN_FOR] = "FOR", [TOKEN_IF] = "IF", [TOKEN_NIL] = "NIL",
+	[TOKEN_OR] = "OR", [TOKEN_PRINT] = "PRINT", [TOKEN_RETURN] = "RETURN",
+	[TOKEN_SUPER] = "SUPER", [TOKEN_THIS] = "THIS", [TOKEN_TRUE] = "TRUE",
+	[TOKEN_VAR] = "VAR", [TOKEN_WHILE] = "WHILE", [TOKEN_FN] = "FN", [TOKEN_LET] = "LET",
+	[TOKEN_MATCH] = "MATCH", [TOKEN_MUT] = "MUT", [TOKEN_PUB] = "PUB",
+	[TOKEN_STRUCT] = "STRUCT", [TOKEN_TYPE] = "TYPE", [TOKEN_EOF] = "END_OF_FILE"
 };
 
-const keyword_map regular_tokens[] = {
-	{"LEFT_PAREN", TOKEN_LEFT_PAREN}, {"RIGHT_PAREN", TOKEN_RIGHT_PAREN},
-	{"LEFT_BRACE", TOKEN_LEFT_BRACE}, {"RIGHT_BRACE", TOKEN_RIGHT_BRACE},
-	{"COMMA", TOKEN_COMMA}, {"DOT", TOKEN_DOT}, {"MINUS", TOKEN_MINUS},
-	{"PLUS", TOKEN_PLUS}, {"SEMICOLON", TOKEN_SEMICOLON}, {"SLASH", TOKEN_SLASH},
-	{"STAR", TOKEN_STAR}, {"BANG", TOKEN_BANG}, {"BANG_EQUAL", TOKEN_BANG_EQUAL},
-	{"EQUAL", TOKEN_EQUAL}, {"EQUAL_EQUAL", TOKEN_EQUAL_EQUAL}, {"GREATER", TOKEN_GREATER},
-	{"GREATER_EQUAL", TOKEN_GREATER_EQUAL}, {"LESS", TOKEN_LESS}, {"LESS_EQUAL", TOKEN_LESS_EQUAL},
-	{"IDENTIFIER", TOKEN_IDENTIFIER}, {"STRING", TOKEN_STRING}, {"NUMBER", TOKEN_NUMBER},
-	{"AND", TOKEN_AND}, {"CLASS", TOKEN_CLASS}, {"ELSE", TOKEN_ELSE}, {"FALSE", TOKEN_FALSE},
-	{"FUN", TOKEN_FUN}, {"FOR", TOKEN_FOR}, {"IF", TOKEN_IF}, {"NIL", TOKEN_NIL},
-	{"OR", TOKEN_OR}, {"PRINT", TOKEN_PRINT}, {"RETURN", TOKEN_RETURN},
-	{"SUPER", TOKEN_SUPER}, {"THIS", TOKEN_THIS}, {"TRUE", TOKEN_TRUE},
-	{"VAR", TOKEN_VAR}, {"WHILE", TOKEN_WHILE}, {"END_OF_FILE", TOKEN_EOF}
-};
-
-char *read_source(const char *filename)
+source_t *source_open(const char *filename)
 {
-	FILE *file = fopen(filename, "r");
-	if (file == NULL) {
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
 		fprintf(stderr, "Error reading file: %s\n", filename);
 		return NULL;
 	}
 
-	fseek(file, 0, SEEK_END);
-	long file_size = ftell(file);
-	rewind(file);
-
-	char *source = malloc(file_size + 1);
-	if (source == NULL) {
-		fprintf(stderr, "Memory allocation failed\n");
-		fclose(file);
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Error reading file: %s\n", filename);
+		close(fd);
 		return NULL;
 	}
 
-	size_t bytes_read = fread(source, 1, file_size, file);
-	if (bytes_read < file_size) {
-		fprintf(stderr, "Error reading file contents\n");
+	source_t *source = malloc(sizeof(source_t));
+	source->length = st.st_size;
+	source->mapped = 0;
+	source->arena = NULL;
+	if (source->length == 0) {
+		source->data = NULL;
+		close(fd);
+		return source;
+	}
+
+	source->data = mmap(NULL, source->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (source->data != MAP_FAILED) {
+		source->mapped = 1;
+		close(fd);
+		return source;
+	}
+
+	/* Not mappable, fall back to reading it in */
+	source->data = malloc(source->length);
+	if (source->data == NULL) {
+		fprintf(stderr, "Memory allocation failed\n");
 		free(source);
-		fclose(file);
+		close(fd);
 		return NULL;
 	}
-
-	source[file_size] = '\0';
-	fclose(file);
+	size_t bytes_read = 0;
+	while (bytes_read < source->length) {
+		ssize_t n = read(fd, source->data + bytes_read, source->length - bytes_read);
+		if (n <= 0) {
+			fprintf(stderr, "Error reading file contents\n");
+			free(source->data);
+			free(source);
+			close(fd);
+			return NULL;
+		}
+		bytes_read += n;
+	}
+	close(fd);
 
 	return source;
 }
 
+void source_close(source_t *source)
+{
+	if (!source)
+		return;
+	if (source->mapped) {
+		munmap(source->data, source->length);
+	} else {
+		free(source->data);
+	}
+	arena_free(source->arena);
+	free(source);
+}
+
+/*
+ * Keep a copy of text that tokens point to after the chunk it was read
+ * in has been reused
+ */
+char *source_store(source_t *source, const char *text, size_t length)
+{
+	if (!source->arena)
+		source->arena = arena_create();
+	char *copy = arena_alloc(source->arena, length);
+	memcpy(copy, text, length);
+	return copy;
+}
+
 int is_digit(char c)
 {
 	return c >= '0' && c <= '9';
@@ -83,24 +133,169 @@ void token_add(array_t *array, token_t token)
 	array->tokens[array->length++] = token;
 }
 
-token_t token_gen(token_type_t type, char *value, int line)
+token_t token_gen(token_type_t type, char *start, int length, int line)
 {
 	token_t token;
 	token.type = type;
-	char *val = strdup(value);
-	token.value = val;
+	token.start = start;
+	token.length = length;
 	token.line = line;
+	token.symbol = NULL;
+	token.as.string = NULL;
 	return token;
 }
 
-char *type_str(token_type_t type)
+int token_equal(token_t *a, token_t *b)
+{
+	return a->length == b->length && !memcmp(a->start, b->start, a->length);
+}
+
+/* Same tokens on the same lines, decoded to the same values */
+int same_tokens(array_t *a, array_t *b)
 {
-	for (int i = 0; i < sizeof(regular_tokens) / sizeof(regular_tokens[0]); i++) {
-		if (regular_tokens[i].token_type == type) {
-			return regular_tokens[i].keyword;
+	if (a->length != b->length)
+		return 0;
+	for (int i = 0; i < a->length; i++) {
+		token_t *x = &a->tokens[i], *y = &b->tokens[i];
+		if (x->type != y->type || x->line != y->line || x->symbol != y->symbol ||
+				!token_equal(x, y) ||
+				(x->type == TOKEN_NUMBER && x->as.number != y->as.number) ||
+				(x->type == TOKEN_STRING && !string_equal(x->as.string, y->as.string)))
+			return 0;
+	}
+	return 1;
+}
+
+/* Powers of ten that a double holds exactly */
+const double exact_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Value of a number lexeme, digits with an optional fraction. While the
+ * digits fit in 53 bits and there are at most 22 after the point, both
+ * sides of the division are exact and the one rounding it does gives the
+ * same double as strtod. Anything longer goes to strtod.
+ */
+double number_decode(const char *start, int length)
+{
+	unsigned long long mantissa = 0;
+	int fraction = -1;
+	for (int i = 0; i < length; i++) {
+		if (start[i] == '.') {
+			fraction = 0;
+			continue;
 		}
+		mantissa = mantissa * 10 + (start[i] - '0');
+		if (fraction >= 0)
+			fraction++;
+		if (mantissa > 1ULL << 53 || fraction > 22) {
+			/* Lexemes are not 0 terminated */
+			char *copy = strndup(start, length);
+			double value = strtod(copy, NULL);
+			free(copy);
+			return value;
+		}
+	}
+	return fraction > 0 ? mantissa / exact_powers[fraction] : (double) mantissa;
+}
+
+/*
+ * Text of tokens that are always spelled the same way, a streamed token
+ * can point here instead of at a copy
+ */
+const char *token_lexemes[] = {
+	[TOKEN_LEFT_PAREN] = "(", [TOKEN_RIGHT_PAREN] = ")", [TOKEN_LEFT_BRACE] = "{",
+	[TOKEN_RIGHT_BRACE] = "}", [TOKEN_COMMA] = ",", [TOKEN_DOT] = ".",
+	[TOKEN_MINUS] = "-", [TOKEN_PLUS] = "+", [TOKEN_SEMICOLON] = ";",
+	[TOKEN_SLASH] = "/", [TOKEN_STAR] = "*", [TOKEN_BANG] = "!",
+	[TOKEN_BANG_EQUAL] = "!=", [TOKEN_EQUAL] = "=", [TOKEN_EQUAL_EQUAL] = "==",
+	[TOKEN_GREATER] = ">", [TOKEN_GREATER_EQUAL] = ">=", [TOKEN_LESS] = "<",
+	[TOKEN_LESS_EQUAL] = "<=", [TOKEN_DOT_DOT] = "..", [TOKEN_DOT_DOT_EQUAL] = "..=",
+	[TOKEN_AND] = "and", [TOKEN_CLASS] = "class",
+	[TOKEN_ELSE] = "else", [TOKEN_FALSE] = "false", [TOKEN_FUN] = "fun",
+	[TOKEN_FOR] = "for", [TOKEN_IF] = "if", [TOKEN_NIL] = "nil", [TOKEN_OR] = "or",
+	[TOKEN_PRINT] = "print", [TOKEN_RETURN] = "return", [TOKEN_SUPER] = "super",
+	[TOKEN_THIS] = "this", [TOKEN_TRUE] = "true", [TOKEN_VAR] = "var",
+	[TOKEN_WHILE] = "while", [TOKEN_FN] = "fn", [TOKEN_LET] = "let",
+	[TOKEN_MATCH] = "match", [TOKEN_MUT] = "mut", [TOKEN_PUB] = "pub",
+	[TOKEN_STRUCT] = "struct", [TOKEN_TYPE] = "type", [TOKEN_EOF] = ""
+};
+
+const char *type_str(token_type_t type)
+{
+	return token_names[type];
+}
+
+/*
+ * Compare the rest of an identifier once length and leading characters
+ * have picked the only keyword it can be
+ */
+token_type_t check_keyword(const char *start, const char *keyword, int length,
+		token_type_t type)
+{
+	return memcmp(start, keyword, length) ? TOKEN_IDENTIFIER : type;
+}
+
+/*
+ * Classify an identifier by switching on its length and first character,
+ * there is at most one candidate keyword to compare against afterwards
+ */
+token_type_t keyword_type(const char *start, int length)
+{
+	switch (length) {
+		case 2:
+			switch (start[0]) {
+				case 'f': return check_keyword(start, "fn", 2, TOKEN_FN);
+				case 'i': return check_keyword(start, "if", 2, TOKEN_IF);
+				case 'o': return check_keyword(start, "or", 2, TOKEN_OR);
+			}
+			break;
+		case 3:
+			switch (start[0]) {
+				case 'a': return check_keyword(start, "and", 3, TOKEN_AND);
+				case 'f':
+					if (start[1] == 'u')
+						return check_keyword(start, "fun", 3, TOKEN_FUN);
+					return check_keyword(start, "for", 3, TOKEN_FOR);
+				case 'l': return check_keyword(start, "let", 3, TOKEN_LET);
+				case 'm': return check_keyword(start, "mut", 3, TOKEN_MUT);
+				case 'n': return check_keyword(start, "nil", 3, TOKEN_NIL);
+				case 'p': return check_keyword(start, "pub", 3, TOKEN_PUB);
+				case 'v': return check_keyword(start, "var", 3, TOKEN_VAR);
+			}
+			break;
+		case 4:
+			switch (start[0]) {
+				case 'e': return check_keyword(start, "else", 4, TOKEN_ELSE);
+				case 't':
+					switch (start[1]) {
+						case 'h': return check_keyword(start, "this", 4, TOKEN_THIS);
+						case 'r': return check_keyword(start, "true", 4, TOKEN_TRUE);
+						case 'y': return check_keyword(start, "type", 4, TOKEN_TYPE);
+					}
+					break;
+			}
+			break;
+		case 5:
+			switch (start[0]) {
+				case 'c': return check_keyword(start, "class", 5, TOKEN_CLASS);
+				case 'f': return check_keyword(start, "false", 5, TOKEN_FALSE);
+				case 'm': return check_keyword(start, "match", 5, TOKEN_MATCH);
+				case 'p': return check_keyword(start, "print", 5, TOKEN_PRINT);
+				case 's': return check_keyword(start, "super", 5, TOKEN_SUPER);
+				case 'w': return check_keyword(start, "while", 5, TOKEN_WHILE);
+			}
+			break;
+		case 6:
+			switch (start[0]) {
+				case 'r': return check_keyword(start, "return", 6, TOKEN_RETURN);
+				case 's': return check_keyword(start, "struct", 6, TOKEN_STRUCT);
+			}
+			break;
 	}
-	return NULL;
+	return TOKEN_IDENTIFIER;
 }
 
 void print_tokens(token_t *tokens)
@@ -108,16 +303,17 @@ void print_tokens(token_t *tokens)
 	for (int i = 0; tokens[i].type != TOKEN_EOF; i++) {
 		token_t token = tokens[i];
 		if (token.type == TOKEN_STRING) {
-			printf("STRING \"%s\" %s\n", token.value, token.value);
+			printf("STRING \"%.*s\" %.*s\n", token.length, token.start,
+					token.length, token.start);
 		} else if (token.type == TOKEN_NUMBER) {
-			double value = strtod(token.value, NULL);
+			double value = token.as.number;
 			if (value == (int) value) {
-				printf("NUMBER %s %d.0\n", token.value, (int) value); 
+				printf("NUMBER %.*s %d.0\n", token.length, token.start, (int) value); 
 			} else {
-				printf("NUMBER %s %g\n", token.value, value); 
+				printf("NUMBER %.*s %g\n", token.length, token.start, value); 
 			}
 		} else {
-			printf("%s %s null\n", type_str(token.type), token.value);
+			printf("%s %.*s null\n", type_str(token.type), token.length, token.start);
 		}
 	}
 	printf("EOF  null\n");
@@ -126,178 +322,522 @@ void print_tokens(token_t *tokens)
 void free_array(array_t *array)
 {
 	for (int i = 0; i < array->length; i++) {
-		if (array->tokens[i].value) {
-			free(array->tokens[i].value);
-		}
+		if (array->tokens[i].type == TOKEN_STRING)
+			free(array->tokens[i].as.string);
 	}
+	source_close(array->source);
 	free(array->tokens);
 	free(array);
 }
 
+lexer_t *lexer_open(const char *filename)
+{
+	lexer_t *lexer = calloc(1, sizeof(lexer_t));
+	lexer->line = 1;
+
+	struct stat st;
+	if (strcmp(filename, "-") && (stat(filename, &st) == -1 || S_ISREG(st.st_mode))) {
+		lexer->source = source_open(filename);
+		if (!lexer->source) {
+			free(lexer);
+			return NULL;
+		}
+		lexer->fd = -1;
+		lexer->buf = lexer->source->data;
+		lexer->len = lexer->source->length;
+		lexer->size = lexer->len;
+		return lexer;
+	}
+
+	/* stdin, pipes and devices have no size up front, read them in chunks */
+	lexer->fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : STDIN_FILENO;
+	if (lexer->fd == -1) {
+		fprintf(stderr, "Error reading file: %s\n", filename);
+		free(lexer);
+		return NULL;
+	}
+	lexer->source = malloc(sizeof(source_t));
+	lexer->source->data = NULL;
+	lexer->source->length = 0;
+	lexer->source->mapped = 0;
+	lexer->source->arena = NULL;
+	lexer->size = LEXER_CHUNK_SIZE;
+	lexer->buf = malloc(lexer->size);
+	lexer->len = 0;
+	return lexer;
+}
+
+/*
+ * Lexer over [start, end) of a source already in memory, starting at line
+ */
+lexer_t *lexer_range(source_t *source, size_t start, size_t end, int line)
+{
+	lexer_t *lexer = calloc(1, sizeof(lexer_t));
+	lexer->source = source;
+	lexer->fd = -1;
+	lexer->buf = source->data + start;
+	lexer->len = end - start;
+	lexer->size = lexer->len;
+	lexer->line = line;
+	return lexer;
+}
+
+/*
+ * Lexer handing out the tokens of an array lexed before, such as by
+ * tokenize_parallel()
+ */
+lexer_t *lexer_tokens(array_t *array)
+{
+	lexer_t *lexer = calloc(1, sizeof(lexer_t));
+	lexer->source = array->source;
+	lexer->fd = -1;
+	lexer->tokens = array->tokens;
+	return lexer;
+}
+
+/*
+ * Source is left to the tokens pointing into it
+ */
+void lexer_close(lexer_t *lexer)
+{
+	if (lexer->fd != -1) {
+		if (lexer->fd != STDIN_FILENO)
+			close(lexer->fd);
+		free(lexer->buf);
+	}
+	free(lexer->errors);
+	free(lexer);
+}
+
+void lex_error_print(int line, char character)
+{
+	if (character) {
+		fprintf(stderr, "[line %d] Error: Unexpected character: %c\n", line, character);
+	} else {
+		fprintf(stderr, "[line %d] Error: Unterminated string.\n", line);
+	}
+}
+
+void lexer_error(lexer_t *lexer, char character)
+{
+	if (lexer->diagnostics) {
+		char message[32];
+		if (character) {
+			sprintf(message, "Unexpected character: %c", character);
+			diagnostic_add(lexer->diagnostics, lexer->line,
+					lexer->buf + lexer->pos - lexer->source->data, 1, message);
+		} else {
+			diagnostic_add(lexer->diagnostics, lexer->line, 0, 0, "Unterminated string.");
+		}
+		errno = 65;
+		return;
+	}
+	if (!lexer->deferred) {
+		lex_error_print(lexer->line, character);
+		errno = 65;
+		return;
+	}
+	if (lexer->errors_length == lexer->errors_capacity) {
+		lexer->errors_capacity = lexer->errors_capacity ? lexer->errors_capacity * 2 : 8;
+		lexer->errors = realloc(lexer->errors, lexer->errors_capacity * sizeof(lex_error_t));
+	}
+	lexer->errors[lexer->errors_length].line = lexer->line;
+	lexer->errors[lexer->errors_length].character = character;
+	lexer->errors_length++;
+}
+
+/*
+ * Read the next chunk, dropping everything before *keep (or pos when keep
+ * is NULL). *keep and pos are moved along with the bytes they point at.
+ * Returns 0 at the end of input.
+ */
+size_t lexer_fill(lexer_t *lexer, size_t *keep)
+{
+	if (lexer->fd == -1)
+		return 0;
+
+	size_t from = keep ? *keep : lexer->pos;
+	memmove(lexer->buf, lexer->buf + from, lexer->len - from);
+	lexer->len -= from;
+	lexer->pos -= from;
+	if (keep)
+		*keep -= from;
+
+	/* A single token longer than the chunk */
+	if (lexer->len == lexer->size) {
+		lexer->size *= 2;
+		lexer->buf = realloc(lexer->buf, lexer->size);
+	}
+
+	ssize_t n;
+	do {
+		n = read(lexer->fd, lexer->buf + lexer->len, lexer->size - lexer->len);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0) {
+		if (n == -1) {
+			fprintf(stderr, "Error reading file contents\n");
+		}
+		return 0;
+	}
+	lexer->len += n;
+	lexer->source->length += n;
+	return n;
+}
+
+/*
+ * Character after pos, 0 at the end of input
+ */
+char lexer_peek_next(lexer_t *lexer, size_t *keep)
+{
+	if (lexer->pos + 1 >= lexer->len && !lexer_fill(lexer, keep))
+		return '\0';
+	return lexer->pos + 1 < lexer->len ? lexer->buf[lexer->pos + 1] : '\0';
+}
+
+token_t lexer_token(lexer_t *lexer, token_type_t type, size_t start, int length)
+{
+	char *text = lexer->buf + start;
+	symbol_t *symbol = NULL;
+	string_t *string = NULL;
+	double number = 0;
+	if (type == TOKEN_IDENTIFIER) {
+		symbol = intern(text, length);
+	} else if (type == TOKEN_STRING) {
+		string = lexer->arena ? string_arena(lexer->arena, text, length) :
+			string_new(text, length);
+	} else if (type == TOKEN_NUMBER) {
+		number = number_decode(text, length);
+	}
+	if (lexer->fd != -1) {
+		if (symbol) {
+			text = symbol->name;
+		} else if (string) {
+			text = string->chars;
+		} else if (type == TOKEN_NUMBER) {
+			text = source_store(lexer->source, text, length);
+		} else {
+			text = (char *) token_lexemes[type];
+		}
+	}
+	token_t token = token_gen(type, text, length, lexer->line);
+	token.symbol = symbol;
+	if (string) {
+		token.as.string = string;
+	} else if (type == TOKEN_NUMBER) {
+		token.as.number = number;
+	}
+	return token;
+}
+
+token_t lexer_single(lexer_t *lexer, token_type_t type)
+{
+	token_t token = lexer_token(lexer, type, lexer->pos, 1);
+	lexer->pos++;
+	return token;
+}
+
+/*
+ * Two character token when the next character is '=', otherwise the one
+ * character one
+ */
+token_t lexer_equal(lexer_t *lexer, token_type_t one, token_type_t two)
+{
+	if (lexer_peek_next(lexer, NULL) == '=') {
+		token_t token = lexer_token(lexer, two, lexer->pos, 2);
+		lexer->pos += 2;
+		return token;
+	}
+	return lexer_single(lexer, one);
+}
+
+token_t lexer_next(lexer_t *lexer)
+{
+	if (lexer->tokens) {
+		token_t token = lexer->tokens[lexer->index];
+		if (token.type == TOKEN_STRING) {
+			lexer->tokens[lexer->index].as.string = NULL;
+			if (lexer->arena) {
+				string_t *string = token.as.string;
+				token.as.string = string_arena(lexer->arena, string->chars, string->length);
+				free(string);
+			}
+		}
+		if (token.type != TOKEN_EOF)
+			lexer->index++;
+		return token;
+	}
+	for (;;) {
+		if (lexer->pos == lexer->len && !lexer_fill(lexer, NULL)) {
+			return token_gen(TOKEN_EOF, "", 0, lexer->line);
+		}
+		char *buf = lexer->buf;
+		size_t start = lexer->pos;
+		switch (buf[lexer->pos]) {
+			case '(': 
+				return lexer_single(lexer, TOKEN_LEFT_PAREN);
+			case ')':
+				return lexer_single(lexer, TOKEN_RIGHT_PAREN);
+			case '{':
+				return lexer_single(lexer, TOKEN_LEFT_BRACE);
+			case '}':
+				return lexer_single(lexer, TOKEN_RIGHT_BRACE);
+			case '*':
+				return lexer_single(lexer, TOKEN_STAR);
+			case '.':
+				if (lexer_peek_next(lexer, &start) != '.') {
+					return lexer_single(lexer, TOKEN_DOT);
+				}
+				/* .. or ..= of a range */
+				lexer->pos++;
+				if (lexer_peek_next(lexer, &start) == '=') {
+					lexer->pos += 2;
+					return lexer_token(lexer, TOKEN_DOT_DOT_EQUAL, start, 3);
+				}
+				lexer->pos++;
+				return lexer_token(lexer, TOKEN_DOT_DOT, start, 2);
+			case ',':
+				return lexer_single(lexer, TOKEN_COMMA);
+			case '+':
+				return lexer_single(lexer, TOKEN_PLUS);
+			case '-':
+				return lexer_single(lexer, TOKEN_MINUS);
+			case ';':
+				return lexer_single(lexer, TOKEN_SEMICOLON);
+			case '=':
+				return lexer_equal(lexer, TOKEN_EQUAL, TOKEN_EQUAL_EQUAL);
+			case '!':
+				return lexer_equal(lexer, TOKEN_BANG, TOKEN_BANG_EQUAL);
+			case '>':
+				return lexer_equal(lexer, TOKEN_GREATER, TOKEN_GREATER_EQUAL);
+			case '<':
+				return lexer_equal(lexer, TOKEN_LESS, TOKEN_LESS_EQUAL);
+			case '/':
+				if (lexer_peek_next(lexer, NULL) != '/') {
+					return lexer_single(lexer, TOKEN_SLASH);
+				}
+				// Skip both forward slashes and the rest of the line
+				lexer->pos += 2;
+				do {
+					lexer->pos = scan_line(lexer->buf + lexer->pos,
+							lexer->buf + lexer->len) - lexer->buf;
+				} while (lexer->pos == lexer->len && lexer_fill(lexer, NULL));
+				break;
+			case ' ':
+			case '\t':
+			case '\n':
+				do {
+					lexer->pos = scan_blank(lexer->buf + lexer->pos,
+							lexer->buf + lexer->len, &lexer->line) - lexer->buf;
+				} while (lexer->pos == lexer->len && lexer_fill(lexer, NULL));
+				break;
+			case '"':
+				start = ++lexer->pos;
+				do {
+					lexer->pos = scan_string(lexer->buf + lexer->pos,
+							lexer->buf + lexer->len, &lexer->line) - lexer->buf;
+				} while (lexer->pos == lexer->len && lexer_fill(lexer, &start));
+				if (lexer->pos == lexer->len) {
+					lexer_error(lexer, 0);
+					break;
+				} else {
+					token_t token = lexer_token(lexer, TOKEN_STRING, start,
+							lexer->pos - start);
+					lexer->pos++;
+					return token;
+				}
+
+			default:
+				if (is_alpha(buf[lexer->pos])) {
+					do {
+						lexer->pos = scan_ident(lexer->buf + lexer->pos,
+								lexer->buf + lexer->len) - lexer->buf;
+					} while (lexer->pos == lexer->len && lexer_fill(lexer, &start));
+					int len = lexer->pos - start;
+					return lexer_token(lexer, keyword_type(lexer->buf + start, len),
+							start, len);
+
+				} else if (is_digit(buf[lexer->pos])) {
+					do {
+						lexer->pos = scan_digits(lexer->buf + lexer->pos,
+								lexer->buf + lexer->len) - lexer->buf;
+					} while (lexer->pos == lexer->len && lexer_fill(lexer, &start));
+					if (lexer->pos < lexer->len && lexer->buf[lexer->pos] == '.' &&
+							is_digit(lexer_peek_next(lexer, &start))) {
+						lexer->pos++;
+						do {
+							lexer->pos = scan_digits(lexer->buf + lexer->pos,
+									lexer->buf + lexer->len) - lexer->buf;
+						} while (lexer->pos == lexer->len && lexer_fill(lexer, &start));
+					}
+					return lexer_token(lexer, TOKEN_NUMBER, start, lexer->pos - start);
+
+				} else {
+					lexer_error(lexer, buf[lexer->pos]);
+					lexer->pos++;
+				}
+		}
+	}
+}
+
 array_t *tokenize(char *filename)
 {
+	lexer_t *lexer = lexer_open(filename);
+	if (!lexer) {
+		return NULL;
+	}
+
 	array_t *tokens = malloc(sizeof(array_t));
 	tokens->tokens = malloc(DEFAULT_TOKENS_SIZE * sizeof(token_t));
 	tokens->length = 0;
 	tokens->capacity = DEFAULT_TOKENS_SIZE;
+	tokens->source = lexer->source;
 
-	char *source = read_source(filename);
-	int line = 1;
-	size_t source_len = strlen(source);
-	if (source_len > 0) {
-		for (int i = 0; i < source_len; i++) {
-			switch (source[i]) {
-				case '(': 
-					token_add(tokens, token_gen(TOKEN_LEFT_PAREN, "(", line));
-					break;
-				case ')':
-					token_add(tokens, token_gen(TOKEN_RIGHT_PAREN, ")", line));
-					break;
-				case '{':
-					token_add(tokens, token_gen(TOKEN_LEFT_BRACE, "{", line));
-					break;
-				case '}':
-					token_add(tokens, token_gen(TOKEN_RIGHT_BRACE, "}", line));
-					break;
-				case '*':
-					token_add(tokens, token_gen(TOKEN_STAR, "*", line));
-					break;
-				case '.':
-					token_add(tokens, token_gen(TOKEN_DOT, ".", line));
-					break;
-				case ',':
-					token_add(tokens, token_gen(TOKEN_COMMA, ",", line));
-					break;
-				case '+':
-					token_add(tokens, token_gen(TOKEN_PLUS, "+", line));
-					break;
-				case '-':
-					token_add(tokens, token_gen(TOKEN_MINUS, "-", line));
-					break;
-				case ';':
-					token_add(tokens, token_gen(TOKEN_SEMICOLON, ";", line));
-					break;
-				case '=':
-					if (source[i + 1] == '=') {
-						token_add(tokens, token_gen(TOKEN_EQUAL_EQUAL, "==", line));
-						i++;
-					} else {
-						token_add(tokens, token_gen(TOKEN_EQUAL, "=", line));
-					}
-					break;
-				case '!':
-					if (source[i + 1] == '=') {
-						token_add(tokens, token_gen(TOKEN_BANG_EQUAL, "!=", line));
-						i++;
-					} else {
-						token_add(tokens, token_gen(TOKEN_BANG, "!", line));
-					}
-					break;
-				case '>':
-					if (source[i + 1] == '=') {
-						token_add(tokens, token_gen(TOKEN_GREATER_EQUAL, ">=", line));
-						i++;
-					} else {
-						token_add(tokens, token_gen(TOKEN_GREATER, ">", line));
-					}
-					break;
-				case '<':
-					if (source[i + 1] == '=') {
-						token_add(tokens, token_gen(TOKEN_LESS_EQUAL, "<=", line));
-						i++;
-					} else {
-						token_add(tokens, token_gen(TOKEN_LESS, "<", line));
-					}
-					break;
-				case '/':
-					if (source[i + 1] == '/') {
-						i += 2; // Skip both forward slashes
-						while (i < strlen(source) && source[i] != '\n') {
-							i++;
-						}
-						i--;
-					} else {
-						token_add(tokens, token_gen(TOKEN_SLASH, "/", line));
-					}
-					break;
-				case ' ':
-					break;
-				case '\t':
-					break;
-				case '\n':
-					line++;
-					break;
-				case '"':
-					i++;
-					int str_start = i;
-					while (source[i] != '"' && source[i] != '\0') {
-						if (source[i] == '\n')
-							line++;
-						i++;
-					}
-					if (source[i] == '\0') {
-						fprintf(stderr, "[line %d] Error: Unterminated string.\n", line);
-						errno = 65;
-					} else {
-						int len = i - str_start;
-						char str[len + 1];
-						strncpy(str, &source[str_start], len);
-						str[len] = 0;
-						token_add(tokens, token_gen(TOKEN_STRING, str, line));
-					}
-					break;
+	token_t token;
+	do {
+		token = lexer_next(lexer);
+		token_add(tokens, token);
+	} while (token.type != TOKEN_EOF);
+	lexer_close(lexer);
+	return tokens;
+}
 
-				default:
-					if (is_alpha(source[i])) {
-						int id_start = i;
-						while (source[i] == '_' || (source[i] >= 'a' && source[i] <= 'z') ||
-								(source[i] >= 'A' && source[i] <= 'Z') ||
-								(source[i] >= '0' && source[i] <= '9')) {
-							i++;
-						}
-						int len = i - id_start;
-						char id[len + 1];
-						strncpy(id, &source[i-len], len);
-						id[len] = 0;
-
-						int found = 0;
-						for (int i = 0; i < sizeof(reserved_keywords) / sizeof(reserved_keywords[0]); i++) {
-							if (strcmp(id, reserved_keywords[i].keyword) == 0) {
-								token_add(tokens, token_gen(reserved_keywords[i].token_type, id, line));
-								found = 1;
-							}
-						}
-						if (!found) {
-							token_add(tokens, token_gen(TOKEN_IDENTIFIER, id, line));
-						}
-						i--;
-						break;
-
-					} else if (is_digit(source[i])) {
-						int int_start = i;
-						while (isdigit(source[i]))
-							i++;
-						if (source[i] == '.' && isdigit(source[i + 1])) {
-							i++;
-							while (isdigit(source[i]))
-								i++;
-						}
-						int len = i - int_start;
-						char *iend = source + int_start;
-						char integer[len + 1];
-						strncpy(integer, iend, len);
-						integer[len] = 0;
-						token_add(tokens, token_gen(TOKEN_NUMBER, integer, line));
-						i--;
-
-					} else {
-						fprintf(stderr, "[line %d] Error: Unexpected character: %c\n", line, source[i]);
-						errno = 65;
-					}
+/*
+ * Chunk starts of roughly equal size. Each is right after a newline outside
+ * any string, so no token crosses from one chunk into the next. Returns the
+ * number of chunks found, at most chunks.
+ */
+int split_source(source_t *source, size_t *starts, int chunks)
+{
+	const char *data = source->data;
+	const char *p = data, *end = data + source->length;
+	int found = 1;
+	int lines = 0;
+	starts[0] = 0;
+	while (found < chunks && p < end) {
+		const char *target = data + source->length / chunks * found;
+		const char *special = scan_code(p, end);
+		if (special > target) {
+			/* Code between p and special, any newline in it after target will do */
+			const char *from = p > target ? p : target;
+			const char *nl = memchr(from, '\n', special - from);
+			if (nl) {
+				starts[found++] = nl + 1 - data;
+				p = nl + 1;
+				continue;
 			}
 		}
+		p = special;
+		if (p == end) {
+			break;
+		} else if (*p == '"') {
+			const char *close = scan_string(p + 1, end, &lines);
+			p = close < end ? close + 1 : end;
+		} else if (p + 1 < end && p[1] == '/') {
+			p = scan_line(p + 2, end);
+		} else {
+			p++;
+		}
 	}
-	token_add(tokens, token_gen(TOKEN_EOF, "EOF", line));
-	free(source);
+	return found;
+}
+
+typedef struct {
+	lexer_t *lexer;
+	array_t tokens;
+	/* Where the chunk goes in the stitched array */
+	token_t *out;
+	int offset;
+	int line;
+} chunk_t;
+
+void lex_chunk(void *arg)
+{
+	chunk_t *chunk = arg;
+	token_t token;
+	do {
+		token = lexer_next(chunk->lexer);
+		token_add(&chunk->tokens, token);
+	} while (token.type != TOKEN_EOF);
+}
+
+void stitch_chunk(void *arg)
+{
+	chunk_t *chunk = arg;
+	for (int i = 0; i < chunk->tokens.length; i++) {
+		chunk->out[i] = chunk->tokens.tokens[i];
+		chunk->out[i].line += chunk->line;
+	}
+	free(chunk->tokens.tokens);
+}
+
+/*
+ * Same tokens as tokenize(), with the source split into chunks that are
+ * lexed on threads and stitched back together
+ */
+array_t *tokenize_parallel(char *filename, int threads)
+{
+	source_t *source = source_open(filename);
+	if (!source) {
+		return NULL;
+	}
+
+	int chunks = source->length / PARALLEL_MIN_CHUNK;
+	chunks = chunks < threads ? chunks : threads;
+	if (chunks <= 1) {
+		source_close(source);
+		return tokenize(filename);
+	}
+
+	size_t *starts = malloc((chunks + 1) * sizeof(size_t));
+	chunks = split_source(source, starts, chunks);
+	starts[chunks] = source->length;
+
+	pool_t *pool = pool_create(threads);
+	chunk_t *chunk = malloc(chunks * sizeof(chunk_t));
+	for (int i = 0; i < chunks; i++) {
+		/* Lines are counted from 0 and shifted when stitching */
+		chunk[i].lexer = lexer_range(source, starts[i], starts[i + 1], 0);
+		chunk[i].lexer->deferred = 1;
+		chunk[i].tokens.tokens = malloc(DEFAULT_TOKENS_SIZE * sizeof(token_t));
+		chunk[i].tokens.length = 0;
+		chunk[i].tokens.capacity = DEFAULT_TOKENS_SIZE;
+		chunk[i].tokens.source = source;
+		pool_submit(pool, lex_chunk, &chunk[i]);
+	}
+	pool_wait(pool);
+
+	/* Line at the start of each chunk and its place in the result */
+	int length = 0;
+	int line = 1;
+	for (int i = 0; i < chunks; i++) {
+		lexer_t *lexer = chunk[i].lexer;
+		for (int j = 0; j < lexer->errors_length; j++) {
+			lex_error_print(lexer->errors[j].line + line, lexer->errors[j].character);
+			errno = 65;
+		}
+		/* Every chunk but the last drops its EOF */
+		if (i < chunks - 1)
+			chunk[i].tokens.length--;
+		chunk[i].line = line;
+		chunk[i].offset = length;
+		length += chunk[i].tokens.length;
+		line += lexer->line;
+		lexer_close(lexer);
+	}
+
+	array_t *tokens = malloc(sizeof(array_t));
+	tokens->tokens = malloc(length * sizeof(token_t));
+	tokens->length = length;
+	tokens->capacity = length;
+	tokens->source = source;
+	for (int i = 0; i < chunks; i++) {
+		chunk[i].out = tokens->tokens + chunk[i].offset;
+		pool_submit(pool, stitch_chunk, &chunk[i]);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+
+	free(chunk);
+	free(starts);
 	return tokens;
 }
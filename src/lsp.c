@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cache.h"
+#include "json.h"
+#include "lsp.h"
+
+void lsp_init(lsp_t *lsp, FILE *in, FILE *out)
+{
+	memset(lsp, 0, sizeof(lsp_t));
+	lsp->in = in;
+	lsp->out = out;
+	lsp->documents_capacity = DEFAULT_DOCUMENTS_SIZE;
+	lsp->documents = malloc(DEFAULT_DOCUMENTS_SIZE * sizeof(lsp_document_t));
+}
+
+/*
+ * Content of the next message, after its headers. NULL at the end of in
+ * or when the headers are broken.
+ */
+char *lsp_read(FILE *in, size_t *length)
+{
+	char header[256];
+	long size = -1;
+	while (fgets(header, sizeof(header), in)) {
+		if (!strcmp(header, "\r\n") || !strcmp(header, "\n")) {
+			if (size < 0) {
+				return NULL;
+			}
+			char *message = malloc(size + 1);
+			if (fread(message, 1, size, in) != (size_t) size) {
+				free(message);
+				return NULL;
+			}
+			message[size] = '\0';
+			*length = size;
+			return message;
+		}
+		if (!strncasecmp(header, "Content-Length:", 15)) {
+			size = strtol(header + 15, NULL, 10);
+		}
+	}
+	return NULL;
+}
+
+void lsp_send(lsp_t *lsp, char *message, size_t length)
+{
+	fprintf(lsp->out, "Content-Length: %zu\r\n\r\n", length);
+	fwrite(message, 1, length, lsp->out);
+	fflush(lsp->out);
+}
+
+/* Ids are numbers or strings, written back as they came */
+void lsp_write_id(FILE *out, json_t *id)
+{
+	if (!id || id->type == JSON_NULL) {
+		fputs("null", out);
+	} else if (id->type == JSON_STRING) {
+		json_write_string(out, id->string, id->length);
+	} else {
+		fprintf(out, "%lld", (long long) id->number);
+	}
+}
+
+void lsp_respond(lsp_t *lsp, json_t *id, const char *result)
+{
+	char *message;
+	size_t length;
+	FILE *out = open_memstream(&message, &length);
+	fputs("{\"jsonrpc\":\"2.0\",\"id\":", out);
+	lsp_write_id(out, id);
+	fprintf(out, ",\"result\":%s}", result);
+	fclose(out);
+	lsp_send(lsp, message, length);
+	free(message);
+}
+
+void lsp_error(lsp_t *lsp, json_t *id, int code, const char *error)
+{
+	char *message;
+	size_t length;
+	FILE *out = open_memstream(&message, &length);
+	fputs("{\"jsonrpc\":\"2.0\",\"id\":", out);
+	lsp_write_id(out, id);
+	fprintf(out, ",\"error\":{\"code\":%d,\"message\":\"%s\"}}", code, error);
+	fclose(out);
+	lsp_send(lsp, message, length);
+	free(message);
+}
+
+/* Positions are counted in bytes or in UTF-16 units of the bytes there */
+int lsp_units(lsp_t *lsp, unsigned char c, int *bytes)
+{
+	*bytes = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+	return lsp->utf8 ? *bytes : *bytes == 4 ? 2 : 1;
+}
+
+/* Offset in the text of an LSP position, kept within its line */
+size_t lsp_offset(lsp_t *lsp, document_t *document, json_t *position)
+{
+	json_t *line = json_get(position, "line");
+	json_t *character = json_get(position, "character");
+	if (!line || !character) {
+		return document->length;
+	}
+	size_t offset = document_line(document, (int) line->number + 1);
+	int units = character->number;
+	while (units > 0 && offset < document->length && document->text[offset] != '\n') {
+		int bytes;
+		units -= lsp_units(lsp, document->text[offset], &bytes);
+		offset += bytes;
+	}
+	return offset < document->length ? offset : document->length;
+}
+
+void lsp_write_position(lsp_t *lsp, FILE *out, document_t *document, size_t offset)
+{
+	int line = document_line_of(document, offset);
+	size_t at = document_line(document, line);
+	int units = 0;
+	while (at < offset) {
+		int bytes;
+		units += lsp_units(lsp, document->text[at], &bytes);
+		at += bytes;
+	}
+	fprintf(out, "{\"line\":%d,\"character\":%d}", line - 1, units);
+}
+
+/*
+ * Send every diagnostic of a document, a diagnostic with no bytes of its
+ * own covers its line
+ */
+void lsp_publish(lsp_t *lsp, lsp_document_t *open)
+{
+	document_t *document = open->document;
+	char *message;
+	size_t length;
+	FILE *out = open_memstream(&message, &length);
+	fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+			"\"params\":{\"uri\":", out);
+	json_write_string(out, open->uri, strlen(open->uri));
+	fprintf(out, ",\"version\":%d,\"diagnostics\":[", open->version);
+	int count = 0;
+	for (int i = 0; i < document->chunks_length; i++) {
+		diagnostics_t *diagnostics = &document->chunks[i].diagnostics;
+		for (int j = 0; j < diagnostics->length; j++) {
+			diagnostic_t *diagnostic = &diagnostics->items[j];
+			size_t start = diagnostic->start, end = start + diagnostic->length;
+			if (!diagnostic->length) {
+				start = document_line(document, diagnostic->line);
+				char *newline = memchr(document->text + start, '\n', document->length - start);
+				end = newline ? (size_t) (newline - document->text) : document->length;
+			}
+			fputs(count++ ? ",{\"range\":{\"start\":" : "{\"range\":{\"start\":", out);
+			lsp_write_position(lsp, out, document, start);
+			fputs(",\"end\":", out);
+			lsp_write_position(lsp, out, document, end);
+			fputs("},\"severity\":1,\"source\":\"rd\",\"message\":", out);
+			json_write_string(out, diagnostic->message, strlen(diagnostic->message));
+			fputc('}', out);
+		}
+	}
+	fputs("]}}", out);
+	fclose(out);
+	lsp_send(lsp, message, length);
+	free(message);
+}
+
+lsp_document_t *lsp_find(lsp_t *lsp, json_t *uri)
+{
+	for (int i = 0; uri && i < lsp->documents_length; i++) {
+		if (!strcmp(lsp->documents[i].uri, uri->string)) {
+			return &lsp->documents[i];
+		}
+	}
+	return NULL;
+}
+
+void lsp_open(lsp_t *lsp, json_t *params)
+{
+	json_t *item = json_get(params, "textDocument");
+	json_t *uri = json_get(item, "uri");
+	json_t *text = json_get(item, "text");
+	json_t *version = json_get(item, "version");
+	if (!uri || uri->type != JSON_STRING || !text || text->type != JSON_STRING) {
+		return;
+	}
+	lsp_document_t *open = lsp_find(lsp, uri);
+	if (open) {
+		document_free(open->document);
+	} else {
+		if (lsp->documents_length == lsp->documents_capacity) {
+			lsp->documents_capacity *= 2;
+			lsp->documents = realloc(lsp->documents,
+					lsp->documents_capacity * sizeof(lsp_document_t));
+		}
+		open = &lsp->documents[lsp->documents_length++];
+		open->uri = strdup(uri->string);
+	}
+	open->version = version ? version->number : 0;
+	open->document = document_open(text->string, text->length);
+	lsp_publish(lsp, open);
+}
+
+/* Edits with a range are applied one after another, one without replaces all */
+void lsp_change(lsp_t *lsp, json_t *params)
+{
+	lsp_document_t *open = lsp_find(lsp, json_path(params, "textDocument", "uri"));
+	json_t *changes = json_get(params, "contentChanges");
+	if (!open || !changes || changes->type != JSON_ARRAY) {
+		return;
+	}
+	json_t *version = json_path(params, "textDocument", "version");
+	open->version = version ? version->number : open->version + 1;
+	document_t *document = open->document;
+	for (json_t *change = changes->child; change; change = change->next) {
+		json_t *text = json_get(change, "text");
+		json_t *range = json_get(change, "range");
+		if (!text || text->type != JSON_STRING) {
+			continue;
+		}
+		size_t start = 0, end = document->length;
+		if (range) {
+			start = lsp_offset(lsp, document, json_get(range, "start"));
+			end = lsp_offset(lsp, document, json_get(range, "end"));
+			if (end < start) {
+				end = start;
+			}
+		}
+		document_edit(document, start, end, text->string, text->length);
+	}
+	lsp_publish(lsp, open);
+}
+
+void lsp_close(lsp_t *lsp, json_t *params)
+{
+	lsp_document_t *open = lsp_find(lsp, json_path(params, "textDocument", "uri"));
+	if (!open) {
+		return;
+	}
+	/* Clear what it showed */
+	document_free(open->document);
+	open->document = document_open("", 0);
+	lsp_publish(lsp, open);
+	document_free(open->document);
+	free(open->uri);
+	*open = lsp->documents[--lsp->documents_length];
+}
+
+void lsp_initialize(lsp_t *lsp, json_t *id, json_t *params)
+{
+	json_t *encodings = json_path(json_get(params, "capabilities"), "general",
+			"positionEncodings");
+	for (json_t *encoding = encodings ? encodings->child : NULL; encoding;
+			encoding = encoding->next) {
+		if (encoding->type == JSON_STRING && !strcmp(encoding->string, "utf-8")) {
+			lsp->utf8 = 1;
+		}
+	}
+	char result[256];
+	snprintf(result, sizeof(result), "{\"capabilities\":{\"positionEncoding\":\"%s\","
+			"\"textDocumentSync\":{\"openClose\":true,\"change\":2}},"
+			"\"serverInfo\":{\"name\":\"rd\",\"version\":\"%s\"}}",
+			lsp->utf8 ? "utf-8" : "utf-16", VERSION);
+	lsp_respond(lsp, id, result);
+}
+
+/* Handle one message, the content of it without the headers */
+void lsp_message(lsp_t *lsp, const char *message, size_t length)
+{
+	arena_t *arena = arena_create();
+	json_t *json = json_parse(arena, message, length);
+	json_t *method = json_get(json, "method");
+	json_t *id = json_get(json, "id");
+	json_t *params = json_get(json, "params");
+	if (!json) {
+		lsp_error(lsp, NULL, -32700, "Parse error");
+	} else if (!method || method->type != JSON_STRING) {
+		/* A response to a request of ours, there are none */
+	} else if (!strcmp(method->string, "initialize")) {
+		lsp_initialize(lsp, id, params);
+	} else if (!strcmp(method->string, "shutdown")) {
+		lsp->shutdown = 1;
+		lsp_respond(lsp, id, "null");
+	} else if (!strcmp(method->string, "exit")) {
+		lsp->exited = 1;
+	} else if (!strcmp(method->string, "textDocument/didOpen")) {
+		lsp_open(lsp, params);
+	} else if (!strcmp(method->string, "textDocument/didChange")) {
+		lsp_change(lsp, params);
+	} else if (!strcmp(method->string, "textDocument/didClose")) {
+		lsp_close(lsp, params);
+	} else if (id) {
+		lsp_error(lsp, id, -32601, "Method not found");
+	}
+	arena_free(arena);
+}
+
+void lsp_free(lsp_t *lsp)
+{
+	for (int i = 0; i < lsp->documents_length; i++) {
+		document_free(lsp->documents[i].document);
+		free(lsp->documents[i].uri);
+	}
+	free(lsp->documents);
+}
+
+/*
+ * rd lsp [--record file]
+ * Serve stdin and stdout until exit, --record keeps what came in so it can
+ * be replayed by rd bench-lsp
+ */
+int lsp_main(int argc, char **argv)
+{
+	lsp_t lsp;
+	lsp_init(&lsp, stdin, stdout);
+	if (argc == 4 && !strcmp(argv[2], "--record")) {
+		lsp.record = fopen(argv[3], "w");
+		if (!lsp.record) {
+			fprintf(stderr, "Error writing file: %s\n", argv[3]);
+			lsp_free(&lsp);
+			return 1;
+		}
+	} else if (argc != 2) {
+		fprintf(stderr, "Usage: rd lsp [--record file]\n");
+		lsp_free(&lsp);
+		return 1;
+	}
+	char *message;
+	size_t length;
+	while (!lsp.exited && (message = lsp_read(lsp.in, &length))) {
+		if (lsp.record) {
+			fprintf(lsp.record, "Content-Length: %zu\r\n\r\n", length);
+			fwrite(message, 1, length, lsp.record);
+			fflush(lsp.record);
+		}
+		lsp_message(&lsp, message, length);
+		free(message);
+	}
+	if (lsp.record) {
+		fclose(lsp.record);
+	}
+	lsp_free(&lsp);
+	free_symbols();
+	return lsp.shutdown ? 0 : 1;
+}
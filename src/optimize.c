@@ -0,0 +1,1773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "interpreter.h"
+#include "optimize.h"
+
+stmt_t *optimize_stmt(arena_t *arena, stmt_t *stmt);
+
+/* Value of a literal, NULL for anything that is not a constant */
+value_t *constant(expr_t *expr)
+{
+	return expr && expr->type == EXPR_LITERAL ? expr->as.literal.value : NULL;
+}
+
+/*
+ * Turn expr into a literal in place, it keeps its line
+ */
+expr_t *make_literal(arena_t *arena, expr_t *expr, value_t value)
+{
+	expr->type = EXPR_LITERAL;
+	expr->as.literal.value = arena_alloc(arena, sizeof(value_t));
+	*expr->as.literal.value = value;
+	return expr;
+}
+
+expr_t *make_number(arena_t *arena, expr_t *expr, double number)
+{
+	return make_literal(arena, expr, NUMBER_VAL(number));
+}
+
+expr_t *make_bool(arena_t *arena, expr_t *expr, int boolean)
+{
+	return make_literal(arena, expr, BOOL_VAL(boolean));
+}
+
+/* Whether expr can only evaluate to a number, or fail */
+int is_number(expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			return IS_NUMBER(*expr->as.literal.value);
+		case EXPR_UNARY:
+			return expr->as.unary.operator.type == TOKEN_MINUS;
+		case EXPR_BINARY:
+			switch (expr->as.binary.operator.type) {
+				case TOKEN_MINUS:
+				case TOKEN_STAR:
+				case TOKEN_SLASH:
+					return 1;
+				case TOKEN_PLUS:
+					return is_number(expr->as.binary.left) && is_number(expr->as.binary.right);
+				default:
+					return 0;
+			}
+		default:
+			return 0;
+	}
+}
+
+/* Whether expr can only evaluate to a boolean, or fail */
+int is_bool(expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			return IS_BOOL(*expr->as.literal.value);
+		case EXPR_UNARY:
+			return expr->as.unary.operator.type == TOKEN_BANG;
+		case EXPR_BINARY:
+			switch (expr->as.binary.operator.type) {
+				case TOKEN_EQUAL_EQUAL:
+				case TOKEN_BANG_EQUAL:
+				case TOKEN_GREATER:
+				case TOKEN_GREATER_EQUAL:
+				case TOKEN_LESS:
+				case TOKEN_LESS_EQUAL:
+					return 1;
+				default:
+					return 0;
+			}
+		default:
+			return 0;
+	}
+}
+
+int is_number_constant(expr_t *expr, double number)
+{
+	value_t *value = constant(expr);
+	return value && IS_NUMBER(*value) && AS_NUMBER(*value) == number;
+}
+
+/*
+ * Same result as visit_binary() for two constants. Anything that would be
+ * a runtime error, division by zero included, is left to raise it when
+ * the program gets there.
+ */
+expr_t *fold_binary(arena_t *arena, expr_t *expr)
+{
+	token_type_t op = expr->as.binary.operator.type;
+	expr_t *left_expr = expr->as.binary.left, *right_expr = expr->as.binary.right;
+	value_t *left = constant(left_expr), *right = constant(right_expr);
+
+	if (!left || !right) {
+		/* x + 0, x - 0, x * 1 and x / 1 when x is surely a number */
+		if ((op == TOKEN_PLUS || op == TOKEN_MINUS) && is_number_constant(right_expr, 0) &&
+				is_number(left_expr)) {
+			return left_expr;
+		}
+		if ((op == TOKEN_STAR || op == TOKEN_SLASH) && is_number_constant(right_expr, 1) &&
+				is_number(left_expr)) {
+			return left_expr;
+		}
+		if (op == TOKEN_PLUS && is_number_constant(left_expr, 0) && is_number(right_expr)) {
+			return right_expr;
+		}
+		if (op == TOKEN_STAR && is_number_constant(left_expr, 1) && is_number(right_expr)) {
+			return right_expr;
+		}
+		return expr;
+	}
+
+	if (IS_NUMBER(*left) && IS_NUMBER(*right)) {
+		double a = AS_NUMBER(*left), b = AS_NUMBER(*right);
+		switch (op) {
+			case TOKEN_PLUS:
+				return make_number(arena, expr, a + b);
+			case TOKEN_MINUS:
+				return make_number(arena, expr, a - b);
+			case TOKEN_STAR:
+				return make_number(arena, expr, a * b);
+			case TOKEN_SLASH:
+				return b == 0 ? expr : make_number(arena, expr, a / b);
+			case TOKEN_GREATER:
+				return make_bool(arena, expr, a > b);
+			case TOKEN_GREATER_EQUAL:
+				return make_bool(arena, expr, a >= b);
+			case TOKEN_LESS:
+				return make_bool(arena, expr, a < b);
+			case TOKEN_LESS_EQUAL:
+				return make_bool(arena, expr, a <= b);
+			default:
+				break;
+		}
+	}
+
+	if (op == TOKEN_EQUAL_EQUAL || op == TOKEN_BANG_EQUAL) {
+		int is_equal = 0;
+		if (VALUE_TYPE(*left) == VALUE_TYPE(*right)) {
+			switch (VALUE_TYPE(*left)) {
+				case VAL_NUMBER:
+					is_equal = AS_NUMBER(*left) == AS_NUMBER(*right);
+					break;
+				case VAL_BOOL:
+					is_equal = AS_BOOL(*left) == AS_BOOL(*right);
+					break;
+				case VAL_STRING:
+					is_equal = string_equal(AS_STRING(*left), AS_STRING(*right));
+					break;
+				case VAL_NIL:
+					is_equal = 1;
+					break;
+				default:
+					return expr;
+			}
+		}
+		return make_bool(arena, expr, op == TOKEN_EQUAL_EQUAL ? is_equal : !is_equal);
+	}
+
+	if (op == TOKEN_PLUS && IS_STRING(*left) && IS_STRING(*right)) {
+		string_t *string = string_concat_arena(arena, AS_STRING(*left), AS_STRING(*right));
+		return make_literal(arena, expr, STRING_VAL(string));
+	}
+	return expr;
+}
+
+expr_t *fold_unary(arena_t *arena, expr_t *expr)
+{
+	expr_t *right = expr->as.unary.right;
+	value_t *value = constant(right);
+	if (expr->as.unary.operator.type == TOKEN_MINUS) {
+		if (value && IS_NUMBER(*value)) {
+			return make_number(arena, expr, -AS_NUMBER(*value));
+		}
+		/* -(-x) */
+		if (right->type == EXPR_UNARY && right->as.unary.operator.type == TOKEN_MINUS &&
+				is_number(right->as.unary.right)) {
+			return right->as.unary.right;
+		}
+	} else if (expr->as.unary.operator.type == TOKEN_BANG) {
+		if (value) {
+			return make_bool(arena, expr, !is_truthy(*value));
+		}
+		/* !!x */
+		if (right->type == EXPR_UNARY && right->as.unary.operator.type == TOKEN_BANG &&
+				is_bool(right->as.unary.right)) {
+			return right->as.unary.right;
+		}
+	}
+	return expr;
+}
+
+/*
+ * and and or give back one of their operands, so a constant left one
+ * decides which
+ */
+expr_t *fold_logical(expr_t *expr)
+{
+	value_t *left = constant(expr->as.logical.left);
+	if (!left) {
+		return expr;
+	}
+	int truthy = is_truthy(*left);
+	if (expr->as.logical.operator.type == TOKEN_OR) {
+		return truthy ? expr->as.logical.left : expr->as.logical.right;
+	}
+	return truthy ? expr->as.logical.right : expr->as.logical.left;
+}
+
+/*
+ * Fold constant subexpressions of expr, which is changed in place or
+ * replaced by one of its children
+ */
+expr_t *fold_expr(arena_t *arena, expr_t *expr)
+{
+	if (!expr) {
+		return NULL;
+	}
+	switch (expr->type) {
+		case EXPR_BINARY:
+			expr->as.binary.left = fold_expr(arena, expr->as.binary.left);
+			expr->as.binary.right = fold_expr(arena, expr->as.binary.right);
+			return fold_binary(arena, expr);
+
+		case EXPR_UNARY:
+			expr->as.unary.right = fold_expr(arena, expr->as.unary.right);
+			return fold_unary(arena, expr);
+
+		case EXPR_LOGICAL:
+			expr->as.logical.left = fold_expr(arena, expr->as.logical.left);
+			expr->as.logical.right = fold_expr(arena, expr->as.logical.right);
+			return fold_logical(expr);
+
+		case EXPR_GROUPING:
+			return fold_expr(arena, expr->as.grouping.expression);
+
+		case EXPR_ASSIGN:
+			expr->as.assign.value = fold_expr(arena, expr->as.assign.value);
+			return expr;
+
+		case EXPR_CALL:
+			expr->as.call.callee = fold_expr(arena, expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				expr->as.call.args->arguments[i] = fold_expr(arena,
+						expr->as.call.args->arguments[i]);
+			}
+			return expr;
+
+		default:
+			return expr;
+	}
+}
+
+/* Statement that does nothing, where one is needed */
+stmt_t *empty_block(arena_t *arena)
+{
+	stmt_t *stmt = arena_alloc(arena, sizeof(stmt_t));
+	stmt->type = STMT_BLOCK;
+	stmt->as.block.statements = arena_alloc(arena, sizeof(stmt_array_t));
+	stmt->as.block.statements->statements = NULL;
+	stmt->as.block.statements->length = 0;
+	stmt->as.block.statements->capacity = 0;
+	return stmt;
+}
+
+/* Block of the single statement stmt, which keeps its scope */
+stmt_t *block_of(arena_t *arena, stmt_t *stmt)
+{
+	stmt_t *block = empty_block(arena);
+	block->as.block.statements->statements = arena_alloc(arena, sizeof(stmt_t *));
+	block->as.block.statements->statements[0] = stmt;
+	block->as.block.statements->length = 1;
+	block->as.block.statements->capacity = 1;
+	return block;
+}
+
+/*
+ * Optimize the statements in place, dropping the ones that do nothing
+ */
+void optimize_stmts(arena_t *arena, stmt_array_t *array)
+{
+	int length = 0;
+	for (int i = 0; i < array->length; i++) {
+		stmt_t *stmt = optimize_stmt(arena, array->statements[i]);
+		if (stmt) {
+			array->statements[length++] = stmt;
+		}
+	}
+	array->length = length;
+}
+
+/*
+ * NULL when stmt does nothing. An if with a constant condition becomes
+ * the branch taken, which runs in the same environment either way.
+ */
+stmt_t *optimize_stmt(arena_t *arena, stmt_t *stmt)
+{
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			optimize_stmts(arena, stmt->as.block.statements);
+			return stmt->as.block.statements->length ? stmt : NULL;
+
+		case STMT_EXPR:
+			stmt->as.expr.expression = fold_expr(arena, stmt->as.expr.expression);
+			return stmt;
+
+		case STMT_PRINT:
+			stmt->as.print.expression = fold_expr(arena, stmt->as.print.expression);
+			return stmt;
+
+		case STMT_VAR:
+			stmt->as.variable.initializer = fold_expr(arena, stmt->as.variable.initializer);
+			return stmt;
+
+		case STMT_RETURN:
+			stmt->as._return.value = fold_expr(arena, stmt->as._return.value);
+			return stmt;
+
+		case STMT_FUN:
+			if (stmt->as.function.body) {
+				optimize_stmts(arena, stmt->as.function.body->as.block.statements);
+			}
+			return stmt;
+
+		case STMT_IF: {
+			expr_t *condition = fold_expr(arena, stmt->as._if.condition);
+			stmt_t *then_branch = optimize_stmt(arena, stmt->as._if.then_branch);
+			stmt_t *else_branch = stmt->as._if.else_branch ?
+				optimize_stmt(arena, stmt->as._if.else_branch) : NULL;
+			value_t *value = constant(condition);
+			if (value) {
+				return is_truthy(*value) ? then_branch : else_branch;
+			}
+			stmt->as._if.condition = condition;
+			stmt->as._if.then_branch = then_branch ? then_branch : empty_block(arena);
+			stmt->as._if.else_branch = else_branch;
+			return stmt;
+		}
+
+		case STMT_WHILE: {
+			expr_t *condition = fold_expr(arena, stmt->as._while.condition);
+			value_t *value = constant(condition);
+			if (value && !is_truthy(*value)) {
+				return NULL;
+			}
+			stmt_t *body = optimize_stmt(arena, stmt->as._while.body);
+			stmt->as._while.condition = condition;
+			stmt->as._while.body = body ? body : empty_block(arena);
+			return stmt;
+		}
+
+		case STMT_FOR: {
+			stmt_t *initializer = stmt->as._for.initializer ?
+				optimize_stmt(arena, stmt->as._for.initializer) : NULL;
+			expr_t *condition = fold_expr(arena, stmt->as._for.condition);
+			value_t *value = constant(condition);
+			if (value && !is_truthy(*value)) {
+				/* Only the initializer ever runs */
+				return initializer ? block_of(arena, initializer) : NULL;
+			}
+			stmt_t *body = optimize_stmt(arena, stmt->as._for.body);
+			stmt->as._for.initializer = initializer;
+			stmt->as._for.condition = condition;
+			stmt->as._for.increment = fold_expr(arena, stmt->as._for.increment);
+			stmt->as._for.body = body ? body : empty_block(arena);
+			return stmt;
+		}
+
+		case STMT_RANGE: {
+			stmt_t *body = optimize_stmt(arena, stmt->as.range.body);
+			stmt->as.range.start = fold_expr(arena, stmt->as.range.start);
+			stmt->as.range.end = fold_expr(arena, stmt->as.range.end);
+			stmt->as.range.body = body ? body : empty_block(arena);
+			return stmt;
+		}
+
+		default:
+			return stmt;
+	}
+}
+
+/*
+ * Fold constants and prune branches that can never run. Runtime errors
+ * are not folded away, they still happen on the same line.
+ */
+void optimize(arena_t *arena, stmt_array_t *statements)
+{
+	optimize_stmts(arena, statements);
+}
+
+/* Set by --opt-report, optimize_program() prints what it inlined or removed */
+int opt_report = 0;
+
+void report_change(optimizer_t *opt, int line, const char *what, symbol_t *name)
+{
+	if (!opt_report) {
+		return;
+	}
+	if (name) {
+		fprintf(stderr, "%s:%d: %s %.*s\n", opt->filename, line, what, name->length,
+				name->name);
+	} else {
+		fprintf(stderr, "%s:%d: %s\n", opt->filename, line, what);
+	}
+}
+
+void use_stmt(optimizer_t *opt, stmt_t *stmt);
+
+void use_expr(optimizer_t *opt, expr_t *expr)
+{
+	if (!expr) {
+		return;
+	}
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			opt->names[expr->as.assign.name->as.variable.name.symbol->id].assigned++;
+			opt->names[expr->as.assign.name->as.variable.name.symbol->id].assigned_in_function +=
+				opt->functions > 0;
+			use_expr(opt, expr->as.assign.name);
+			use_expr(opt, expr->as.assign.value);
+			break;
+		case EXPR_BINARY:
+			use_expr(opt, expr->as.binary.left);
+			use_expr(opt, expr->as.binary.right);
+			break;
+		case EXPR_CALL:
+			use_expr(opt, expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				use_expr(opt, expr->as.call.args->arguments[i]);
+			}
+			break;
+		case EXPR_GET:
+			use_expr(opt, expr->as.get.object);
+			break;
+		case EXPR_GROUPING:
+			use_expr(opt, expr->as.grouping.expression);
+			break;
+		case EXPR_LOGICAL:
+			use_expr(opt, expr->as.logical.left);
+			use_expr(opt, expr->as.logical.right);
+			break;
+		case EXPR_SET:
+			use_expr(opt, expr->as.set.object);
+			use_expr(opt, expr->as.set.value);
+			break;
+		case EXPR_UNARY:
+			use_expr(opt, expr->as.unary.right);
+			break;
+		case EXPR_VARIABLE:
+			opt->names[expr->as.variable.name.symbol->id].used++;
+			break;
+		default:
+			break;
+	}
+}
+
+void use_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	for (int i = 0; i < array->length; i++) {
+		use_stmt(opt, array->statements[i]);
+	}
+}
+
+/* A function body not parsed yet could use or assign anything */
+void use_function(optimizer_t *opt, stmt_t *stmt)
+{
+	for (int i = 0; i < stmt->as.function.params->length; i++) {
+		opt->names[stmt->as.function.params->tokens[i].symbol->id].declared++;
+	}
+	if (stmt->as.function.body) {
+		opt->functions++;
+		use_stmt(opt, stmt->as.function.body);
+		opt->functions--;
+	} else {
+		opt->unknown = 1;
+	}
+}
+
+void use_stmt(optimizer_t *opt, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			use_stmts(opt, stmt->as.block.statements);
+			break;
+		case STMT_CLASS:
+			/* Not parsed yet, nothing is known of what a class uses */
+			opt->unknown = 1;
+			break;
+		case STMT_EXPR:
+			use_expr(opt, stmt->as.expr.expression);
+			break;
+		case STMT_FUN:
+			opt->names[stmt->as.function.name.symbol->id].declared++;
+			use_function(opt, stmt);
+			break;
+		case STMT_IF:
+			use_expr(opt, stmt->as._if.condition);
+			use_stmt(opt, stmt->as._if.then_branch);
+			use_stmt(opt, stmt->as._if.else_branch);
+			break;
+		case STMT_PRINT:
+			use_expr(opt, stmt->as.print.expression);
+			break;
+		case STMT_VAR:
+			opt->names[stmt->as.variable.name.symbol->id].declared++;
+			use_expr(opt, stmt->as.variable.initializer);
+			break;
+		case STMT_WHILE:
+			use_expr(opt, stmt->as._while.condition);
+			use_stmt(opt, stmt->as._while.body);
+			break;
+		case STMT_RETURN:
+			use_expr(opt, stmt->as._return.value);
+			break;
+		case STMT_FOR:
+			use_stmt(opt, stmt->as._for.initializer);
+			use_expr(opt, stmt->as._for.condition);
+			use_expr(opt, stmt->as._for.increment);
+			use_stmt(opt, stmt->as._for.body);
+			break;
+		case STMT_RANGE:
+			opt->names[stmt->as.range.name.symbol->id].declared++;
+			use_expr(opt, stmt->as.range.start);
+			use_expr(opt, stmt->as.range.end);
+			use_stmt(opt, stmt->as.range.body);
+			break;
+	}
+}
+
+/* Count again what the statements declare, use and assign, by symbol id */
+void use_program(optimizer_t *opt, stmt_array_t *statements)
+{
+	memset(opt->names, 0, opt->names_length * sizeof(name_use_t));
+	use_stmts(opt, statements);
+}
+
+void prune_stmt(optimizer_t *opt, stmt_t *stmt);
+
+/* Nothing after a return in the same block can run */
+void prune_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	for (int i = 0; i < array->length; i++) {
+		stmt_t *stmt = array->statements[i];
+		prune_stmt(opt, stmt);
+		if (stmt->type == STMT_RETURN && i + 1 < array->length) {
+			report_change(opt, stmt->as._return.keyword.line, "removed unreachable code after return",
+					NULL);
+			array->length = i + 1;
+		}
+	}
+}
+
+void prune_stmt(optimizer_t *opt, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			prune_stmts(opt, stmt->as.block.statements);
+			break;
+		case STMT_FUN:
+			prune_stmt(opt, stmt->as.function.body);
+			break;
+		case STMT_IF:
+			prune_stmt(opt, stmt->as._if.then_branch);
+			prune_stmt(opt, stmt->as._if.else_branch);
+			break;
+		case STMT_WHILE:
+			prune_stmt(opt, stmt->as._while.body);
+			break;
+		case STMT_FOR:
+			prune_stmt(opt, stmt->as._for.body);
+			break;
+		case STMT_RANGE:
+			prune_stmt(opt, stmt->as.range.body);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Index of the parameter of fn named symbol, -1 if there is none */
+int param_of(stmt_t *fn, symbol_t *symbol)
+{
+	for (int i = 0; i < fn->as.function.params->length; i++) {
+		if (fn->as.function.params->tokens[i].symbol == symbol) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Nodes in expr when it only reads parameters of fn and has no calls or
+ * assignments, -1 otherwise
+ */
+int inline_size(stmt_t *fn, expr_t *expr)
+{
+	int left, right;
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			return 1;
+		case EXPR_VARIABLE:
+			return param_of(fn, expr->as.variable.name.symbol) < 0 ? -1 : 1;
+		case EXPR_GROUPING:
+			left = inline_size(fn, expr->as.grouping.expression);
+			return left < 0 ? -1 : left + 1;
+		case EXPR_UNARY:
+			left = inline_size(fn, expr->as.unary.right);
+			return left < 0 ? -1 : left + 1;
+		case EXPR_BINARY:
+			left = inline_size(fn, expr->as.binary.left);
+			right = inline_size(fn, expr->as.binary.right);
+			return left < 0 || right < 0 ? -1 : left + right + 1;
+		case EXPR_LOGICAL:
+			left = inline_size(fn, expr->as.logical.left);
+			right = inline_size(fn, expr->as.logical.right);
+			return left < 0 || right < 0 ? -1 : left + right + 1;
+		default:
+			return -1;
+	}
+}
+
+/*
+ * A function declared once, never assigned, with distinct parameters and
+ * a body of return with a small expression of them. It cannot call
+ * anything, itself included.
+ */
+int is_inlinable(optimizer_t *opt, stmt_t *fn)
+{
+	name_use_t *name = &opt->names[fn->as.function.name.symbol->id];
+	stmt_t *body = fn->as.function.body;
+	if (name->declared != 1 || name->assigned || body->as.block.statements->length != 1) {
+		return 0;
+	}
+	stmt_t *stmt = body->as.block.statements->statements[0];
+	if (stmt->type != STMT_RETURN || !stmt->as._return.value) {
+		return 0;
+	}
+	array_t *params = fn->as.function.params;
+	for (int i = 0; i < params->length; i++) {
+		if (param_of(fn, params->tokens[i].symbol) != i) {
+			return 0;
+		}
+	}
+	int size = inline_size(fn, stmt->as._return.value);
+	return size > 0 && size <= INLINE_NODES;
+}
+
+void mark_defined(optimizer_t *opt, symbol_t *symbol)
+{
+	if (opt->defined_length == opt->defined_capacity) {
+		opt->defined_capacity = opt->defined_capacity ? opt->defined_capacity * 2 :
+			DEFAULT_NODES_SIZE;
+		opt->defined = realloc(opt->defined, opt->defined_capacity * sizeof(symbol_t *));
+	}
+	opt->defined[opt->defined_length++] = symbol;
+}
+
+int is_defined(optimizer_t *opt, symbol_t *symbol)
+{
+	for (int i = opt->defined_length - 1; i >= 0; i--) {
+		if (opt->defined[i] == symbol) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Where a check of the order of an inlined body has got to */
+typedef struct {
+	arg_array_t *args;
+	/* Arguments read so far */
+	char *read;
+	/* Arguments that do the same wherever and however often they are read */
+	char *free;
+	/* Past an operation that can raise a runtime error */
+	int raised;
+	/* Inside the right of and or or, which might not run */
+	int conditional;
+	/* Every argument is a literal or a variable, nothing they do can be seen */
+	int pure;
+} inline_order_t;
+
+/*
+ * Whether reading the arguments where the body of fn reads its parameters
+ * gives what evaluating them all before the call would. That is the same
+ * reads, errors and side effects in the same order, so walk the body in
+ * the order the interpreter does: the right of a binary before its left.
+ */
+int inline_order(stmt_t *fn, expr_t *expr, inline_order_t *order)
+{
+	switch (expr->type) {
+		case EXPR_VARIABLE: {
+			int i = param_of(fn, expr->as.variable.name.symbol);
+			expr_t *arg = order->args->arguments[i];
+			if (order->free[i]) {
+				return 1;
+			}
+			if (order->read[i]) {
+				/* Reading a variable again gives the same when nothing can assign it */
+				return arg->type == EXPR_VARIABLE && order->pure;
+			}
+			if (order->raised || order->conditional) {
+				return 0;
+			}
+			for (int j = 0; j < i; j++) {
+				if (!order->read[j] && !order->free[j]) {
+					return 0;
+				}
+			}
+			order->read[i] = 1;
+			return 1;
+		}
+		case EXPR_GROUPING:
+			return inline_order(fn, expr->as.grouping.expression, order);
+		case EXPR_UNARY:
+			if (!inline_order(fn, expr->as.unary.right, order)) {
+				return 0;
+			}
+			order->raised |= expr->as.unary.operator.type == TOKEN_MINUS;
+			return 1;
+		case EXPR_BINARY: {
+			if (!inline_order(fn, expr->as.binary.right, order) ||
+					!inline_order(fn, expr->as.binary.left, order)) {
+				return 0;
+			}
+			token_type_t op = expr->as.binary.operator.type;
+			order->raised |= op != TOKEN_EQUAL_EQUAL && op != TOKEN_BANG_EQUAL;
+			return 1;
+		}
+		case EXPR_LOGICAL: {
+			if (!inline_order(fn, expr->as.logical.left, order)) {
+				return 0;
+			}
+			order->conditional++;
+			int ok = inline_order(fn, expr->as.logical.right, order);
+			order->conditional--;
+			return ok;
+		}
+		default:
+			return 1;
+	}
+}
+
+/* Copy of the body of fn, arguments in place of its parameters */
+expr_t *inline_copy(arena_t *arena, stmt_t *fn, expr_t *expr, arg_array_t *args)
+{
+	if (expr->type == EXPR_VARIABLE) {
+		return args->arguments[param_of(fn, expr->as.variable.name.symbol)];
+	}
+	if (expr->type == EXPR_LITERAL) {
+		return expr;
+	}
+	expr_t *copy = arena_alloc(arena, sizeof(expr_t));
+	*copy = *expr;
+	switch (expr->type) {
+		case EXPR_GROUPING:
+			copy->as.grouping.expression = inline_copy(arena, fn,
+					expr->as.grouping.expression, args);
+			break;
+		case EXPR_UNARY:
+			copy->as.unary.right = inline_copy(arena, fn, expr->as.unary.right, args);
+			break;
+		case EXPR_BINARY:
+			copy->as.binary.left = inline_copy(arena, fn, expr->as.binary.left, args);
+			copy->as.binary.right = inline_copy(arena, fn, expr->as.binary.right, args);
+			break;
+		case EXPR_LOGICAL:
+			copy->as.logical.left = inline_copy(arena, fn, expr->as.logical.left, args);
+			copy->as.logical.right = inline_copy(arena, fn, expr->as.logical.right, args);
+			break;
+		default:
+			break;
+	}
+	return copy;
+}
+
+/*
+ * The body of fn for call when it does what the call would, the copy
+ * keeps the lines of fn so runtime errors in it say the same. NULL when
+ * it cannot be inlined.
+ */
+expr_t *inline_call(optimizer_t *opt, stmt_t *fn, expr_t *call)
+{
+	arg_array_t *args = call->as.call.args;
+	if (args->length != fn->as.function.params->length || args->length > DEFAULT_ARGS_SIZE) {
+		/* Left to raise the error */
+		return NULL;
+	}
+	char read[DEFAULT_ARGS_SIZE] = { 0 }, free[DEFAULT_ARGS_SIZE] = { 0 };
+	inline_order_t order = { args, read, free, 0, 0, 1 };
+	for (int i = 0; i < args->length; i++) {
+		expr_type_t type = args->arguments[i]->type;
+		order.pure &= type == EXPR_LITERAL || type == EXPR_VARIABLE;
+	}
+	/* A declared variable cannot fail to be read, or change when nothing assigns */
+	for (int i = 0; i < args->length; i++) {
+		expr_t *arg = args->arguments[i];
+		free[i] = arg->type == EXPR_LITERAL || (order.pure && arg->type == EXPR_VARIABLE &&
+				is_defined(opt, arg->as.variable.name.symbol));
+	}
+	expr_t *body = fn->as.function.body->as.block.statements->statements[0]->as._return.value;
+	if (!inline_order(fn, body, &order)) {
+		return NULL;
+	}
+	/* Every argument with something to do has to be read */
+	for (int i = 0; i < args->length; i++) {
+		if (!read[i] && !free[i]) {
+			return NULL;
+		}
+	}
+	report_change(opt, call->line, "inlined call to", fn->as.function.name.symbol);
+	return fold_expr(opt->arena, inline_copy(opt->arena, fn, body, args));
+}
+
+void inline_stmt(optimizer_t *opt, stmt_t *stmt);
+
+expr_t *inline_expr(optimizer_t *opt, expr_t *expr)
+{
+	if (!expr) {
+		return NULL;
+	}
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			expr->as.assign.value = inline_expr(opt, expr->as.assign.value);
+			break;
+		case EXPR_BINARY:
+			expr->as.binary.left = inline_expr(opt, expr->as.binary.left);
+			expr->as.binary.right = inline_expr(opt, expr->as.binary.right);
+			break;
+		case EXPR_CALL: {
+			expr_t *callee = expr->as.call.callee = inline_expr(opt, expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				expr->as.call.args->arguments[i] = inline_expr(opt,
+						expr->as.call.args->arguments[i]);
+			}
+			if (callee->type != EXPR_VARIABLE) {
+				break;
+			}
+			/* Names of functions inlined are declared once, so there is no shadowing */
+			for (int i = 0; i < opt->inlinable_length; i++) {
+				stmt_t *fn = opt->inlinable[i];
+				if (fn->as.function.name.symbol == callee->as.variable.name.symbol) {
+					expr_t *inlined = inline_call(opt, fn, expr);
+					return inlined ? inlined : expr;
+				}
+			}
+			break;
+		}
+		case EXPR_GET:
+			expr->as.get.object = inline_expr(opt, expr->as.get.object);
+			break;
+		case EXPR_GROUPING:
+			expr->as.grouping.expression = inline_expr(opt, expr->as.grouping.expression);
+			break;
+		case EXPR_LOGICAL:
+			expr->as.logical.left = inline_expr(opt, expr->as.logical.left);
+			expr->as.logical.right = inline_expr(opt, expr->as.logical.right);
+			break;
+		case EXPR_SET:
+			expr->as.set.object = inline_expr(opt, expr->as.set.object);
+			expr->as.set.value = inline_expr(opt, expr->as.set.value);
+			break;
+		case EXPR_UNARY:
+			expr->as.unary.right = inline_expr(opt, expr->as.unary.right);
+			break;
+		default:
+			break;
+	}
+	return expr;
+}
+
+/*
+ * A function can be inlined into what comes after its declaration in the
+ * block it is in. A call before that, or from outside the block, fails at
+ * runtime and has to keep doing so.
+ */
+void inline_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	int visible = opt->inlinable_length, defined = opt->defined_length;
+	for (int i = 0; i < array->length; i++) {
+		stmt_t *stmt = array->statements[i];
+		inline_stmt(opt, stmt);
+		if (stmt->type == STMT_FUN && is_inlinable(opt, stmt)) {
+			if (opt->inlinable_length == opt->inlinable_capacity) {
+				opt->inlinable_capacity = opt->inlinable_capacity ?
+					opt->inlinable_capacity * 2 : DEFAULT_NODES_SIZE;
+				opt->inlinable = realloc(opt->inlinable,
+						opt->inlinable_capacity * sizeof(stmt_t *));
+			}
+			opt->inlinable[opt->inlinable_length++] = stmt;
+		}
+	}
+	opt->inlinable_length = visible;
+	opt->defined_length = defined;
+}
+
+void inline_stmt(optimizer_t *opt, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			inline_stmts(opt, stmt->as.block.statements);
+			break;
+		case STMT_EXPR:
+			stmt->as.expr.expression = inline_expr(opt, stmt->as.expr.expression);
+			break;
+		case STMT_FUN: {
+			mark_defined(opt, stmt->as.function.name.symbol);
+			int defined = opt->defined_length;
+			for (int i = 0; i < stmt->as.function.params->length; i++) {
+				mark_defined(opt, stmt->as.function.params->tokens[i].symbol);
+			}
+			inline_stmt(opt, stmt->as.function.body);
+			opt->defined_length = defined;
+			break;
+		}
+		case STMT_IF:
+			stmt->as._if.condition = inline_expr(opt, stmt->as._if.condition);
+			inline_stmt(opt, stmt->as._if.then_branch);
+			inline_stmt(opt, stmt->as._if.else_branch);
+			break;
+		case STMT_PRINT:
+			stmt->as.print.expression = inline_expr(opt, stmt->as.print.expression);
+			break;
+		case STMT_VAR:
+			stmt->as.variable.initializer = inline_expr(opt, stmt->as.variable.initializer);
+			mark_defined(opt, stmt->as.variable.name.symbol);
+			break;
+		case STMT_WHILE:
+			stmt->as._while.condition = inline_expr(opt, stmt->as._while.condition);
+			inline_stmt(opt, stmt->as._while.body);
+			break;
+		case STMT_RETURN:
+			stmt->as._return.value = inline_expr(opt, stmt->as._return.value);
+			break;
+		case STMT_FOR: {
+			int defined = opt->defined_length;
+			inline_stmt(opt, stmt->as._for.initializer);
+			stmt->as._for.condition = inline_expr(opt, stmt->as._for.condition);
+			stmt->as._for.increment = inline_expr(opt, stmt->as._for.increment);
+			inline_stmt(opt, stmt->as._for.body);
+			opt->defined_length = defined;
+			break;
+		}
+		case STMT_RANGE: {
+			stmt->as.range.start = inline_expr(opt, stmt->as.range.start);
+			stmt->as.range.end = inline_expr(opt, stmt->as.range.end);
+			int defined = opt->defined_length;
+			mark_defined(opt, stmt->as.range.name.symbol);
+			inline_stmt(opt, stmt->as.range.body);
+			opt->defined_length = defined;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+int drop_stmt(optimizer_t *opt, stmt_t *stmt);
+
+/*
+ * Drop declarations of names declared once and never used. What the
+ * initializer of a variable does still happens, as an expression
+ * statement. How many were dropped.
+ */
+int drop_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	int dropped = 0, length = 0;
+	for (int i = 0; i < array->length; i++) {
+		stmt_t *stmt = array->statements[i];
+		dropped += drop_stmt(opt, stmt);
+		name_use_t *name = NULL;
+		if (stmt->type == STMT_FUN) {
+			name = &opt->names[stmt->as.function.name.symbol->id];
+		} else if (stmt->type == STMT_VAR) {
+			name = &opt->names[stmt->as.variable.name.symbol->id];
+		}
+		if (!name || name->declared != 1 || name->used) {
+			array->statements[length++] = stmt;
+			continue;
+		}
+		dropped++;
+		if (stmt->type == STMT_FUN) {
+			report_change(opt, stmt->as.function.name.line, "removed unused function",
+					stmt->as.function.name.symbol);
+			continue;
+		}
+		report_change(opt, stmt->as.variable.name.line, "removed unused variable",
+				stmt->as.variable.name.symbol);
+		expr_t *initializer = stmt->as.variable.initializer;
+		if (initializer && initializer->type != EXPR_LITERAL) {
+			stmt->type = STMT_EXPR;
+			stmt->as.expr.expression = initializer;
+			array->statements[length++] = stmt;
+		}
+	}
+	array->length = length;
+	return dropped;
+}
+
+int drop_stmt(optimizer_t *opt, stmt_t *stmt)
+{
+	if (!stmt) {
+		return 0;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			return drop_stmts(opt, stmt->as.block.statements);
+		case STMT_FUN:
+			return drop_stmt(opt, stmt->as.function.body);
+		case STMT_IF:
+			return drop_stmt(opt, stmt->as._if.then_branch) +
+				drop_stmt(opt, stmt->as._if.else_branch);
+		case STMT_WHILE:
+			return drop_stmt(opt, stmt->as._while.body);
+		case STMT_FOR:
+			return drop_stmt(opt, stmt->as._for.body);
+		case STMT_RANGE:
+			return drop_stmt(opt, stmt->as.range.body);
+		default:
+			return 0;
+	}
+}
+
+/* Whether expr only reads variables and constants, it can still raise an error */
+int is_pure(expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_LITERAL:
+		case EXPR_VARIABLE:
+			return 1;
+		case EXPR_GROUPING:
+			return is_pure(expr->as.grouping.expression);
+		case EXPR_UNARY:
+			return is_pure(expr->as.unary.right);
+		case EXPR_BINARY:
+			return is_pure(expr->as.binary.left) && is_pure(expr->as.binary.right);
+		case EXPR_LOGICAL:
+			return is_pure(expr->as.logical.left) && is_pure(expr->as.logical.right);
+		default:
+			return 0;
+	}
+}
+
+/* Operators in a pure expr, reads is set when it reads a variable */
+int operators(expr_t *expr, int *reads)
+{
+	switch (expr->type) {
+		case EXPR_VARIABLE:
+			*reads = 1;
+			return 0;
+		case EXPR_GROUPING:
+			return operators(expr->as.grouping.expression, reads);
+		case EXPR_UNARY:
+			return 1 + operators(expr->as.unary.right, reads);
+		case EXPR_BINARY:
+			return 1 + operators(expr->as.binary.left, reads) +
+				operators(expr->as.binary.right, reads);
+		case EXPR_LOGICAL:
+			return 1 + operators(expr->as.logical.left, reads) +
+				operators(expr->as.logical.right, reads);
+		default:
+			return 0;
+	}
+}
+
+/* A pure expression worth keeping the value of, constants are folded already */
+int is_reusable(expr_t *expr)
+{
+	int reads = 0;
+	return is_pure(expr) && operators(expr, &reads) && reads;
+}
+
+int same_constant(value_t *a, value_t *b)
+{
+	if (VALUE_TYPE(*a) != VALUE_TYPE(*b)) {
+		return 0;
+	}
+	switch (VALUE_TYPE(*a)) {
+		case VAL_BOOL:
+			return AS_BOOL(*a) == AS_BOOL(*b);
+		case VAL_NUMBER:
+			return AS_NUMBER(*a) == AS_NUMBER(*b);
+		case VAL_STRING:
+			return string_equal(AS_STRING(*a), AS_STRING(*b));
+		case VAL_NIL:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Whether two pure expressions compute the same thing the same way */
+int same_expr(expr_t *a, expr_t *b)
+{
+	if (a->type != b->type) {
+		return 0;
+	}
+	switch (a->type) {
+		case EXPR_LITERAL:
+			return same_constant(a->as.literal.value, b->as.literal.value);
+		case EXPR_VARIABLE:
+			return a->as.variable.name.symbol == b->as.variable.name.symbol;
+		case EXPR_GROUPING:
+			return same_expr(a->as.grouping.expression, b->as.grouping.expression);
+		case EXPR_UNARY:
+			return a->as.unary.operator.type == b->as.unary.operator.type &&
+				same_expr(a->as.unary.right, b->as.unary.right);
+		case EXPR_BINARY:
+			return a->as.binary.operator.type == b->as.binary.operator.type &&
+				same_expr(a->as.binary.left, b->as.binary.left) &&
+				same_expr(a->as.binary.right, b->as.binary.right);
+		case EXPR_LOGICAL:
+			return a->as.logical.operator.type == b->as.logical.operator.type &&
+				same_expr(a->as.logical.left, b->as.logical.left) &&
+				same_expr(a->as.logical.right, b->as.logical.right);
+		default:
+			return 0;
+	}
+}
+
+expr_t *copy_pure(arena_t *arena, expr_t *expr)
+{
+	expr_t *copy = arena_alloc(arena, sizeof(expr_t));
+	*copy = *expr;
+	switch (expr->type) {
+		case EXPR_GROUPING:
+			copy->as.grouping.expression = copy_pure(arena, expr->as.grouping.expression);
+			break;
+		case EXPR_UNARY:
+			copy->as.unary.right = copy_pure(arena, expr->as.unary.right);
+			break;
+		case EXPR_BINARY:
+			copy->as.binary.left = copy_pure(arena, expr->as.binary.left);
+			copy->as.binary.right = copy_pure(arena, expr->as.binary.right);
+			break;
+		case EXPR_LOGICAL:
+			copy->as.logical.left = copy_pure(arena, expr->as.logical.left);
+			copy->as.logical.right = copy_pure(arena, expr->as.logical.right);
+			break;
+		default:
+			break;
+	}
+	return copy;
+}
+
+/* Whether a pure expr reads symbol */
+int mentions(expr_t *expr, symbol_t *symbol)
+{
+	switch (expr->type) {
+		case EXPR_VARIABLE:
+			return expr->as.variable.name.symbol == symbol;
+		case EXPR_GROUPING:
+			return mentions(expr->as.grouping.expression, symbol);
+		case EXPR_UNARY:
+			return mentions(expr->as.unary.right, symbol);
+		case EXPR_BINARY:
+			return mentions(expr->as.binary.left, symbol) ||
+				mentions(expr->as.binary.right, symbol);
+		case EXPR_LOGICAL:
+			return mentions(expr->as.logical.left, symbol) ||
+				mentions(expr->as.logical.right, symbol);
+		default:
+			return 0;
+	}
+}
+
+/* A new variable for a value to be kept in, a script has no way to name it */
+symbol_t *temporary(optimizer_t *opt)
+{
+	char name[32];
+	int length = snprintf(name, sizeof(name), ".%d", ++opt->temporaries);
+	return intern(name, length);
+}
+
+expr_t *temporary_read(arena_t *arena, symbol_t *symbol, int line)
+{
+	token_t name = { TOKEN_IDENTIFIER, symbol->name, symbol->length, line, symbol, { 0 } };
+	return create_variable_expr(arena, &name);
+}
+
+/* var symbol; */
+stmt_t *temporary_decl(arena_t *arena, symbol_t *symbol, int line)
+{
+	stmt_t *stmt = arena_alloc(arena, sizeof(stmt_t));
+	stmt->type = STMT_VAR;
+	stmt->as.variable.name = (token_t) { TOKEN_IDENTIFIER, symbol->name, symbol->length, line,
+		symbol, { 0 } };
+	stmt->as.variable.initializer = NULL;
+	return stmt;
+}
+
+void loop_write(loop_info_t *loop, symbol_t *symbol)
+{
+	if (loop->written_length == loop->written_capacity) {
+		loop->written_capacity = loop->written_capacity ? loop->written_capacity * 2 :
+			DEFAULT_NODES_SIZE;
+		loop->written = realloc(loop->written, loop->written_capacity * sizeof(symbol_t *));
+	}
+	loop->written[loop->written_length++] = symbol;
+}
+
+int loop_writes(loop_info_t *loop, symbol_t *symbol)
+{
+	for (int i = 0; i < loop->written_length; i++) {
+		if (loop->written[i] == symbol) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void scan_stmt(loop_info_t *loop, stmt_t *stmt);
+
+/* Note what expr assigns and whether it calls anything */
+void scan_expr(loop_info_t *loop, expr_t *expr)
+{
+	if (!expr) {
+		return;
+	}
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			loop_write(loop, expr->as.assign.name->as.variable.name.symbol);
+			scan_expr(loop, expr->as.assign.value);
+			break;
+		case EXPR_BINARY:
+			scan_expr(loop, expr->as.binary.left);
+			scan_expr(loop, expr->as.binary.right);
+			break;
+		case EXPR_CALL:
+			loop->calls = 1;
+			scan_expr(loop, expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				scan_expr(loop, expr->as.call.args->arguments[i]);
+			}
+			break;
+		case EXPR_GROUPING:
+			scan_expr(loop, expr->as.grouping.expression);
+			break;
+		case EXPR_LOGICAL:
+			scan_expr(loop, expr->as.logical.left);
+			scan_expr(loop, expr->as.logical.right);
+			break;
+		case EXPR_UNARY:
+			scan_expr(loop, expr->as.unary.right);
+			break;
+		case EXPR_LITERAL:
+		case EXPR_VARIABLE:
+			break;
+		default:
+			/* Properties run code nothing here follows */
+			loop->calls = 1;
+			break;
+	}
+}
+
+/*
+ * Everything a loop declares counts as written too, a name declared in
+ * its body is a new variable every time round. So do the bodies of
+ * functions declared in it, they could be called from it.
+ */
+void scan_stmt(loop_info_t *loop, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			for (int i = 0; i < stmt->as.block.statements->length; i++) {
+				scan_stmt(loop, stmt->as.block.statements->statements[i]);
+			}
+			break;
+		case STMT_CLASS:
+			loop->calls = 1;
+			loop_write(loop, stmt->as.class.name.symbol);
+			break;
+		case STMT_EXPR:
+			scan_expr(loop, stmt->as.expr.expression);
+			break;
+		case STMT_FUN:
+			loop_write(loop, stmt->as.function.name.symbol);
+			for (int i = 0; i < stmt->as.function.params->length; i++) {
+				loop_write(loop, stmt->as.function.params->tokens[i].symbol);
+			}
+			scan_stmt(loop, stmt->as.function.body);
+			break;
+		case STMT_IF:
+			scan_expr(loop, stmt->as._if.condition);
+			scan_stmt(loop, stmt->as._if.then_branch);
+			scan_stmt(loop, stmt->as._if.else_branch);
+			break;
+		case STMT_PRINT:
+			scan_expr(loop, stmt->as.print.expression);
+			break;
+		case STMT_VAR:
+			loop_write(loop, stmt->as.variable.name.symbol);
+			scan_expr(loop, stmt->as.variable.initializer);
+			break;
+		case STMT_WHILE:
+			scan_expr(loop, stmt->as._while.condition);
+			scan_stmt(loop, stmt->as._while.body);
+			break;
+		case STMT_RETURN:
+			scan_expr(loop, stmt->as._return.value);
+			break;
+		case STMT_FOR:
+			scan_stmt(loop, stmt->as._for.initializer);
+			scan_expr(loop, stmt->as._for.condition);
+			scan_expr(loop, stmt->as._for.increment);
+			scan_stmt(loop, stmt->as._for.body);
+			break;
+		case STMT_RANGE:
+			loop_write(loop, stmt->as.range.name.symbol);
+			scan_expr(loop, stmt->as.range.start);
+			scan_expr(loop, stmt->as.range.end);
+			scan_stmt(loop, stmt->as.range.body);
+			break;
+	}
+}
+
+/*
+ * Whether a pure expr has the same value every time round the loop. With
+ * a call in the loop a variable also must not be assigned by any function,
+ * a closure could be what is called.
+ */
+int is_invariant(optimizer_t *opt, loop_info_t *loop, expr_t *expr)
+{
+	switch (expr->type) {
+		case EXPR_LITERAL:
+			return 1;
+		case EXPR_VARIABLE: {
+			symbol_t *symbol = expr->as.variable.name.symbol;
+			if (loop_writes(loop, symbol)) {
+				return 0;
+			}
+			return !loop->calls || (symbol->id < opt->names_length &&
+					!opt->names[symbol->id].assigned_in_function);
+		}
+		case EXPR_GROUPING:
+			return is_invariant(opt, loop, expr->as.grouping.expression);
+		case EXPR_UNARY:
+			return is_invariant(opt, loop, expr->as.unary.right);
+		case EXPR_BINARY:
+			return is_invariant(opt, loop, expr->as.binary.left) &&
+				is_invariant(opt, loop, expr->as.binary.right);
+		case EXPR_LOGICAL:
+			return is_invariant(opt, loop, expr->as.logical.left) &&
+				is_invariant(opt, loop, expr->as.logical.right);
+		default:
+			return 0;
+	}
+}
+
+/*
+ * An invariant expression becomes `t or (t = expr)` with t declared just
+ * before the loop. It is still evaluated where it was the first time, so
+ * an error it raises comes at the same point, and is only evaluated again
+ * when its value is false or nil.
+ */
+expr_t *hoist_expr(optimizer_t *opt, loop_info_t *loop, expr_t *expr)
+{
+	if (!expr) {
+		return NULL;
+	}
+	if (is_reusable(expr) && is_invariant(opt, loop, expr)) {
+		symbol_t *symbol = NULL;
+		for (int i = 0; i < loop->hoisted_length && !symbol; i++) {
+			if (same_expr(loop->hoisted[i].expr, expr)) {
+				symbol = loop->hoisted[i].temporary;
+			}
+		}
+		if (!symbol) {
+			if (loop->hoisted_length == loop->hoisted_capacity) {
+				loop->hoisted_capacity = loop->hoisted_capacity ?
+					loop->hoisted_capacity * 2 : DEFAULT_NODES_SIZE;
+				loop->hoisted = realloc(loop->hoisted,
+						loop->hoisted_capacity * sizeof(hoisted_t));
+			}
+			symbol = temporary(opt);
+			loop->hoisted[loop->hoisted_length++] = (hoisted_t) { expr, symbol };
+		}
+		report_change(opt, expr->line, "hoisted loop invariant expression", NULL);
+		token_t or = { TOKEN_OR, "or", 2, expr->line, NULL, { 0 } };
+		return create_logical_expr(opt->arena, &or,
+				temporary_read(opt->arena, symbol, expr->line),
+				create_assign_expr(opt->arena, temporary_read(opt->arena, symbol, expr->line),
+					expr));
+	}
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			expr->as.assign.value = hoist_expr(opt, loop, expr->as.assign.value);
+			break;
+		case EXPR_BINARY:
+			expr->as.binary.left = hoist_expr(opt, loop, expr->as.binary.left);
+			expr->as.binary.right = hoist_expr(opt, loop, expr->as.binary.right);
+			break;
+		case EXPR_CALL:
+			expr->as.call.callee = hoist_expr(opt, loop, expr->as.call.callee);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				expr->as.call.args->arguments[i] = hoist_expr(opt, loop,
+						expr->as.call.args->arguments[i]);
+			}
+			break;
+		case EXPR_GROUPING:
+			expr->as.grouping.expression = hoist_expr(opt, loop, expr->as.grouping.expression);
+			break;
+		case EXPR_LOGICAL:
+			expr->as.logical.left = hoist_expr(opt, loop, expr->as.logical.left);
+			expr->as.logical.right = hoist_expr(opt, loop, expr->as.logical.right);
+			break;
+		case EXPR_UNARY:
+			expr->as.unary.right = hoist_expr(opt, loop, expr->as.unary.right);
+			break;
+		default:
+			break;
+	}
+	return expr;
+}
+
+/* Hoist from what runs each time round, functions declared in it run later */
+void hoist_body(optimizer_t *opt, loop_info_t *loop, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			for (int i = 0; i < stmt->as.block.statements->length; i++) {
+				hoist_body(opt, loop, stmt->as.block.statements->statements[i]);
+			}
+			break;
+		case STMT_EXPR:
+			stmt->as.expr.expression = hoist_expr(opt, loop, stmt->as.expr.expression);
+			break;
+		case STMT_IF:
+			stmt->as._if.condition = hoist_expr(opt, loop, stmt->as._if.condition);
+			hoist_body(opt, loop, stmt->as._if.then_branch);
+			hoist_body(opt, loop, stmt->as._if.else_branch);
+			break;
+		case STMT_PRINT:
+			stmt->as.print.expression = hoist_expr(opt, loop, stmt->as.print.expression);
+			break;
+		case STMT_VAR:
+			stmt->as.variable.initializer = hoist_expr(opt, loop,
+					stmt->as.variable.initializer);
+			break;
+		case STMT_WHILE:
+			stmt->as._while.condition = hoist_expr(opt, loop, stmt->as._while.condition);
+			hoist_body(opt, loop, stmt->as._while.body);
+			break;
+		case STMT_RETURN:
+			stmt->as._return.value = hoist_expr(opt, loop, stmt->as._return.value);
+			break;
+		case STMT_FOR:
+			hoist_body(opt, loop, stmt->as._for.initializer);
+			stmt->as._for.condition = hoist_expr(opt, loop, stmt->as._for.condition);
+			stmt->as._for.increment = hoist_expr(opt, loop, stmt->as._for.increment);
+			hoist_body(opt, loop, stmt->as._for.body);
+			break;
+		case STMT_RANGE:
+			stmt->as.range.start = hoist_expr(opt, loop, stmt->as.range.start);
+			stmt->as.range.end = hoist_expr(opt, loop, stmt->as.range.end);
+			hoist_body(opt, loop, stmt->as.range.body);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Hoist what is invariant out of the loop at slot, which becomes a block
+ * declaring the variables the values are kept in and then the loop. They
+ * start out nil each time the loop is reached.
+ */
+void hoist_loop(optimizer_t *opt, stmt_t **slot)
+{
+	stmt_t *stmt = *slot;
+	loop_info_t loop = { NULL, 0, 0, 0, NULL, 0, 0 };
+	scan_stmt(&loop, stmt);
+	switch (stmt->type) {
+		case STMT_WHILE:
+			stmt->as._while.condition = hoist_expr(opt, &loop, stmt->as._while.condition);
+			hoist_body(opt, &loop, stmt->as._while.body);
+			break;
+		case STMT_FOR:
+			/* The initializer runs once, before the loop */
+			stmt->as._for.condition = hoist_expr(opt, &loop, stmt->as._for.condition);
+			stmt->as._for.increment = hoist_expr(opt, &loop, stmt->as._for.increment);
+			hoist_body(opt, &loop, stmt->as._for.body);
+			break;
+		default:
+			/* The bounds of a range are evaluated once */
+			hoist_body(opt, &loop, stmt->as.range.body);
+			break;
+	}
+	if (loop.hoisted_length) {
+		stmt_t *block = empty_block(opt->arena);
+		stmt_array_t *statements = block->as.block.statements;
+		statements->capacity = loop.hoisted_length + 1;
+		statements->statements = arena_alloc(opt->arena,
+				statements->capacity * sizeof(stmt_t *));
+		for (int i = 0; i < loop.hoisted_length; i++) {
+			statements->statements[statements->length++] = temporary_decl(opt->arena,
+					loop.hoisted[i].temporary, loop.hoisted[i].expr->line);
+		}
+		statements->statements[statements->length++] = stmt;
+		*slot = block;
+	}
+	free(loop.written);
+	free(loop.hoisted);
+}
+
+void hoist_stmt(optimizer_t *opt, stmt_t **slot);
+
+void hoist_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	for (int i = 0; i < array->length; i++) {
+		hoist_stmt(opt, &array->statements[i]);
+	}
+}
+
+/* Loops inside are done first, what they keep is then kept by the outer one */
+void hoist_stmt(optimizer_t *opt, stmt_t **slot)
+{
+	stmt_t *stmt = *slot;
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			hoist_stmts(opt, stmt->as.block.statements);
+			break;
+		case STMT_FUN:
+			hoist_stmt(opt, &stmt->as.function.body);
+			break;
+		case STMT_IF:
+			hoist_stmt(opt, &stmt->as._if.then_branch);
+			hoist_stmt(opt, &stmt->as._if.else_branch);
+			break;
+		case STMT_WHILE:
+			hoist_stmt(opt, &stmt->as._while.body);
+			hoist_loop(opt, slot);
+			break;
+		case STMT_FOR:
+			hoist_stmt(opt, &stmt->as._for.body);
+			hoist_loop(opt, slot);
+			break;
+		case STMT_RANGE:
+			hoist_stmt(opt, &stmt->as.range.body);
+			hoist_loop(opt, slot);
+			break;
+		default:
+			break;
+	}
+}
+
+void available_add(block_info_t *block, expr_t *expr, expr_t **slot)
+{
+	if (block->length == block->capacity) {
+		block->capacity = block->capacity ? block->capacity * 2 : DEFAULT_NODES_SIZE;
+		block->items = realloc(block->items, block->capacity * sizeof(available_t));
+	}
+	block->items[block->length++] = (available_t) { expr, slot, block->index, NULL, 1 };
+}
+
+/* Forget what reads symbol, or everything when symbol is NULL */
+void available_kill(block_info_t *block, symbol_t *symbol)
+{
+	for (int i = 0; i < block->length; i++) {
+		if (!symbol || mentions(block->items[i].expr, symbol)) {
+			block->items[i].live = 0;
+		}
+	}
+}
+
+/*
+ * Walk expr in the order the interpreter evaluates it. The first time a
+ * pure expression comes again it is made to store its value the first
+ * time, and read from there after. Only what is surely evaluated counts,
+ * not the right of and or or, and a call could assign anything.
+ */
+void cse_expr(optimizer_t *opt, block_info_t *block, expr_t **slot, int conditional)
+{
+	expr_t *expr = *slot, *pristine = NULL;
+	if (!expr) {
+		return;
+	}
+	if (is_pure(expr)) {
+		if (conditional || !is_reusable(expr)) {
+			return;
+		}
+		for (int i = block->length - 1; i >= 0; i--) {
+			available_t *available = &block->items[i];
+			if (!available->live || !same_expr(available->expr, expr)) {
+				continue;
+			}
+			if (!available->temporary) {
+				available->temporary = temporary(opt);
+				*available->slot = create_assign_expr(opt->arena, temporary_read(opt->arena,
+							available->temporary, available->expr->line), *available->slot);
+			}
+			report_change(opt, expr->line, "reused common subexpression", NULL);
+			*slot = temporary_read(opt->arena, available->temporary, expr->line);
+			return;
+		}
+		/* What is inside can be reused too, which changes it, keep it as it was */
+		pristine = copy_pure(opt->arena, expr);
+	}
+	switch (expr->type) {
+		case EXPR_ASSIGN:
+			cse_expr(opt, block, &expr->as.assign.value, conditional);
+			available_kill(block, expr->as.assign.name->as.variable.name.symbol);
+			break;
+		case EXPR_BINARY:
+			cse_expr(opt, block, &expr->as.binary.right, conditional);
+			cse_expr(opt, block, &expr->as.binary.left, conditional);
+			break;
+		case EXPR_CALL:
+			cse_expr(opt, block, &expr->as.call.callee, conditional);
+			for (int i = 0; i < expr->as.call.args->length; i++) {
+				cse_expr(opt, block, &expr->as.call.args->arguments[i], conditional);
+			}
+			available_kill(block, NULL);
+			break;
+		case EXPR_GROUPING:
+			cse_expr(opt, block, &expr->as.grouping.expression, conditional);
+			break;
+		case EXPR_LOGICAL:
+			cse_expr(opt, block, &expr->as.logical.left, conditional);
+			cse_expr(opt, block, &expr->as.logical.right, 1);
+			break;
+		case EXPR_UNARY:
+			cse_expr(opt, block, &expr->as.unary.right, conditional);
+			break;
+		default:
+			available_kill(block, NULL);
+			break;
+	}
+	if (pristine) {
+		available_add(block, pristine, slot);
+	}
+}
+
+void cse_stmt(optimizer_t *opt, stmt_t *stmt);
+
+/*
+ * A basic block is a run of expression, print and var statements. The
+ * variables values are kept in are declared just before the statement
+ * that first stores one.
+ */
+void cse_stmts(optimizer_t *opt, stmt_array_t *array)
+{
+	block_info_t block = { NULL, 0, 0, 0 };
+	int temporaries = 0;
+	for (int i = 0; i < array->length; i++) {
+		stmt_t *stmt = array->statements[i];
+		block.index = i;
+		switch (stmt->type) {
+			case STMT_EXPR:
+				cse_expr(opt, &block, &stmt->as.expr.expression, 0);
+				break;
+			case STMT_PRINT:
+				cse_expr(opt, &block, &stmt->as.print.expression, 0);
+				break;
+			case STMT_VAR:
+				cse_expr(opt, &block, &stmt->as.variable.initializer, 0);
+				available_kill(&block, stmt->as.variable.name.symbol);
+				break;
+			default:
+				available_kill(&block, NULL);
+				cse_stmt(opt, stmt);
+				break;
+		}
+	}
+	for (int i = 0; i < block.length; i++) {
+		temporaries += block.items[i].temporary != NULL;
+	}
+	if (temporaries) {
+		stmt_t **statements = arena_alloc(opt->arena,
+				(array->length + temporaries) * sizeof(stmt_t *));
+		int length = 0;
+		for (int i = 0, j = 0; i < array->length; i++) {
+			for (; j < block.length && block.items[j].index == i; j++) {
+				if (block.items[j].temporary) {
+					statements[length++] = temporary_decl(opt->arena,
+							block.items[j].temporary, block.items[j].expr->line);
+				}
+			}
+			statements[length++] = array->statements[i];
+		}
+		array->statements = statements;
+		array->length = length;
+		array->capacity = length;
+	}
+	free(block.items);
+}
+
+void cse_stmt(optimizer_t *opt, stmt_t *stmt)
+{
+	if (!stmt) {
+		return;
+	}
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			cse_stmts(opt, stmt->as.block.statements);
+			break;
+		case STMT_FUN:
+			cse_stmt(opt, stmt->as.function.body);
+			break;
+		case STMT_IF:
+			cse_stmt(opt, stmt->as._if.then_branch);
+			cse_stmt(opt, stmt->as._if.else_branch);
+			break;
+		case STMT_WHILE:
+			cse_stmt(opt, stmt->as._while.body);
+			break;
+		case STMT_FOR:
+			cse_stmt(opt, stmt->as._for.body);
+			break;
+		case STMT_RANGE:
+			cse_stmt(opt, stmt->as.range.body);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * optimize() and then what needs the whole program in sight: inline
+ * small functions, drop code after a return and declarations left unused,
+ * keep loop invariant and repeated expressions instead of evaluating them
+ * again.
+ * Nothing is inlined or dropped when a body has not been parsed, --lazy,
+ * as it could use any name. filename is what --opt-report says it is.
+ */
+void optimize_program(arena_t *arena, stmt_array_t *statements, const char *filename)
+{
+	optimize(arena, statements);
+	optimizer_t opt = { arena, filename ? filename : "-", NULL, symbol_count(), 0, 0, NULL, 0, 0,
+		NULL, 0, 0, 0 };
+	opt.names = malloc(opt.names_length * sizeof(name_use_t));
+	prune_stmts(&opt, statements);
+	use_program(&opt, statements);
+	if (!opt.unknown) {
+		inline_stmts(&opt, statements);
+		do {
+			use_program(&opt, statements);
+		} while (drop_stmts(&opt, statements));
+		hoist_stmts(&opt, statements);
+		cse_stmts(&opt, statements);
+	}
+	free(opt.inlinable);
+	free(opt.defined);
+	free(opt.names);
+}
@@ -2,206 +2,161 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <setjmp.h>
 
 #include "ast.h"
+#include "cache.h"
+#include "flat.h"
 #include "interpreter.h"
 #include "lexer.h"
+#include "optimize.h"
 #include "parser.h"
-
-int current = 0;
-token_t *tokens;
-void free_args(arg_array_t *array);
-expr_t *expression(void);
-stmt_t *expression_stmt(void);
-stmt_t *statement(void);
-stmt_t *var_declaration(void);
-stmt_t *declaration(void);
-void synchronize(void);
+#include "pool.h"
+#include "resolve.h"
+#include "scan.h"
+
+/* Default for parser_t.lazy, --lazy */
+int lazy_bodies = 0;
+expr_t *expression(parser_t *parser);
+stmt_t *expression_stmt(parser_t *parser);
+stmt_t *statement(parser_t *parser);
+stmt_t *var_declaration(parser_t *parser);
+stmt_t *declaration(parser_t *parser);
+void skip_body(parser_t *parser, stmt_t *stmt, token_t *brace);
+void parser_init(parser_t *parser, lexer_t *lexer, arena_t *arena);
+int at_statement(parser_t *parser);
+void synchronize(parser_t *parser);
 
 /*
  * Syntax error
  */
-void error(token_t *token, char *message)
-{
-	if (token->type == TOKEN_EOF) {
-		fprintf(stderr, "[line %d] at end: %s\n", token->line, message);
-	} else {
-		fprintf(stderr, "[line %d] at '%s': %s\n", token->line, token->value, message);
-	}
-	errno = 65;
-	exit(65);
-	synchronize();
-}
-
-void free_expr(expr_t *expr)
-{
-	if (!expr)
-		return;
-	switch (expr->type) {
-		case EXPR_BINARY:
-			free(expr->as.binary.operator.value);
-			free_expr(expr->as.binary.left);
-			free_expr(expr->as.binary.right);
-			free(expr);
-			break;
-
-		case EXPR_GROUPING:
-			free_expr(expr->as.grouping.expression);
-			free(expr);
-			break;
-
-		case EXPR_UNARY:
-			free(expr->as.unary.operator.value);
-			free_expr(expr->as.unary.right);
-			free(expr);
-			break;
-
-		case EXPR_LITERAL:
-			if (expr->as.literal.value->type == VAL_STRING) {
-				if (expr->as.literal.value->as.string)
-					free(expr->as.literal.value->as.string);
-			}
-			free(expr->as.literal.value);
-			free(expr);
-			break;
-	
-		case EXPR_VARIABLE:
-			free(expr->as.variable.name.value);
-			free(expr);
-			break;
-
-		case EXPR_ASSIGN:
-			free_expr(expr->as.assign.name);
-			free_expr(expr->as.assign.value);
-			free(expr);
-			break;
-
-		case EXPR_LOGICAL:
-			free(expr->as.logical.operator.value);
-			free_expr(expr->as.logical.left);
-			free_expr(expr->as.logical.right);
-			free(expr);
-			break;
-
-		case EXPR_CALL:
-			free_args(expr->as.call.args);
-			free_expr(expr->as.call.callee);
-			free(expr->as.call.paren.value);
-			free(expr);
-			break;
-
-		default:
-			break;
+void error(parser_t *parser, token_t *token, char *message)
+{
+	/* Parsing on after a lexical error only finds errors caused by it */
+	if (errno != 65) {
+		lexer_t *lexer = parser->lexer;
+		if (lexer->diagnostics) {
+			/* The end of file token is not in the source, it is at the end */
+			const char *start = token->type == TOKEN_EOF ? lexer->buf + lexer->len :
+				token->start;
+			diagnostic_add(lexer->diagnostics, token->line, start - lexer->source->data,
+					token->length, message);
+		} else if (token->type == TOKEN_EOF) {
+			fprintf(stderr, "[line %d] at end: %s\n", token->line, message);
+		} else {
+			fprintf(stderr, "[line %d] at '%.*s': %s\n", token->line, token->length,
+					token->start, message);
+		}
+		errno = 65;
 	}
+	longjmp(parser->error, 1);
 }
 
-token_t *peek(void)
+token_t *peek(parser_t *parser)
 {
-	return &tokens[current];
+	return &parser->ring[parser->current & (TOKEN_RING_SIZE - 1)];
 }
 
-int end(void)
+int end(parser_t *parser)
 {
-	return tokens[current].type == TOKEN_EOF;
+	return peek(parser)->type == TOKEN_EOF;
 }
 
-token_t *previous(void)
+/*
+ * Only valid until the next advance(), copy tokens that are needed after
+ * parsing further
+ */
+token_t *previous(parser_t *parser)
 {
-	return &tokens[current - 1];
+	return &parser->ring[(parser->current - 1) & (TOKEN_RING_SIZE - 1)];
 }
 
-void advance(void)
+void advance(parser_t *parser)
 {
-	if (!end())
-		current++;
+	if (!end(parser)) {
+		parser->current++;
+		parser->ring[parser->current & (TOKEN_RING_SIZE - 1)] = lexer_next(parser->lexer);
+	}
 }
 
-int check(token_type_t type)
+int check(parser_t *parser, token_type_t type)
 {
-	return tokens[current].type == type;
+	return peek(parser)->type == type;
 }
 
-int match(token_type_t type)
+int match(parser_t *parser, token_type_t type)
 {
-	if (check(type)) {
-		advance();
+	if (check(parser, type)) {
+		advance(parser);
 		return 1;
 	} else {
 		return 0;
 	}
 }
 
-token_t *consume(token_type_t type, char *message)
+token_t *consume(parser_t *parser, token_type_t type, char *message)
 {
-	if (!check(type)) {
-		error(peek(), message);
+	if (!check(parser, type)) {
+		error(parser, peek(parser), message);
 	} else {
-		token_t *tok = peek();
-		advance();
+		token_t *tok = peek(parser);
+		advance(parser);
 		return tok;
 	}
 	return NULL;
 }
 
-expr_t *primary(void)
+expr_t *primary(parser_t *parser)
 {
-	if (match(TOKEN_FALSE) || match(TOKEN_TRUE) || match(TOKEN_NIL) ||
-			match(TOKEN_NUMBER) || match(TOKEN_STRING)) {
-		token_t *tok = previous();
-		return create_literal_expr(tok);
+	if (match(parser, TOKEN_FALSE) || match(parser, TOKEN_TRUE) || match(parser, TOKEN_NIL) ||
+			match(parser, TOKEN_NUMBER) || match(parser, TOKEN_STRING)) {
+		token_t *tok = previous(parser);
+		return create_literal_expr(parser->arena, tok);
 	}
 
-	if (match(TOKEN_IDENTIFIER)) {
-		token_t *tok = previous();
-		return create_variable_expr(tok);
+	if (match(parser, TOKEN_IDENTIFIER)) {
+		token_t *tok = previous(parser);
+		return create_variable_expr(parser->arena, tok);
 	}
 
-	if (match(TOKEN_LEFT_PAREN)) {
-		expr_t *expr = expression();
-		consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-		return create_grouping_expr(expr);
+	if (match(parser, TOKEN_LEFT_PAREN)) {
+		expr_t *expr = expression(parser);
+		consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+		return create_grouping_expr(parser->arena, expr);
 	}
-	error(peek(), "Expect expression.");
+	error(parser, peek(parser), "Expect expression.");
 	return NULL;
 }
 
-void arg_add(arg_array_t *array, expr_t *expr)
+void arg_add(parser_t *parser, arg_array_t *array, expr_t *expr)
 {
 	if (array->length == array->capacity) {
+		array->arguments = arena_grow(parser->arena, array->arguments,
+				array->capacity * sizeof(expr_t *), array->capacity * 2 * sizeof(expr_t *));
 		array->capacity *= 2;
-		array->arguments = realloc(array->arguments, array->capacity * sizeof(expr_t *));
 	}
 	array->arguments[array->length++] = expr;
 }
 
-void free_args(arg_array_t *array)
-{
-	for (int i = 0; i < array->length; i++) {
-		free_expr(array->arguments[i]);
-	}
-	free(array->arguments);
-	free(array);
-}
-
-expr_t *call(void)
+expr_t *call(parser_t *parser)
 {
-    expr_t *expr = primary();
+    expr_t *expr = primary(parser);
 	while (1) {
-		if (match(TOKEN_LEFT_PAREN)) {
-			arg_array_t *args = malloc(sizeof(arg_array_t));
-			args->arguments = malloc(DEFAULT_ARGS_SIZE * sizeof(expr_t *));
+		if (match(parser, TOKEN_LEFT_PAREN)) {
+			arg_array_t *args = arena_alloc(parser->arena, sizeof(arg_array_t));
+			args->arguments = arena_alloc(parser->arena, DEFAULT_NODES_SIZE * sizeof(expr_t *));
 			args->length = 0;
-			args->capacity = DEFAULT_ARGS_SIZE;
-			if (!check(TOKEN_RIGHT_PAREN)) {
+			args->capacity = DEFAULT_NODES_SIZE;
+			if (!check(parser, TOKEN_RIGHT_PAREN)) {
 				do {
 					if (args->length >= 255) {
-						error(peek(), "Can't have more than 255 arguments.");
+						error(parser, peek(parser), "Can't have more than 255 arguments.");
 					}
-					arg_add(args, expression());
-				} while (match(TOKEN_COMMA));
+					arg_add(parser, args, expression(parser));
+				} while (match(parser, TOKEN_COMMA));
 			}
-			token_t *paren = consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
-			expr = create_call_expr(expr, paren, args);
+			token_t *paren = consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+			expr = create_call_expr(parser->arena, expr, paren, args);
 		} else {
 			break;
 		}
@@ -209,260 +164,211 @@ expr_t *call(void)
 	return expr;
 }
 
-expr_t *unary(void)
+expr_t *unary(parser_t *parser)
 {
-	if (match(TOKEN_BANG) || match(TOKEN_MINUS)) {
-		token_t *operator = previous();
-		expr_t *right = unary();
-		return create_unary_expr(operator, right);
+	if (match(parser, TOKEN_BANG) || match(parser, TOKEN_MINUS)) {
+		token_t operator = *previous(parser);
+		expr_t *right = unary(parser);
+		return create_unary_expr(parser->arena, &operator, right);
 	}
 
-	return call();
+	return call(parser);
 }
 
-expr_t *factor(void)
+expr_t *factor(parser_t *parser)
 {
-	expr_t *expr = unary();
+	expr_t *expr = unary(parser);
 
-	while (match(TOKEN_SLASH) || match(TOKEN_STAR)) {
-		token_t *operator = previous();
-		expr_t *right = unary();
-		expr = create_binary_expr(operator, expr, right);
+	while (match(parser, TOKEN_SLASH) || match(parser, TOKEN_STAR)) {
+		token_t operator = *previous(parser);
+		expr_t *right = unary(parser);
+		expr = create_binary_expr(parser->arena, &operator, expr, right);
 	}
 
 	return expr;
 }
 
-expr_t *term(void)
+expr_t *term(parser_t *parser)
 {
-	expr_t *expr = factor();
+	expr_t *expr = factor(parser);
 
-	while (match(TOKEN_MINUS) || match(TOKEN_PLUS)) {
-		token_t *operator = previous();
-		expr_t *right = factor();
-		expr = create_binary_expr(operator, expr, right);
+	while (match(parser, TOKEN_MINUS) || match(parser, TOKEN_PLUS)) {
+		token_t operator = *previous(parser);
+		expr_t *right = factor(parser);
+		expr = create_binary_expr(parser->arena, &operator, expr, right);
 	}
 
 	return expr;
 }
 
-expr_t *comparison(void)
+expr_t *comparison(parser_t *parser)
 {
-	expr_t *expr = term();
+	expr_t *expr = term(parser);
 
-	while (match(TOKEN_GREATER) || match(TOKEN_GREATER_EQUAL) || match(TOKEN_LESS)
-			|| match(TOKEN_LESS_EQUAL)) {
-		token_t *operator = previous();
-		expr_t *right = term();
-		expr = create_binary_expr(operator, expr, right);
+	while (match(parser, TOKEN_GREATER) || match(parser, TOKEN_GREATER_EQUAL) || match(parser, TOKEN_LESS)
+			|| match(parser, TOKEN_LESS_EQUAL)) {
+		token_t operator = *previous(parser);
+		expr_t *right = term(parser);
+		expr = create_binary_expr(parser->arena, &operator, expr, right);
 	}
 
 	return expr;
 }
 
-expr_t *equality(void)
+expr_t *equality(parser_t *parser)
 {
-	expr_t *expr = comparison();
+	expr_t *expr = comparison(parser);
 
-	while (match(TOKEN_BANG_EQUAL) || match(TOKEN_EQUAL_EQUAL)) {
-		token_t *operator = previous();
-		expr_t *right = comparison();
-		expr = create_binary_expr(operator, expr, right);
+	while (match(parser, TOKEN_BANG_EQUAL) || match(parser, TOKEN_EQUAL_EQUAL)) {
+		token_t operator = *previous(parser);
+		expr_t *right = comparison(parser);
+		expr = create_binary_expr(parser->arena, &operator, expr, right);
 	}
 
 	return expr;
 }
 
-expr_t *and(void)
+expr_t *and(parser_t *parser)
 {
-	expr_t *expr = equality();
+	expr_t *expr = equality(parser);
 
-    while (match(TOKEN_AND)) {
-		token_t *operator = previous();
-		expr_t *right = equality();
-		expr = create_logical_expr(operator, expr, right);
+    while (match(parser, TOKEN_AND)) {
+		token_t operator = *previous(parser);
+		expr_t *right = equality(parser);
+		expr = create_logical_expr(parser->arena, &operator, expr, right);
     }
 
     return expr;
 }
 
-expr_t *or(void)
+expr_t *or(parser_t *parser)
 {
-	expr_t *expr = and();
+	expr_t *expr = and(parser);
 
-    while (match(TOKEN_OR)) {
-		token_t *operator = previous();
-		expr_t *right = and();
-		expr = create_logical_expr(operator, expr, right);
+    while (match(parser, TOKEN_OR)) {
+		token_t operator = *previous(parser);
+		expr_t *right = and(parser);
+		expr = create_logical_expr(parser->arena, &operator, expr, right);
     }
 
     return expr;
 }
 
-expr_t *assignment(void)
+expr_t *assignment(parser_t *parser)
 {
-	expr_t *expr = or();
+	expr_t *expr = or(parser);
 
-	if (match(TOKEN_EQUAL)) {
-		token_t *equals = previous();
-		expr_t *value = assignment();
+	if (match(parser, TOKEN_EQUAL)) {
+		token_t equals = *previous(parser);
+		expr_t *value = assignment(parser);
 
 		if (expr->type == EXPR_VARIABLE) {
-			return create_assign_expr(expr, value);
+			return create_assign_expr(parser->arena, expr, value);
 		}
-		error(equals, "Invalid assignment target.");
+		error(parser, &equals, "Invalid assignment target.");
 	}
 
     return expr;
 }
 
-expr_t *expression(void)
+expr_t *expression(parser_t *parser)
+{
+	return assignment(parser);
+}
+
+stmt_array_t *new_stmts(parser_t *parser)
 {
-	return assignment();
+	stmt_array_t *array = arena_alloc(parser->arena, sizeof(stmt_array_t));
+	array->statements = arena_alloc(parser->arena, DEFAULT_NODES_SIZE * sizeof(stmt_t *));
+	array->length = 0;
+	array->capacity = DEFAULT_NODES_SIZE;
+	return array;
 }
 
-void stmt_add(stmt_array_t *array, stmt_t *stmt)
+void stmt_add(parser_t *parser, stmt_array_t *array, stmt_t *stmt)
 {
 	if (array->length == array->capacity) {
+		array->statements = arena_grow(parser->arena, array->statements,
+				array->capacity * sizeof(stmt_t *), array->capacity * 2 * sizeof(stmt_t *));
 		array->capacity *= 2;
-		array->statements = realloc(array->statements, array->capacity * sizeof(stmt_t *));
 	}
 	array->statements[array->length++] = stmt;
 }
 
-void free_statement(stmt_t *stmt)
-{
-	if (!stmt) {
-		return;
-	}
-	switch (stmt->type) {
-		case STMT_PRINT:
-			free_expr(stmt->as.print.expression);
-			break;
-		case STMT_EXPR:
-			free_expr(stmt->as.expr.expression);
-			break;
-		case STMT_VAR:
-			free(stmt->as.variable.name.value);
-			free_expr(stmt->as.variable.initializer);
-			break;
-		case STMT_BLOCK:
-			free_statements(stmt->as.block.statements);
-			break;
-		case STMT_IF:
-			free_expr(stmt->as._if.condition);
-			free_statement(stmt->as._if.then_branch);
-			free_statement(stmt->as._if.else_branch);
-			break;
-		case STMT_WHILE:
-			free_expr(stmt->as._while.condition);
-			free_statement(stmt->as._while.body);
-			break;
-		case STMT_FUN:
-			free(stmt->as.function.name.value);
-			free_array(stmt->as.function.params);
-			free_statement(stmt->as.function.body);
-			break;
-		case STMT_RETURN:
-			free(stmt->as._return.keyword.value);
-			free_expr(stmt->as._return.value);
-			break;
-		default:
-			break;
-	}
-	free(stmt);
+/*
+ * for name in start..end body, the bounds are evaluated once
+ */
+stmt_t *range_stmt(parser_t *parser)
+{
+	token_t name = *consume(parser, TOKEN_IDENTIFIER, "Expect loop variable name.");
+	token_t *in = peek(parser);
+	if (in->type != TOKEN_IDENTIFIER || in->length != 2 || memcmp(in->start, "in", 2)) {
+		error(parser, in, "Expect 'in' after loop variable.");
+	}
+	advance(parser);
+	expr_t *start = expression(parser);
+	if (!match(parser, TOKEN_DOT_DOT) && !match(parser, TOKEN_DOT_DOT_EQUAL)) {
+		error(parser, peek(parser), "Expect '..' or '..=' in range.");
+	}
+	token_type_t operator = previous(parser)->type;
+	expr_t *end = expression(parser);
+
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
+	stmt->type = STMT_RANGE;
+	stmt->as.range.name = name;
+	stmt->as.range.start = start;
+	stmt->as.range.end = end;
+	stmt->as.range.operator = operator;
+	stmt->as.range.body = statement(parser);
+	return stmt;
 }
 
-void free_statements(stmt_array_t *array)
+stmt_t *for_stmt(parser_t *parser)
 {
-	for (int i = 0; i < array->length; i++) {
-		free_statement(array->statements[i]);
+	if (check(parser, TOKEN_IDENTIFIER)) {
+		return range_stmt(parser);
 	}
-	free(array->statements);
-	free(array);
-}
-
-stmt_t *for_stmt(void)
-{
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 	stmt_t *initializer = NULL;
-    if (match(TOKEN_SEMICOLON)) {
-    } else if (match(TOKEN_VAR)) {
-		initializer = var_declaration();
+    if (match(parser, TOKEN_SEMICOLON)) {
+    } else if (match(parser, TOKEN_VAR)) {
+		initializer = var_declaration(parser);
     } else {
-		initializer = expression_stmt();
+		initializer = expression_stmt(parser);
 	}
 
 	expr_t *condition = NULL;
-    if (!check(TOKEN_SEMICOLON)) {
-		condition = expression();
+    if (!check(parser, TOKEN_SEMICOLON)) {
+		condition = expression(parser);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 	expr_t *increment = NULL;
-    if (!check(TOKEN_RIGHT_PAREN)) {
-		increment = expression();
-    }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-	stmt_t *body = statement();
-	if (increment) {
-		stmt_t *body_incremented = malloc(sizeof(stmt_t));
-		body_incremented->type = STMT_BLOCK;
-		stmt_array_t *statements = malloc(sizeof(stmt_array_t));
-		statements->statements = malloc(DEFAULT_STMTS_SIZE * sizeof(stmt_t));
-		statements->length = 0;
-		statements->capacity = DEFAULT_STMTS_SIZE;
-		stmt_add(statements, body);
-		body_incremented->as.block.statements = statements;
-
-		stmt_t *stmt = malloc(sizeof(stmt_t));
-		stmt->type = STMT_EXPR;
-		stmt->as.expr.expression = increment;
-		stmt_add(statements, stmt);
-		body = body_incremented;
-    }
-	if (!condition) {
-		token_t tok;
-		tok.type = TOKEN_TRUE;
-		tok.value = strdup("true");
-		tok.line = -1;
-		condition = create_literal_expr(&tok);
-	}
-	stmt_t *stmt = malloc(sizeof(stmt_t));
-	stmt->type = STMT_WHILE;
-	stmt->as._while.condition = condition;
-	stmt->as._while.body = body;
-
-	body = stmt;
-
-	if (initializer) {
-		stmt_t *body_initialized = malloc(sizeof(stmt_t));
-		body_initialized->type = STMT_BLOCK;
-		stmt_array_t *statements = malloc(sizeof(stmt_array_t));
-		statements->statements = malloc(DEFAULT_STMTS_SIZE * sizeof(stmt_t));
-		statements->length = 0;
-		statements->capacity = DEFAULT_STMTS_SIZE;
-		stmt_add(statements, initializer);
-		stmt_add(statements, body);
-		body_initialized->as.block.statements = statements;
-		body = body_initialized;
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+		increment = expression(parser);
     }
-
-    return body;
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
+	stmt->type = STMT_FOR;
+	stmt->as._for.initializer = initializer;
+	stmt->as._for.condition = condition;
+	stmt->as._for.increment = increment;
+	stmt->as._for.body = statement(parser);
+    return stmt;
 }
 
-stmt_t *if_stmt(void)
+stmt_t *if_stmt(parser_t *parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-	expr_t *cond = expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
-	stmt_t *then_branch = statement();
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expr_t *cond = expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
+	stmt_t *then_branch = statement(parser);
     stmt_t *else_branch = NULL;
-    if (match(TOKEN_ELSE)) {
-		else_branch = statement();
+    if (match(parser, TOKEN_ELSE)) {
+		else_branch = statement(parser);
     }
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_IF;
 	stmt->as._if.condition = cond;
 	stmt->as._if.then_branch = then_branch;
@@ -470,219 +376,395 @@ stmt_t *if_stmt(void)
 	return stmt;
 }
 
-stmt_t *print_stmt(void)
+stmt_t *print_stmt(parser_t *parser)
 {
-	expr_t *value = expression();
-	consume(TOKEN_SEMICOLON, "Expect ; after value.");
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	expr_t *value = expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ; after value.");
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_PRINT;
 	stmt->as.print.expression = value;
 	return stmt;
 }
 
-stmt_t *return_stmt(void)
+stmt_t *return_stmt(parser_t *parser)
 {
-	token_t *keyword = previous();
+	token_t keyword = *previous(parser);
 	expr_t *value = NULL;
-	if (!check(TOKEN_SEMICOLON)) {
-		value = expression();
+	if (!check(parser, TOKEN_SEMICOLON)) {
+		value = expression(parser);
     }
 
-	consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_RETURN;
-	stmt->as._return.keyword.type = keyword->type;
-	stmt->as._return.keyword.value = strdup(keyword->value);
-	stmt->as._return.keyword.line = keyword->line;
+	stmt->as._return.keyword = keyword;
 	stmt->as._return.value = value;
     return stmt;
 }
 
-stmt_t *while_stmt(void)
+stmt_t *while_stmt(parser_t *parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expr_t *condition = expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    stmt_t *body = statement();
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expr_t *condition = expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    stmt_t *body = statement(parser);
 
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_WHILE;
 	stmt->as._while.condition = condition;
 	stmt->as._while.body = body;
 	return stmt;
 }
 
-stmt_t *block_stmt(void)
+stmt_t *block_stmt(parser_t *parser)
 {
-	stmt_array_t *statements = malloc(sizeof(stmt_array_t));
-	statements->statements = malloc(DEFAULT_STMTS_SIZE * sizeof(stmt_t));
-	statements->length = 0;
-	statements->capacity = DEFAULT_STMTS_SIZE;
+	stmt_array_t *statements = new_stmts(parser);
 
-
-    while (!check(TOKEN_RIGHT_BRACE) && !end()) {
-		stmt_add(statements, declaration());
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !end(parser)) {
+		stmt_add(parser, statements, declaration(parser));
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_BLOCK;
 	stmt->as.block.statements = statements;
 	return stmt;
 }
 
-stmt_t *expression_stmt(void)
+stmt_t *expression_stmt(parser_t *parser)
 {
-	expr_t *expr = expression();
-	consume(TOKEN_SEMICOLON, "Expect ; after expression.");
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	expr_t *expr = expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ; after expression.");
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_EXPR;
 	stmt->as.expr.expression = expr;
 	return stmt;
 }
 
-stmt_t *statement(void)
+stmt_t *statement(parser_t *parser)
 {
-	if (match(TOKEN_FOR)) {
-		return for_stmt();
+	if (match(parser, TOKEN_FOR)) {
+		return for_stmt(parser);
 	}
-	if (match(TOKEN_IF)) {
-		return if_stmt();
+	if (match(parser, TOKEN_IF)) {
+		return if_stmt(parser);
 	}
-	if (match(TOKEN_PRINT)) {
-		return print_stmt();
+	if (match(parser, TOKEN_PRINT)) {
+		return print_stmt(parser);
 	}
-	if (match(TOKEN_RETURN)) {
-		return return_stmt();
+	if (match(parser, TOKEN_RETURN)) {
+		return return_stmt(parser);
 	}
-	if (match(TOKEN_WHILE)) {
-		return while_stmt();
+	if (match(parser, TOKEN_WHILE)) {
+		return while_stmt(parser);
 	}
-	if (match(TOKEN_LEFT_BRACE)) {
-		return block_stmt();
+	if (match(parser, TOKEN_LEFT_BRACE)) {
+		return block_stmt(parser);
 	}
-	return expression_stmt();
+	return expression_stmt(parser);
 }
 
-stmt_t *function(char *kind)
+stmt_t *function(parser_t *parser, char *kind)
 {
 	char err[512];
 	snprintf(err, 512, "Expect %s name.", kind);
-	token_t *name = consume(TOKEN_IDENTIFIER, err);
+	token_t name = *consume(parser, TOKEN_IDENTIFIER, err);
 	snprintf(err, 512, "Expect '(' after %s name.", kind);
-	consume(TOKEN_LEFT_PAREN, err);
-	array_t *parameters = malloc(sizeof(array_t));
-	parameters->tokens = malloc(DEFAULT_ARGS_SIZE * sizeof(token_t));
+	consume(parser, TOKEN_LEFT_PAREN, err);
+	array_t *parameters = arena_alloc(parser->arena, sizeof(array_t));
+	parameters->tokens = arena_alloc(parser->arena, DEFAULT_NODES_SIZE * sizeof(token_t));
 	parameters->length = 0;
-	parameters->capacity = DEFAULT_ARGS_SIZE;
+	parameters->capacity = DEFAULT_NODES_SIZE;
+	parameters->source = NULL;
 
-	if (!check(TOKEN_RIGHT_PAREN)) {
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
 		do {
 			if (parameters->length >= 255) {
-				error(peek(), "Can't have more than 255 parameters.");
+				error(parser, peek(parser), "Can't have more than 255 parameters.");
 			}
 
-			token_t *param = consume(TOKEN_IDENTIFIER, "Expect parameter name.");
-			token_t param_cpy;
-			memcpy(&param_cpy, param, sizeof(token_t));
-			param_cpy.value = strdup(param->value);
-			token_add(parameters, param_cpy);
-		} while (match(TOKEN_COMMA));
+			token_t *param = consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
+			if (parameters->length == parameters->capacity) {
+				parameters->tokens = arena_grow(parser->arena, parameters->tokens,
+						parameters->capacity * sizeof(token_t),
+						parameters->capacity * 2 * sizeof(token_t));
+				parameters->capacity *= 2;
+			}
+			parameters->tokens[parameters->length++] = *param;
+		} while (match(parser, TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 	snprintf(err, 512, "Expect '{' before %s body.", kind);
-	consume(TOKEN_LEFT_BRACE, err);
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	token_t brace = *consume(parser, TOKEN_LEFT_BRACE, err);
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_FUN;
-	stmt->as.function.name.type = name->type;
-	stmt->as.function.name.value = strdup(name->value);
-	stmt->as.function.name.line = name->line;
+	stmt->as.function.name = name;
 	stmt->as.function.params = parameters;
-	stmt->as.function.body = block_stmt();
+	stmt->as.function.source = NULL;
+	/* Only a source kept in memory can be lexed again */
+	if (parser->lazy && parser->lexer->source->data) {
+		skip_body(parser, stmt, &brace);
+	} else {
+		stmt->as.function.body = block_stmt(parser);
+	}
 	return stmt;
 }
 
-stmt_t *var_declaration(void)
+/*
+ * Parse a function body only to check it, keeping where it is for
+ * parse_range(). Its nodes go to an arena of their own that is dropped
+ * straight after, so syntax errors in the body are reported now while it
+ * is only kept, flattened and resolved once it is called.
+ */
+void skip_body(parser_t *parser, stmt_t *stmt, token_t *brace)
+{
+	arena_t *arena = parser->arena;
+	jmp_buf error;
+	memcpy(error, parser->error, sizeof(jmp_buf));
+	/* Bodies in it are checked as part of it */
+	parser->lazy = 0;
+	parser->arena = arena_create();
+	if (setjmp(parser->error)) {
+		arena_free(parser->arena);
+		parser->arena = arena;
+		parser->lazy = 1;
+		memcpy(parser->error, error, sizeof(jmp_buf));
+		longjmp(parser->error, 1);
+	}
+	block_stmt(parser);
+	token_t *close = previous(parser);
+	arena_free(parser->arena);
+	parser->arena = arena;
+	parser->lazy = 1;
+	memcpy(parser->error, error, sizeof(jmp_buf));
+
+	char *data = parser->lexer->source->data;
+	stmt->as.function.body = NULL;
+	stmt->as.function.source = parser->lexer->source;
+	stmt->as.function.start = brace->start - data;
+	stmt->as.function.end = close->start + close->length - data;
+	stmt->as.function.line = brace->line;
+}
+
+/*
+ * Parse a body left by skip_body() into arena, NULL after a syntax error
+ * in it
+ */
+stmt_t *parse_range(source_t *source, size_t start, size_t end, int line, arena_t *arena)
+{
+	parser_t parser;
+	lexer_t *lexer = lexer_range(source, start, end, line);
+	parser_init(&parser, lexer, arena);
+	if (setjmp(parser.error)) {
+		lexer_close(lexer);
+		return NULL;
+	}
+	consume(&parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	stmt_t *body = block_stmt(&parser);
+	lexer_close(lexer);
+	return body;
+}
+
+stmt_t *var_declaration(parser_t *parser)
 {
-	token_t *name = consume(TOKEN_IDENTIFIER, "Expect variable name.");
+	token_t name = *consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
 
 	expr_t *initializer = NULL;
-	if (match(TOKEN_EQUAL)) {
-		initializer = expression();
+	if (match(parser, TOKEN_EQUAL)) {
+		initializer = expression(parser);
 	}
 
-	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-	stmt_t *stmt = malloc(sizeof(stmt_t));
+	stmt_t *stmt = arena_alloc(parser->arena, sizeof(stmt_t));
 	stmt->type = STMT_VAR;
-	stmt->as.variable.name.type = name->type;
-	stmt->as.variable.name.value = strdup(name->value);
-	stmt->as.variable.name.line = name->line;
+	stmt->as.variable.name = name;
 	stmt->as.variable.initializer = initializer;
 	return stmt;
 }
 
-stmt_t *declaration(void)
+stmt_t *declaration(parser_t *parser)
 {
-	if (match(TOKEN_FUN)) {
-		return function("function");
+	if (match(parser, TOKEN_FUN)) {
+		return function(parser, "function");
 	}
-	if (match(TOKEN_VAR)) {
-		return var_declaration();
+	if (match(parser, TOKEN_VAR)) {
+		return var_declaration(parser);
 	}
 
-	return statement();
+	return statement(parser);
+}
+
+/*
+ * Tokens are pulled from the lexer as the parser reaches them, lexing and
+ * parsing happen in one pass. Nodes and the strings in them are allocated
+ * from arena, which the caller frees once it is done with the program.
+ */
+void parser_init(parser_t *parser, lexer_t *lexer, arena_t *arena)
+{
+	parser->lexer = lexer;
+	parser->arena = arena;
+	parser->lazy = lazy_bodies;
+	lexer->arena = arena;
+	parser->current = 0;
+	parser->ring[0] = lexer_next(lexer);
 }
 
-stmt_array_t *parse(token_t *tks)
+/*
+ * NULL after a lexical or syntax error, which has been reported
+ */
+stmt_array_t *parse(lexer_t *lexer, arena_t *arena)
 {
-	tokens = tks;
+	parser_t parser;
+	parser_init(&parser, lexer, arena);
+	if (setjmp(parser.error)) {
+		return NULL;
+	}
+	stmt_array_t *statements = new_stmts(&parser);
+	while (!end(&parser)) {
+		stmt_add(&parser, statements, declaration(&parser));
+	}
 	if (errno == 65) {
 		return NULL;
-	} else {
-		stmt_array_t *statements = malloc(sizeof(stmt_array_t));
-		statements->statements = malloc(DEFAULT_STMTS_SIZE * sizeof(stmt_t *));
-		statements->length = 0;
-		statements->capacity = DEFAULT_STMTS_SIZE;
-		while (!end()) {
-			stmt_add(statements, declaration());
-		}
-		return statements;
 	}
+	return statements;
 }
 
-expr_t *parse_expr(token_t *tks)
+expr_t *parse_expr(lexer_t *lexer, arena_t *arena)
 {
-	tokens = tks;
+	parser_t parser;
+	parser_init(&parser, lexer, arena);
+	if (setjmp(parser.error)) {
+		return NULL;
+	}
+	expr_t *expr = expression(&parser);
+	/* Lex the rest so errors in it are still reported */
+	while (!end(&parser)) {
+		advance(&parser);
+	}
 	if (errno == 65) {
 		return NULL;
-	} else {
-		return expression();
 	}
+	return expr;
+}
+
+/*
+ * Parse the declaration at start of a source in memory, for rd lsp to go
+ * over a file one top level statement at a time. *next is set to where the
+ * one after it starts and *next_line to its line. Errors are added to
+ * diagnostics, NULL is then returned with *next past where the parser
+ * picked up again. Also NULL when only blank space and comments are left.
+ */
+stmt_t *parse_declaration(source_t *source, size_t start, int line, arena_t *arena,
+		diagnostics_t *diagnostics, size_t *next, int *next_line)
+{
+	errno = 0;
+	lexer_t *lexer = lexer_range(source, start, source->length, line);
+	lexer->diagnostics = diagnostics;
+	parser_t parser;
+	parser_init(&parser, lexer, arena);
+	stmt_t *stmt = NULL;
+	const char *first = peek(&parser)->start;
+	if (setjmp(parser.error)) {
+		/* A statement cut short by the next one leaves that one whole */
+		if (peek(&parser)->start == first || !at_statement(&parser)) {
+			synchronize(&parser);
+		}
+	} else if (!end(&parser)) {
+		stmt = declaration(&parser);
+	}
+	token_t *token = peek(&parser);
+	*next = token->type == TOKEN_EOF ? source->length : (size_t) (token->start - source->data);
+	/* Not the line of the token, that is where it ends for a string across lines */
+	*next_line = line + count_newlines(source->data + start, source->data + *next);
+	lexer_close(lexer);
+	return errno == 65 ? NULL : stmt;
 }
 
-void synchronize(void)
+void parse_file(void *arg)
 {
-	advance();
+	program_t *program = arg;
+	/* errno is per thread, clear what an earlier job on it left */
+	errno = 0;
+	lexer_t *lexer = lexer_open(program->filename);
+	if (!lexer) {
+		program->status = 1;
+		return;
+	}
+	program->source = lexer->source;
+	program->flat = cache_load(program->source, &program->root);
+	if (program->flat) {
+		lexer_close(lexer);
+		return;
+	}
+	arena_t *arena = arena_create();
+	stmt_array_t *statements = parse(lexer, arena);
+	program->status = errno == 65 ? 65 : 0;
+	if (statements) {
+		optimize_program(arena, statements, program->filename);
+		program->flat = flat_create();
+		program->root = flatten(program->flat, statements);
+		if (!resolve(program->flat, program->root)) {
+			program->status = 65;
+		} else if (!program->status) {
+			cache_store(program->source, program->flat, program->root);
+		}
+	}
+	arena_free(arena);
+	lexer_close(lexer);
+}
 
-	while (!end()) {
-		if (previous()->type == TOKEN_SEMICOLON) return;
+/*
+ * Parse every file on a pool of threads, the programs come back in the
+ * order of filenames
+ */
+program_t *parse_files(char **filenames, int count, int threads)
+{
+	program_t *programs = calloc(count, sizeof(program_t));
+	pool_t *pool = pool_create(threads > count ? count : threads);
+	for (int i = 0; i < count; i++) {
+		programs[i].filename = filenames[i];
+		pool_submit(pool, parse_file, &programs[i]);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+	return programs;
+}
 
-		switch (peek()->type) {
-			case TOKEN_CLASS:
-			case TOKEN_FUN:
-			case TOKEN_VAR:
-			case TOKEN_FOR:
-			case TOKEN_IF:
-			case TOKEN_WHILE:
-			case TOKEN_PRINT:
-			case TOKEN_RETURN:
-				return;
-			default:
-				return;
-		}
+void free_programs(program_t *programs, int count)
+{
+	for (int i = 0; i < count; i++) {
+		flat_free(programs[i].flat);
+		source_close(programs[i].source);
+	}
+	free(programs);
+}
+
+/* Whether the next token can only start a statement */
+int at_statement(parser_t *parser)
+{
+	switch (peek(parser)->type) {
+		case TOKEN_CLASS:
+		case TOKEN_FUN:
+		case TOKEN_VAR:
+		case TOKEN_FOR:
+		case TOKEN_IF:
+		case TOKEN_WHILE:
+		case TOKEN_PRINT:
+		case TOKEN_RETURN:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void synchronize(parser_t *parser)
+{
+	advance(parser);
 
-		advance();
+	while (!end(parser)) {
+		if (previous(parser)->type == TOKEN_SEMICOLON || at_statement(parser)) return;
+		advance(parser);
 	}
 }
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+void *pool_worker(void *arg)
+{
+	pool_t *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->next == pool->length && !pool->stop) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->next == pool->length) {
+			break;
+		}
+		job_t job = pool->jobs[pool->next++];
+		pool->running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		job.fn(job.arg);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->running--;
+		if (pool->next == pool->length && pool->running == 0) {
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Threads asked for by a -j argument, 0 when it is not a positive number
+ */
+int pool_jobs(const char *arg)
+{
+	char *end;
+	errno = 0;
+	long jobs = strtol(arg, &end, 10);
+	if (end == arg || *end || errno || jobs < 1 || jobs > INT_MAX) {
+		return 0;
+	}
+	return jobs;
+}
+
+/* Always at least one thread, so the jobs submitted get run */
+pool_t *pool_create(int threads)
+{
+	if (threads < 1) {
+		threads = 1;
+	}
+	pool_t *pool = malloc(sizeof(pool_t));
+	pool->threads = malloc(threads * sizeof(pthread_t));
+	pool->threads_length = threads;
+	pool->jobs = malloc(DEFAULT_JOBS_SIZE * sizeof(job_t));
+	pool->length = 0;
+	pool->capacity = DEFAULT_JOBS_SIZE;
+	pool->next = 0;
+	pool->running = 0;
+	pool->stop = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (int i = 0; i < threads; i++) {
+		pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+	}
+	return pool;
+}
+
+void pool_submit(pool_t *pool, void (*fn)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (pool->length == pool->capacity) {
+		pool->capacity *= 2;
+		pool->jobs = realloc(pool->jobs, pool->capacity * sizeof(job_t));
+	}
+	pool->jobs[pool->length].fn = fn;
+	pool->jobs[pool->length].arg = arg;
+	pool->length++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Block until every submitted job has finished
+ */
+void pool_wait(pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->length || pool->running > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pool->length = 0;
+	pool->next = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->threads_length; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->jobs);
+	free(pool->threads);
+	free(pool);
+}
@@ -4,50 +4,207 @@
 #include <errno.h>
 
 #include "ast.h"
+#include "bench.h"
+#include "cache.h"
+#include "flat.h"
 #include "interpreter.h"
 #include "lexer.h"
+#include "lsp.h"
+#include "optimize.h"
 #include "parser.h"
+#include "pool.h"
+#include "resolve.h"
+
+void usage(void)
+{
+	fprintf(stderr, "Usage: rd tokenize|parse|evaluate|run|check [-j jobs] [--lazy] "
+			"[--no-cache] [--opt-report]\n"
+			"       [--gc-stats] [--gc-threshold bytes] <filename|->...\n"
+			"       rd cache warm [-j jobs] <filename>...|clear\n"
+			"       rd lsp [--record file]\n");
+}
+
+/*
+ * rd check|run [-j jobs] <filename>...
+ * Parse every script on jobs threads, then run them one after another
+ */
+int run_files(const char *command, char **filenames, int count, int jobs)
+{
+	int run = !strcmp(command, "run");
+	if (!run && strcmp(command, "check")) {
+		usage();
+		return 1;
+	}
+	program_t *programs = parse_files(filenames, count, jobs);
+	int status = 0;
+	for (int i = 0; i < count; i++) {
+		if (programs[i].status) {
+			fprintf(stderr, "%s: could not be parsed\n", programs[i].filename);
+			status = status ? status : programs[i].status;
+		}
+	}
+	for (int i = 0; run && !status && i < count; i++) {
+		status = interpret(programs[i].flat, programs[i].root);
+	}
+	free_programs(programs, count);
+	free_symbols();
+	return status;
+}
 
 int main(int argc, char **argv)
 {
+	if (argc >= 2 && !strcmp(argv[1], "lsp")) {
+		return lsp_main(argc, argv);
+	}
 	if (argc < 3) {
-		fprintf(stderr, "Usage: rd tokenize|parse|evaluate|run <filename>\n");
+		usage();
 		return 1;
 	}
 
 	const char *command = argv[1];
 
-	array_t *array = tokenize(argv[2]);
-	if (!array) {
+	if (!strcmp(command, "bench-lex")) {
+		return bench_lex(argc, argv);
+	}
+	if (!strcmp(command, "bench-lex-parallel")) {
+		return bench_lex_parallel(argc, argv);
+	}
+	if (!strcmp(command, "bench-frontend")) {
+		return bench_frontend(argc, argv);
+	}
+	if (!strcmp(command, "bench-cache")) {
+		return bench_cache(argc, argv);
+	}
+	if (!strcmp(command, "bench-lsp")) {
+		return bench_lsp(argc, argv);
+	}
+	if (!strcmp(command, "bench-eval")) {
+		return bench_eval(argc, argv);
+	}
+	if (!strcmp(command, "cache")) {
+		return cache_command(argc, argv);
+	}
+
+	char **filenames = malloc(argc * sizeof(char *));
+	int files = 0;
+	/*
+	 * Threads to lex a single large regular file with, or to parse several
+	 * files at once
+	 */
+	int jobs = 1;
+	for (int i = 2; i < argc; i++) {
+		if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) && i + 1 < argc) {
+			if (!(jobs = pool_jobs(argv[++i]))) {
+				fprintf(stderr, "rd: -j takes a positive number of jobs, not '%s'\n", argv[i]);
+				usage();
+				free(filenames);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--lazy")) {
+			lazy_bodies = 1;
+		} else if (!strcmp(argv[i], "--no-cache")) {
+			cache_disabled = 1;
+		} else if (!strcmp(argv[i], "--gc-stats")) {
+			gc_stats = 1;
+		} else if (!strcmp(argv[i], "--gc-threshold") && i + 1 < argc) {
+			gc_threshold = strtoull(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--opt-report")) {
+			/* The report comes from the front end, which a cached program skips */
+			opt_report = 1;
+			cache_disabled = 1;
+		} else {
+			filenames[files++] = argv[i];
+		}
+	}
+	if (!files) {
+		usage();
+		free(filenames);
 		return 1;
 	}
+	if (files > 1 || !strcmp(command, "check")) {
+		int status = run_files(command, filenames, files, jobs);
+		free(filenames);
+		return status;
+	}
+	char *filename = filenames[0];
+	free(filenames);
+
 	if (!strcmp(command, "tokenize")) {
+		array_t *array = jobs > 1 ? tokenize_parallel(filename, jobs) : tokenize(filename);
+		if (!array) {
+			return 1;
+		}
 		print_tokens(array->tokens);
 		free_array(array);
-	} else if (!strcmp(command, "parse")) {
-		expr_t *expr = parse_expr(array->tokens);
+		return errno == 65 ? 65 : 0;
+	}
+
+	lexer_t *lexer = lexer_open(filename);
+	if (!lexer) {
+		return 1;
+	}
+	/* Tokens in the AST point into the source, keep it until the end */
+	source_t *source = lexer->source;
+	/* Looked up first, a cached program needs no tokens at all */
+	node_t root;
+	flat_t *cached = strcmp(command, "run") ? NULL : cache_load(source, &root);
+	array_t *array = NULL;
+	if (jobs > 1 && !cached && source->data) {
+		lexer_close(lexer);
+		source_close(source);
+		array = tokenize_parallel(filename, jobs);
+		if (!array) {
+			return 1;
+		}
+		lexer = lexer_tokens(array);
+		source = lexer->source;
+	}
+	/* The AST, freed all at once */
+	arena_t *arena = arena_create();
+	/* What is run, once the AST has been flattened into it */
+	flat_t *flat = flat_create();
+	if (!strcmp(command, "parse")) {
+		expr_t *expr = parse_expr(lexer, arena);
 		if (errno != 65) {
 			print_ast(expr);
 			printf("\n");
 		}
-		free_array(array);
-		free_expr(expr);
 	} else if (!strcmp(command, "evaluate")) {
-		expr_t *expr = parse_expr(array->tokens);
-		value_t *val = evaluate(expr, NULL);
-		print_value(val);
-		free_array(array);
-		free_expr(expr);
-	} else if (!strcmp(command, "run")) {
-		stmt_array_t *stmts = parse(array->tokens);
+		expr_t *expr = parse_expr(lexer, arena);
 		if (errno != 65) {
-			interpret(stmts);
-			free_array(array);
+			interpret_expr(flat, flatten_expr(flat, fold_expr(arena, expr)));
+		}
+	} else if (!strcmp(command, "run")) {
+		if (cached) {
+			flat_free(flat);
+			flat = cached;
+			interpret(flat, root);
+		} else {
+			stmt_array_t *stmts = parse(lexer, arena);
+			if (errno != 65) {
+				optimize_program(arena, stmts, filename);
+				root = flatten(flat, stmts);
+				arena_free(arena);
+				arena = NULL;
+				if (resolve(flat, root)) {
+					cache_store(source, flat, root);
+					interpret(flat, root);
+				}
+			}
 		}
 	} else {
 		fprintf(stderr, "Unknown command: %s\n", command);
 		return 1;
 	}
+	lexer_close(lexer);
+	arena_free(arena);
+	flat_free(flat);
+	if (array) {
+		array->source = NULL;
+		free_array(array);
+	}
+	source_close(source);
+	free_symbols();
 	if (errno == 65) {
 		return 65;
 	} else if (errno == 70) {
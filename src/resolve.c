@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat.h"
+#include "resolve.h"
+
+void resolve_stmt(resolver_t *resolver, node_t node);
+void resolve_fn(resolver_t *resolver, node_t function);
+
+void resolve_error(resolver_t *resolver, node_t expr, symbol_t *name, char *message)
+{
+	if (resolver->diagnostics) {
+		diagnostic_add(resolver->diagnostics, resolver->flat->lines[expr], 0, 0, message);
+	} else {
+		fprintf(stderr, "[line %d] at '%.*s': %s\n", resolver->flat->lines[expr],
+				name->length, name->name, message);
+	}
+	errno = 65;
+	resolver->ok = 0;
+}
+
+void push_scope(resolver_t *resolver)
+{
+	if (resolver->length == resolver->capacity) {
+		resolver->capacity *= 2;
+		resolver->scopes = realloc(resolver->scopes,
+				resolver->capacity * sizeof(local_array_t));
+	}
+	local_array_t *scope = &resolver->scopes[resolver->length++];
+	scope->locals = malloc(DEFAULT_LOCALS_SIZE * sizeof(local_t));
+	scope->length = 0;
+	scope->capacity = DEFAULT_LOCALS_SIZE;
+}
+
+/* Slots the scope ended up with */
+int pop_scope(resolver_t *resolver)
+{
+	local_array_t *scope = &resolver->scopes[--resolver->length];
+	free(scope->locals);
+	return scope->length;
+}
+
+/*
+ * Slot of name in the innermost scope, declaring it again reuses the slot
+ */
+int declare(resolver_t *resolver, symbol_t *name)
+{
+	local_array_t *scope = &resolver->scopes[resolver->length - 1];
+	for (int i = 0; i < scope->length; i++) {
+		if (scope->locals[i].name == name) {
+			scope->locals[i].defined = 0;
+			return i;
+		}
+	}
+	if (scope->length == scope->capacity) {
+		scope->capacity *= 2;
+		scope->locals = realloc(scope->locals, scope->capacity * sizeof(local_t));
+	}
+	scope->locals[scope->length].name = name;
+	scope->locals[scope->length].defined = 0;
+	return scope->length++;
+}
+
+void define(resolver_t *resolver, int slot)
+{
+	resolver->scopes[resolver->length - 1].locals[slot].defined = 1;
+}
+
+/*
+ * 0 when name is not a local of any scope around, so a global
+ */
+int lookup(resolver_t *resolver, symbol_t *name, int *depth, int *slot)
+{
+	for (int i = resolver->length - 1; i >= 0; i--) {
+		local_array_t *scope = &resolver->scopes[i];
+		for (int j = 0; j < scope->length; j++) {
+			if (scope->locals[j].name == name) {
+				*depth = resolver->length - 1 - i;
+				*slot = j;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Variables and functions declared directly in a block */
+int count_declarations(flat_t *flat, flat_stmt_t *block)
+{
+	int count = 0;
+	for (node_t i = 0; i < block->b; i++) {
+		int type = flat->stmts[flat->lists[block->a + i]].type;
+		count += type == STMT_VAR || type == STMT_FUN;
+	}
+	return count;
+}
+
+void resolve_expr(resolver_t *resolver, node_t node)
+{
+	if (!node) {
+		return;
+	}
+	flat_t *flat = resolver->flat;
+	flat_expr_t *expr = &flat->exprs[node];
+	int depth, slot;
+	switch (expr->type) {
+		case EXPR_VARIABLE: {
+			symbol_t *name = flat->names[expr->a];
+			if (lookup(resolver, name, &depth, &slot)) {
+				if (depth == 0 &&
+						!resolver->scopes[resolver->length - 1].locals[slot].defined) {
+					resolve_error(resolver, node, name,
+							"Can't read local variable in its own initializer.");
+				}
+				expr->count = depth + 1;
+				expr->a = slot;
+			}
+			break;
+		}
+
+		case EXPR_ASSIGN:
+			resolve_expr(resolver, expr->b);
+			if (lookup(resolver, flat->names[expr->a], &depth, &slot)) {
+				expr->count = depth + 1;
+				expr->a = slot;
+			}
+			break;
+
+		case EXPR_BINARY:
+		case EXPR_LOGICAL:
+			resolve_expr(resolver, expr->a);
+			resolve_expr(resolver, expr->b);
+			break;
+
+		case EXPR_UNARY:
+			resolve_expr(resolver, expr->a);
+			break;
+
+		case EXPR_CALL:
+			resolve_expr(resolver, expr->a);
+			for (int i = 0; i < expr->count; i++) {
+				resolve_expr(resolver, flat->lists[expr->b + i]);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+void resolve_stmts(resolver_t *resolver, flat_stmt_t *block)
+{
+	for (node_t i = 0; i < block->b; i++) {
+		resolve_stmt(resolver, resolver->flat->lists[block->a + i]);
+	}
+}
+
+void resolve_stmt(resolver_t *resolver, node_t node)
+{
+	if (!node) {
+		return;
+	}
+	flat_t *flat = resolver->flat;
+	flat_stmt_t *stmt = &flat->stmts[node];
+	switch (stmt->type) {
+		case STMT_BLOCK:
+			if (count_declarations(flat, stmt)) {
+				push_scope(resolver);
+				resolve_stmts(resolver, stmt);
+				stmt->c = pop_scope(resolver);
+			} else {
+				resolve_stmts(resolver, stmt);
+				stmt->c = 0;
+			}
+			break;
+
+		case STMT_EXPR:
+		case STMT_PRINT:
+		case STMT_RETURN:
+			resolve_expr(resolver, stmt->a);
+			break;
+
+		case STMT_VAR:
+			if (resolver->length) {
+				int slot = declare(resolver, flat->names[stmt->a]);
+				resolve_expr(resolver, stmt->b);
+				define(resolver, slot);
+				stmt->a = slot;
+				stmt->c = 1;
+			} else {
+				resolve_expr(resolver, stmt->b);
+			}
+			break;
+
+		case STMT_IF:
+			resolve_expr(resolver, stmt->a);
+			resolve_stmt(resolver, stmt->b);
+			resolve_stmt(resolver, stmt->c);
+			break;
+
+		case STMT_WHILE:
+			resolve_expr(resolver, stmt->a);
+			resolve_stmt(resolver, stmt->b);
+			break;
+
+		case STMT_FOR: {
+			int scoped = stmt->a && flat->stmts[stmt->a].type == STMT_VAR;
+			if (scoped) {
+				push_scope(resolver);
+			}
+			resolve_stmt(resolver, stmt->a);
+			resolve_expr(resolver, stmt->b);
+			resolve_expr(resolver, flat->lists[stmt->c]);
+			resolve_stmt(resolver, flat->lists[stmt->c + 1]);
+			if (scoped) {
+				pop_scope(resolver);
+			}
+			break;
+		}
+
+		case STMT_RANGE:
+			/* The bounds are evaluated outside the loop */
+			resolve_expr(resolver, stmt->a);
+			resolve_expr(resolver, stmt->b);
+			push_scope(resolver);
+			define(resolver, declare(resolver, flat->names[flat->lists[stmt->c]]));
+			resolve_stmt(resolver, flat->lists[stmt->c + 1]);
+			pop_scope(resolver);
+			break;
+
+		case STMT_FUN:
+			/* Defined before its body so it can call itself */
+			if (resolver->length) {
+				int slot = declare(resolver, flat->functions[stmt->a].name);
+				define(resolver, slot);
+				stmt->b = slot + 1;
+			}
+			resolve_fn(resolver, stmt->a);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Keep the locals visible from a lazy function for when its body is
+ * resolved, 0 when there are none
+ */
+node_t save_scopes(resolver_t *resolver)
+{
+	flat_t *flat = resolver->flat;
+	node_t enclosing = 0;
+	for (int i = 0; i < resolver->length; i++) {
+		local_array_t *scope = &resolver->scopes[i];
+		flat_scope_t saved = { enclosing, flat_list(flat, scope->length), scope->length };
+		for (int j = 0; j < scope->length; j++) {
+			node_t name = flat_name(flat, scope->locals[j].name);
+			flat->lists[saved.names + j] = name;
+		}
+		enclosing = flat_scope(flat, &saved);
+	}
+	return enclosing;
+}
+
+void restore_scopes(resolver_t *resolver, node_t scope)
+{
+	flat_t *flat = resolver->flat;
+	if (!scope) {
+		return;
+	}
+	flat_scope_t saved = flat->scopes[scope];
+	restore_scopes(resolver, saved.enclosing);
+	push_scope(resolver);
+	for (int i = 0; i < saved.length; i++) {
+		define(resolver, declare(resolver, flat->names[flat->lists[saved.names + i]]));
+	}
+}
+
+/*
+ * Parameters and the locals declared directly in the body share the scope
+ * of a call
+ */
+void resolve_fn(resolver_t *resolver, node_t function)
+{
+	flat_t *flat = resolver->flat;
+	flat_fn_t *fn = &flat->functions[function];
+	if (!fn->body) {
+		node_t scope = save_scopes(resolver);
+		flat->functions[function].scope = scope;
+		return;
+	}
+	flat_stmt_t *body = &flat->stmts[fn->body];
+	int scoped = fn->arity + count_declarations(flat, body) > 0;
+	if (scoped) {
+		push_scope(resolver);
+		for (int i = 0; i < fn->arity; i++) {
+			define(resolver, declare(resolver, flat->names[flat->lists[fn->params + i]]));
+		}
+	}
+	resolve_stmts(resolver, body);
+	flat->functions[function].slots = scoped ? pop_scope(resolver) : 0;
+}
+
+void resolver_init(resolver_t *resolver, flat_t *flat)
+{
+	resolver->flat = flat;
+	resolver->scopes = malloc(DEFAULT_LOCALS_SIZE * sizeof(local_array_t));
+	resolver->length = 0;
+	resolver->capacity = DEFAULT_LOCALS_SIZE;
+	resolver->ok = 1;
+	resolver->diagnostics = NULL;
+}
+
+void resolver_free(resolver_t *resolver)
+{
+	while (resolver->length) {
+		pop_scope(resolver);
+	}
+	free(resolver->scopes);
+}
+
+/*
+ * Bind every local variable under the block root to the scope and slot it
+ * lives in, so the interpreter can index them instead of looking names
+ * up. Top level names stay global. 0 after an error, which is reported.
+ */
+int resolve(flat_t *flat, node_t root)
+{
+	return resolve_report(flat, root, NULL);
+}
+
+/* resolve() adding errors to diagnostics instead of printing them */
+int resolve_report(flat_t *flat, node_t root, diagnostics_t *diagnostics)
+{
+	resolver_t resolver;
+	resolver_init(&resolver, flat);
+	resolver.diagnostics = diagnostics;
+	resolve_stmts(&resolver, &flat->stmts[root]);
+	resolver_free(&resolver);
+	return resolver.ok;
+}
+
+/*
+ * Resolve a lazy function once flat_body() has its body, in the scopes
+ * that were around its declaration
+ */
+int resolve_function(flat_t *flat, node_t function)
+{
+	resolver_t resolver;
+	resolver_init(&resolver, flat);
+	restore_scopes(&resolver, flat->functions[function].scope);
+	resolve_fn(&resolver, function);
+	resolver_free(&resolver);
+	return resolver.ok;
+}
@@ -0,0 +1,253 @@
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 32
+#define SCAN_ISA "avx2"
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *) (p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_sub(a, b) _mm256_sub_epi8(a, b)
+#define vec_min(a, b) _mm256_min_epu8(a, b)
+#define vec_mask(v) ((unsigned int) _mm256_movemask_epi8(v))
+#define VEC_ALL 0xffffffffu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+#define SCAN_ISA "sse2"
+typedef __m128i vec_t;
+#define vec_load(p) _mm_loadu_si128((const __m128i *) (p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_sub(a, b) _mm_sub_epi8(a, b)
+#define vec_min(a, b) _mm_min_epu8(a, b)
+#define vec_mask(v) ((unsigned int) _mm_movemask_epi8(v))
+#define VEC_ALL 0xffffu
+#endif
+
+int is_blank_char(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+int is_ident_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '_';
+}
+
+const char *scan_blank_scalar(const char *p, const char *end, int *lines)
+{
+	while (p < end && is_blank_char(*p)) {
+		if (*p == '\n')
+			(*lines)++;
+		p++;
+	}
+	return p;
+}
+
+const char *scan_line_scalar(const char *p, const char *end)
+{
+	while (p < end && *p != '\n')
+		p++;
+	return p;
+}
+
+const char *scan_string_scalar(const char *p, const char *end, int *lines)
+{
+	while (p < end && *p != '"') {
+		if (*p == '\n')
+			(*lines)++;
+		p++;
+	}
+	return p;
+}
+
+const char *scan_ident_scalar(const char *p, const char *end)
+{
+	while (p < end && is_ident_char(*p))
+		p++;
+	return p;
+}
+
+const char *scan_digits_scalar(const char *p, const char *end)
+{
+	while (p < end && *p >= '0' && *p <= '9')
+		p++;
+	return p;
+}
+
+const char *scan_code_scalar(const char *p, const char *end)
+{
+	while (p < end && *p != '"' && *p != '/')
+		p++;
+	return p;
+}
+
+int count_newlines_scalar(const char *p, const char *end)
+{
+	int lines = 0;
+	for (; p < end; p++)
+		lines += *p == '\n';
+	return lines;
+}
+
+#ifdef SCAN_WIDTH
+
+/*
+ * Bytes in [lo, hi], sub wraps everything below lo above hi - lo so one
+ * unsigned min and compare does both bounds
+ */
+vec_t vec_range(vec_t v, char lo, char hi)
+{
+	vec_t t = vec_sub(v, vec_set1(lo));
+	return vec_eq(vec_min(t, vec_set1(hi - lo)), t);
+}
+
+/* Mask with only the bits below the lowest set bit of mask */
+#define below_first(mask) (((mask) & -(mask)) - 1)
+
+const char *scan_blank(const char *p, const char *end, int *lines)
+{
+	vec_t space = vec_set1(' '), tab = vec_set1('\t'), nl = vec_set1('\n');
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		vec_t v = vec_load(p);
+		unsigned int newline = vec_mask(vec_eq(v, nl));
+		unsigned int stop = ~vec_mask(vec_or(vec_or(vec_eq(v, space),
+						vec_eq(v, tab)), vec_eq(v, nl))) & VEC_ALL;
+		if (stop) {
+			*lines += __builtin_popcount(newline & below_first(stop));
+			return p + __builtin_ctz(stop);
+		}
+		*lines += __builtin_popcount(newline);
+	}
+	return scan_blank_scalar(p, end, lines);
+}
+
+const char *scan_line(const char *p, const char *end)
+{
+	vec_t nl = vec_set1('\n');
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		unsigned int stop = vec_mask(vec_eq(vec_load(p), nl));
+		if (stop)
+			return p + __builtin_ctz(stop);
+	}
+	return scan_line_scalar(p, end);
+}
+
+const char *scan_string(const char *p, const char *end, int *lines)
+{
+	vec_t quote = vec_set1('"'), nl = vec_set1('\n');
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		vec_t v = vec_load(p);
+		unsigned int newline = vec_mask(vec_eq(v, nl));
+		unsigned int stop = vec_mask(vec_eq(v, quote));
+		if (stop) {
+			*lines += __builtin_popcount(newline & below_first(stop));
+			return p + __builtin_ctz(stop);
+		}
+		*lines += __builtin_popcount(newline);
+	}
+	return scan_string_scalar(p, end, lines);
+}
+
+const char *scan_ident(const char *p, const char *end)
+{
+	vec_t lower = vec_set1(0x20), underscore = vec_set1('_');
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		vec_t v = vec_load(p);
+		/* Setting 0x20 folds A-Z onto a-z and nothing else onto it */
+		vec_t ident = vec_or(vec_or(vec_range(vec_or(v, lower), 'a', 'z'),
+					vec_range(v, '0', '9')), vec_eq(v, underscore));
+		unsigned int stop = ~vec_mask(ident) & VEC_ALL;
+		if (stop)
+			return p + __builtin_ctz(stop);
+	}
+	return scan_ident_scalar(p, end);
+}
+
+const char *scan_digits(const char *p, const char *end)
+{
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		unsigned int stop = ~vec_mask(vec_range(vec_load(p), '0', '9')) & VEC_ALL;
+		if (stop)
+			return p + __builtin_ctz(stop);
+	}
+	return scan_digits_scalar(p, end);
+}
+
+const char *scan_code(const char *p, const char *end)
+{
+	vec_t quote = vec_set1('"'), slash = vec_set1('/');
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH) {
+		vec_t v = vec_load(p);
+		unsigned int stop = vec_mask(vec_or(vec_eq(v, quote), vec_eq(v, slash)));
+		if (stop)
+			return p + __builtin_ctz(stop);
+	}
+	return scan_code_scalar(p, end);
+}
+
+int count_newlines(const char *p, const char *end)
+{
+	vec_t nl = vec_set1('\n');
+	int lines = 0;
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH)
+		lines += __builtin_popcount(vec_mask(vec_eq(vec_load(p), nl)));
+	return lines + count_newlines_scalar(p, end);
+}
+
+const char *scan_isa(void)
+{
+	return SCAN_ISA;
+}
+
+#else
+
+const char *scan_blank(const char *p, const char *end, int *lines)
+{
+	return scan_blank_scalar(p, end, lines);
+}
+
+const char *scan_line(const char *p, const char *end)
+{
+	const char *nl = memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+const char *scan_string(const char *p, const char *end, int *lines)
+{
+	return scan_string_scalar(p, end, lines);
+}
+
+const char *scan_ident(const char *p, const char *end)
+{
+	return scan_ident_scalar(p, end);
+}
+
+const char *scan_digits(const char *p, const char *end)
+{
+	return scan_digits_scalar(p, end);
+}
+
+const char *scan_code(const char *p, const char *end)
+{
+	return scan_code_scalar(p, end);
+}
+
+int count_newlines(const char *p, const char *end)
+{
+	return count_newlines_scalar(p, end);
+}
+
+const char *scan_isa(void)
+{
+	return "scalar";
+}
+
+#endif
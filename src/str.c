@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "str.h"
+
+/* FNV-1a carried on from hash, a concatenation only hashes what it adds */
+unsigned int string_hash(unsigned int hash, const char *chars, int length)
+{
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char) chars[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void string_fill(string_t *string, const char *chars, int length, int refs)
+{
+	string->length = length;
+	string->refs = refs;
+	string->hash = string_hash(STRING_HASH, chars, length);
+	memcpy(string->chars, chars, length);
+	string->chars[length] = 0;
+}
+
+string_t *string_new(const char *chars, int length)
+{
+	string_t *string = malloc(sizeof(string_t) + length + 1);
+	string_fill(string, chars, length, 1);
+	return string;
+}
+
+string_t *string_arena(arena_t *arena, const char *chars, int length)
+{
+	string_t *string = arena_alloc(arena, sizeof(string_t) + length + 1);
+	string_fill(string, chars, length, 0);
+	return string;
+}
+
+/* Another reference to string, for whoever is sharing it */
+string_t *string_ref(string_t *string)
+{
+	if (string->refs) {
+		string->refs++;
+	}
+	return string;
+}
+
+void string_release(string_t *string)
+{
+	if (string->refs && !--string->refs) {
+		free(string);
+	}
+}
+
+void string_join(string_t *string, string_t *a, string_t *b, int refs)
+{
+	string->length = a->length + b->length;
+	string->refs = refs;
+	string->hash = string_hash(a->hash, b->chars, b->length);
+	memcpy(string->chars, a->chars, a->length);
+	memcpy(string->chars + a->length, b->chars, b->length);
+	string->chars[string->length] = 0;
+}
+
+string_t *string_concat(string_t *a, string_t *b)
+{
+	string_t *string = malloc(sizeof(string_t) + a->length + b->length + 1);
+	string_join(string, a, b, 1);
+	return string;
+}
+
+/* A long string out of a short one and anything, there is no hash to carry on */
+string_t *string_concat_chars(const char *a, int a_length, const char *b, int b_length)
+{
+	string_t *string = malloc(sizeof(string_t) + a_length + b_length + 1);
+	string->length = a_length + b_length;
+	string->refs = 1;
+	memcpy(string->chars, a, a_length);
+	memcpy(string->chars + a_length, b, b_length);
+	string->chars[string->length] = 0;
+	string->hash = string_hash(STRING_HASH, string->chars, string->length);
+	return string;
+}
+
+string_t *string_concat_arena(arena_t *arena, string_t *a, string_t *b)
+{
+	string_t *string = arena_alloc(arena, sizeof(string_t) + a->length + b->length + 1);
+	string_join(string, a, b, 0);
+	return string;
+}
+
+/* Shared strings are the same one, different hashes can't be equal */
+int string_equal(string_t *a, string_t *b)
+{
+	return a == b || (a->length == b->length && a->hash == b->hash &&
+			!memcmp(a->chars, b->chars, a->length));
+}
@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "str.h"
+#include "symbol.h"
+
+/* Open addressing table of symbols, capacity is a power of two */
+symbol_t **symbol_table;
+int symbol_capacity;
+/* Symbols by id */
+symbol_t **symbols;
+int symbols_length;
+/* Lexers on other threads intern too, see tokenize_parallel() */
+pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int symbol_hash(const char *start, int length)
+{
+	return string_hash(STRING_HASH, start, length);
+}
+
+void symbol_insert(symbol_t **table, int capacity, symbol_t *symbol)
+{
+	unsigned int idx = symbol->hash & (capacity - 1);
+	while (table[idx]) {
+		idx = (idx + 1) & (capacity - 1);
+	}
+	table[idx] = symbol;
+}
+
+void symbol_grow(void)
+{
+	int capacity = symbol_capacity ? symbol_capacity * 2 : DEFAULT_SYMBOLS_SIZE;
+	symbol_t **table = calloc(capacity, sizeof(symbol_t *));
+	for (int i = 0; i < symbols_length; i++) {
+		symbol_insert(table, capacity, symbols[i]);
+	}
+	free(symbol_table);
+	symbol_table = table;
+	symbol_capacity = capacity;
+	symbols = realloc(symbols, capacity / 2 * sizeof(symbol_t *));
+}
+
+/*
+ * Symbol for the name, created the first time it is seen
+ */
+symbol_t *intern(const char *start, int length)
+{
+	unsigned int hash = symbol_hash(start, length);
+	pthread_mutex_lock(&symbol_lock);
+	if (symbols_length + 1 > symbol_capacity / 2) {
+		symbol_grow();
+	}
+	unsigned int idx = hash & (symbol_capacity - 1);
+	/* Linear probing to search for the name */
+	for (symbol_t *symbol; (symbol = symbol_table[idx]);
+			idx = (idx + 1) & (symbol_capacity - 1)) {
+		if (symbol->hash == hash && symbol->length == length &&
+				!memcmp(symbol->name, start, length)) {
+			pthread_mutex_unlock(&symbol_lock);
+			return symbol;
+		}
+	}
+
+	symbol_t *symbol = malloc(sizeof(symbol_t) + length + 1);
+	symbol->id = symbols_length;
+	symbol->hash = hash;
+	symbol->length = length;
+	memcpy(symbol->name, start, length);
+	symbol->name[length] = 0;
+	symbol_table[idx] = symbol;
+	symbols[symbols_length++] = symbol;
+	pthread_mutex_unlock(&symbol_lock);
+	return symbol;
+}
+
+symbol_t *symbol_get(int id)
+{
+	pthread_mutex_lock(&symbol_lock);
+	symbol_t *symbol = symbols[id];
+	pthread_mutex_unlock(&symbol_lock);
+	return symbol;
+}
+
+int symbol_count(void)
+{
+	return symbols_length;
+}
+
+void free_symbols(void)
+{
+	for (int i = 0; i < symbols_length; i++) {
+		free(symbols[i]);
+	}
+	free(symbols);
+	free(symbol_table);
+	symbols = NULL;
+	symbol_table = NULL;
+	symbols_length = 0;
+	symbol_capacity = 0;
+}
@@ -0,0 +1,38 @@
+#include <string.h>
+
+#include "value.h"
+
+/*
+ * a followed by b as one short string, FITS_SHORT() of their lengths
+ * together. A NaN boxed value has no room for it, that one goes on the
+ * heap.
+ */
+value_t short_concat(const char *a, int a_length, const char *b, int b_length)
+{
+#ifdef NAN_BOXING
+	return STRING_VAL(string_concat_chars(a, a_length, b, b_length));
+#else
+	value_t value = { VAL_SHORT, a_length + b_length, 0, 0, { .bits = 0 } };
+	memcpy(AS_SHORT(value), a, a_length);
+	memcpy(AS_SHORT(value) + a_length, b, b_length);
+	return value;
+#endif
+}
+
+/*
+ * left followed by right, both strings of either kind. Kept out of line so
+ * taking the address of their bytes doesn't keep the values of whoever
+ * calls it in memory.
+ */
+value_t text_concat(value_t left, value_t right)
+{
+	if (FITS_SHORT(TEXT_LENGTH(left) + TEXT_LENGTH(right))) {
+		return short_concat(TEXT_CHARS(left), TEXT_LENGTH(left), TEXT_CHARS(right),
+				TEXT_LENGTH(right));
+	}
+	if (IS_STRING(left) && IS_STRING(right)) {
+		return STRING_VAL(string_concat(AS_STRING(left), AS_STRING(right)));
+	}
+	return STRING_VAL(string_concat_chars(TEXT_CHARS(left), TEXT_LENGTH(left),
+				TEXT_CHARS(right), TEXT_LENGTH(right)));
+}
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lexer.h"
+
+/* Threads, and so chunks, a source is split into */
+#define TEST_THREADS 4
+/* Bytes of a string or comment a chunk boundary is meant to land in */
+#define TEST_SPAN (PARALLEL_MIN_CHUNK * 3 / 2)
+#define TEST_MAX_SPANS 16
+
+/*
+ * Source being generated, with where its long strings and comments are so
+ * the boundaries can be checked to land in them
+ */
+typedef struct {
+	char *data;
+	size_t length;
+	size_t capacity;
+	size_t spans[TEST_MAX_SPANS][2];
+	int spans_length;
+} text_t;
+
+void test_text_init(text_t *text)
+{
+	memset(text, 0, sizeof(text_t));
+	text->capacity = PARALLEL_MIN_CHUNK;
+	text->data = malloc(text->capacity);
+}
+
+void test_text_add(text_t *text, const char *chars)
+{
+	size_t length = strlen(chars);
+	if (text->length + length > text->capacity) {
+		while (text->length + length > text->capacity) {
+			text->capacity *= 2;
+		}
+		text->data = realloc(text->data, text->capacity);
+	}
+	memcpy(text->data + text->length, chars, length);
+	text->length += length;
+}
+
+/* chars over and over until bytes more have been added */
+void test_text_fill(text_t *text, const char *chars, size_t bytes)
+{
+	size_t end = text->length + bytes;
+	while (text->length < end) {
+		test_text_add(text, chars);
+	}
+}
+
+/* Like test_text_fill(), remembering it as a span */
+void test_text_span(text_t *text, const char *chars, size_t bytes)
+{
+	text->spans[text->spans_length][0] = text->length;
+	test_text_fill(text, chars, bytes);
+	text->spans[text->spans_length++][1] = text->length;
+}
+
+/* Where split_source() starts looking for each boundary */
+int test_in_spans(text_t *text, int chunks)
+{
+	for (int i = 1; i < chunks; i++) {
+		size_t target = text->length / chunks * i;
+		int inside = 0;
+		for (int j = 0; j < text->spans_length; j++) {
+			inside = inside || (target > text->spans[j][0] && target < text->spans[j][1]);
+		}
+		if (!inside) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Tokens of filename, what went to stderr is kept in errors */
+array_t *test_tokenize(char *filename, int threads, char **errors, int *status)
+{
+	FILE *capture = tmpfile();
+	int saved = dup(STDERR_FILENO);
+	fflush(stderr);
+	dup2(fileno(capture), STDERR_FILENO);
+	errno = 0;
+	array_t *array = threads > 1 ? tokenize_parallel(filename, threads) : tokenize(filename);
+	*status = errno;
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	long length = lseek(fileno(capture), 0, SEEK_END);
+	*errors = calloc(1, length + 1);
+	if (pread(fileno(capture), *errors, length, 0) != length) {
+		**errors = 0;
+	}
+	fclose(capture);
+	return array;
+}
+
+/*
+ * Lex text one chunk at a time and on threads, the tokens, their lines and
+ * the errors and their order have to be the same
+ */
+int test_lex(const char *name, text_t *text, int threads, int errors_expected)
+{
+	char filename[] = "/tmp/rd-lex-XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1 || write(fd, text->data, text->length) != (ssize_t) text->length) {
+		fprintf(stderr, "lex: %s: could not write %s\n", name, filename);
+		return 1;
+	}
+	close(fd);
+
+	char *expected_errors, *errors;
+	int expected_status, status;
+	array_t *expected = test_tokenize(filename, 1, &expected_errors, &expected_status);
+	array_t *array = test_tokenize(filename, threads, &errors, &status);
+	int chunks = text->length / PARALLEL_MIN_CHUNK;
+	chunks = chunks < threads ? chunks : threads;
+
+	const char *failure = NULL;
+	if (!expected || !array) {
+		failure = "could not be lexed";
+	} else if (chunks < 2) {
+		failure = "too short to be split";
+	} else if (text->spans_length && !test_in_spans(text, chunks)) {
+		failure = "boundaries are not in its strings or comments";
+	} else if (!same_tokens(expected, array)) {
+		failure = "tokens differ";
+	} else if (strcmp(expected_errors, errors) || expected_status != status) {
+		failure = "errors differ";
+	} else if (errors_expected != !!*errors) {
+		failure = errors_expected ? "no errors" : "unexpected errors";
+	}
+	if (failure) {
+		printf("lex: %s with %d threads: %s\n", name, threads, failure);
+	}
+
+	if (expected) {
+		free_array(expected);
+	}
+	if (array) {
+		free_array(array);
+	}
+	free(expected_errors);
+	free(errors);
+	unlink(filename);
+	return failure != NULL;
+}
+
+int main(void)
+{
+	int failed = 0;
+	text_t text;
+
+	/* Boundaries in long strings over many lines, with // in them */
+	test_text_init(&text);
+	test_text_fill(&text, "var a = 1;\n", TEST_SPAN / 2);
+	for (int i = 0; i < TEST_THREADS; i++) {
+		test_text_add(&text, "print \"");
+		test_text_span(&text, "a line of a string // not a comment\n", TEST_SPAN);
+		test_text_add(&text, "\";\nprint a + 1;\n");
+	}
+	failed += test_lex("strings", &text, TEST_THREADS, 0);
+	free(text.data);
+
+	/* Boundaries in comments on one long line, with quotes in them */
+	test_text_init(&text);
+	test_text_fill(&text, "var b = \"b\";\n", TEST_SPAN / 2);
+	for (int i = 0; i < TEST_THREADS; i++) {
+		test_text_add(&text, "// ");
+		test_text_span(&text, "a comment with a \" in it ", TEST_SPAN);
+		test_text_add(&text, "\nprint b;\n");
+	}
+	failed += test_lex("comments", &text, TEST_THREADS, 0);
+	free(text.data);
+
+	/* Short tokens over lines everywhere, boundaries wherever they fall */
+	test_text_init(&text);
+	test_text_fill(&text, "var s = \"two\nlines // and a slash\";\n// a \"comment\n"
+			"print s + \"x\"; print \"\"; var n = 12.5 * 3;\nif (n >= 1) { print n; }\n",
+			PARALLEL_MIN_CHUNK * 5);
+	for (int threads = 2; threads <= 8; threads++) {
+		failed += test_lex("multi-line tokens", &text, threads, 0);
+	}
+	free(text.data);
+
+	/* Errors in every chunk, the last an unterminated string at the end */
+	test_text_init(&text);
+	test_text_add(&text, "var c = $;\n");
+	test_text_fill(&text, "var c = 1;\n", TEST_SPAN);
+	test_text_add(&text, "var d = @;\n");
+	test_text_fill(&text, "var d = \"d\";\n", TEST_SPAN);
+	test_text_add(&text, "var e = 1 # 2;\n");
+	test_text_fill(&text, "print c;\n", TEST_SPAN);
+	test_text_add(&text, "print \"unterminated\nstring\n");
+	failed += test_lex("errors", &text, TEST_THREADS, 1);
+	free(text.data);
+
+	free_symbols();
+	printf("lex: %s\n", failed ? "FAILED" : "ok");
+	return failed != 0;
+}
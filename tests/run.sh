@@ -0,0 +1,48 @@
+#!/bin/sh
+# Run each tests/*.rd and compare what it prints with tests/*.out: its
+# stdout, then its stderr, then "exit N" when it fails. A first line of
+# "// flags: ..." gives what to run it with. Each script is run storing
+# into an empty cache, loading from it, again with bytes of it overwritten,
+# without it and with --opt-report, whose report is left out.
+rd=${RD:-./rd}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+failed=0
+
+run() {
+	RD_CACHE_DIR="$tmp/cache" "$rd" run $flags "$@" "$script" >"$tmp/stdout" 2>"$tmp/stderr"
+	status=$?
+	cat "$tmp/stdout"
+	grep -v "^$script:" "$tmp/stderr"
+	[ $status -eq 0 ] || echo "exit $status"
+}
+
+# Overwrite bytes a quarter, half and three quarters into each cache file
+corrupt() {
+	for file in "$tmp"/cache/*.rdc; do
+		[ -f "$file" ] || continue
+		size=$(wc -c <"$file")
+		for at in $((size / 4)) $((size / 2)) $((size * 3 / 4)); do
+			printf 'XXXXXXXX' | dd of="$file" bs=1 seek=$at conv=notrunc 2>/dev/null
+		done
+	done
+}
+
+for script in tests/*.rd; do
+	flags=$(sed -n '1s|^// flags:||p' "$script")
+	rm -rf "$tmp/cache"
+	for mode in store load corrupt --no-cache --opt-report; do
+		case $mode in
+			--*) run $mode >"$tmp/actual" ;;
+			corrupt) corrupt; run >"$tmp/actual" ;;
+			*) run >"$tmp/actual" ;;
+		esac
+		if ! diff -u "${script%.rd}.out" "$tmp/actual" >"$tmp/diff"; then
+			echo "$script ($mode): FAILED"
+			cat "$tmp/diff"
+			failed=$((failed + 1))
+		fi
+	done
+done
+[ $failed -eq 0 ] && echo "scripts: ok" || echo "scripts: $failed FAILED"
+[ $failed -eq 0 ]